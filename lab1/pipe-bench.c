@@ -0,0 +1,135 @@
+// Microbenchmark for run_pipeline: how many `true | true | true` pipelines
+// per second each launcher manages, from a parent with little memory and
+// from one with a large resident heap, where fork has many page tables to
+// copy; and how many we get by posix_spawning ./pipe for each pipeline,
+// against a client of a ./pipe --serve server.
+//
+// Usage: ./pipe-bench [iterations [heap-MiB]], where a heap of 0 skips the
+// large-heap runs.
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <spawn.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "pipeline.h"
+#include "server.h"
+
+static double seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench(const char *name, enum launcher how, int iterations,
+                  size_t heap)
+{
+    char *cmds[] = {"true", "true", "true"};
+    struct pipeline_options options = {.how = how};
+    double start = seconds();
+    for (int i = 0; i < iterations; i++) {
+        if (run_pipeline(cmds, 3, &options)) {
+            fprintf(stderr, "Pipeline failed\n");
+            exit(1);
+        }
+    }
+    double elapsed = seconds() - start;
+    printf("%-6s %6zu MiB heap: %9.0f pipelines/s\n", name, heap >> 20,
+           iterations / elapsed);
+}
+
+static void bench_server(int iterations)
+{
+    char *cmds[] = {"true", "true", "true"};
+    char *pipe_argv[] = {"./pipe", "true", "true", "true", NULL};
+    struct pipeline_options options = {0};
+
+    double start = seconds();
+    for (int i = 0; i < iterations; i++) {
+        pid_t pid;
+        int status;
+        if (posix_spawn(&pid, "./pipe", NULL, NULL, pipe_argv, environ)
+            || waitpid(pid, &status, 0) < 0 || status) {
+            fprintf(stderr, "./pipe failed\n");
+            exit(1);
+        }
+    }
+    printf("%-22s: %9.0f pipelines/s\n", "one-shot ./pipe",
+           iterations / (seconds() - start));
+
+    char dir[] = "/tmp/pipe-bench-XXXXXX", path[64];
+    if (!mkdtemp(dir)) {
+        perror("Mkdtemp error");
+        exit(errno);
+    }
+    snprintf(path, sizeof(path), "%s/socket", dir);
+    // Or the server's workers print our results again when they exit.
+    fflush(stdout);
+    pid_t server = fork();
+    if (server == 0) {
+        serve(path);
+    }
+    // Wait for it to listen.
+    struct timespec tick = {.tv_nsec = 1000000};
+    while (access(path, F_OK) < 0) {
+        nanosleep(&tick, NULL);
+    }
+    nanosleep(&tick, NULL);
+
+    start = seconds();
+    for (int i = 0; i < iterations; i++) {
+        if (run_remote(path, cmds, 3, &options)) {
+            fprintf(stderr, "Pipeline failed\n");
+            exit(1);
+        }
+    }
+    printf("%-22s: %9.0f pipelines/s\n", "./pipe --serve client",
+           iterations / (seconds() - start));
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+    unlink(path);
+    rmdir(dir);
+}
+
+int main(int argc, char *argv[])
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 2000;
+    size_t heap = (argc > 2 ? strtoull(argv[2], NULL, 10) : 1024) << 20;
+    if (argc > 3 || iterations <= 0) {
+        errno = EINVAL;
+        perror("Usage: ./pipe-bench [iterations [heap-MiB]]");
+        exit(errno);
+    }
+
+    bench("fork", LAUNCH_FORK, iterations, 0);
+    bench("spawn", LAUNCH_SPAWN, iterations, 0);
+    bench_server(iterations);
+    // A heap of 0 MiB skips the large-heap runs.
+    if (heap == 0) {
+        return 0;
+    }
+
+    // Touch every page so that fork has to copy its page tables.  Small
+    // pages, as a heap of many small allocations would have.
+    char *ballast = mmap(NULL, heap, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ballast == MAP_FAILED) {
+        perror("Mmap error");
+        exit(errno);
+    }
+    madvise(ballast, heap, MADV_NOHUGEPAGE);
+    memset(ballast, 1, heap);
+    bench("fork", LAUNCH_FORK, iterations, heap);
+    bench("spawn", LAUNCH_SPAWN, iterations, heap);
+    munmap(ballast, heap);
+    return 0;
+}
@@ -1,58 +1,91 @@
-#include <fcntl.h>
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
-#include <unistd.h>
-#include <sys/wait.h>
 #include <errno.h>
+#include <getopt.h>
+#include <unistd.h>
 
-int main(int argc, char *argv[])
+#include "pipeline.h"
+#include "server.h"
+
+static void usage(void)
 {
-	if (argc < 2) {
-        errno = EINVAL;
-        perror("Error");
-        exit(errno);
+    fprintf(stderr, "Usage: ./pipe [-b pipe-size] [--stats] "
+                    "[--connect socket] stage...\n"
+                    "       ./pipe --serve socket\n");
+    exit(EINVAL);
+}
+
+// Parse a size like 1048576, 1024K or 1M.
+static int parse_size(const char *string)
+{
+    char *end;
+    errno = 0;
+    unsigned long size = strtoul(string, &end, 10);
+    switch (*end) {
+    case 'k':
+    case 'K':
+        size <<= 10;
+        end++;
+        break;
+    case 'm':
+    case 'M':
+        size <<= 20;
+        end++;
+        break;
+    }
+    if (errno || end == string || *end || size == 0 || size > 1UL << 30) {
+        usage();
     }
+    return size;
+}
 
-    int fd[2];
-    pid_t pid;
-    int in_fd = STDIN_FILENO;  // Starts with standard input
+int main(int argc, char *argv[])
+{
+    struct pipeline_options options = {.how = LAUNCH_SPAWN};
+    static const struct option long_options[] = {
+        {"stats", no_argument, NULL, 's'},
+        {"serve", required_argument, NULL, 'S'},
+        {"connect", required_argument, NULL, 'c'},
+        {0},
+    };
+    const char *serve_path = NULL, *connect_path = NULL;
+    int opt;
 
-    for (int i = 1; i < argc; i++) {
-        if (i != argc - 1 && pipe(fd) < 0) {
-            perror("Pipe creation error");
-            exit(errno);
+    // Stop at the first stage, so that stages may look like options.
+    while ((opt = getopt_long(argc, argv, "+b:s", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'b':
+            options.pipe_size = parse_size(optarg);
+            break;
+        case 's':
+            options.stats = true;
+            break;
+        case 'S':
+            serve_path = optarg;
+            break;
+        case 'c':
+            connect_path = optarg;
+            break;
+        default:
+            usage();
         }
-
-        if ((pid = fork()) < 0) {
-            perror("Fork error");
-            exit(errno);
+    }
+    if (serve_path) {
+        if (optind < argc || connect_path) {
+            usage();
         }
+        serve(serve_path);
+    }
+    if (optind >= argc) {
+        errno = EINVAL;
+        perror("Error");
+        exit(errno);
+    }
 
-        if (pid == 0) { // child
-            if (i != 1) {
-                dup2(in_fd, STDIN_FILENO);  // If not the first command, read from previous pipe
-            }
-            if (i != argc - 1) {
-                dup2(fd[1], STDOUT_FILENO);  // If not the last command, write to next pipe
-                close(fd[0]);  // Close read side as it's not used
-            }
-            close(in_fd);  // Close this as we've duplicated the descriptor we needed
-            execlp(argv[i], argv[i], (char *)NULL);
-            perror("Exec error");
-            exit(errno);
-        } else {
-            close(fd[1]);  // Close write side
-            if (i != 1) {
-                close(in_fd);  // Close the previous read descriptor
-            }
-            in_fd = fd[0];  // Update in_fd to current read end for next iteration
-        }
+    if (connect_path) {
+        return run_remote(connect_path, argv + optind, argc - optind,
+                          &options);
     }
-    int status; // to get the status of child process
-        while ((pid = wait(&status)) > 0) {
-            if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
-                exit(WEXITSTATUS(status));
-            }
-        }
-    return 0;
+    return run_pipeline(argv + optind, argc - optind, &options);
 }
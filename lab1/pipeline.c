@@ -0,0 +1,1606 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/pidfd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "pipeline.h"
+
+// The most a relay moves with one splice, tee, or read.
+#define RELAY_CHUNK (1 << 20)
+
+// The most copies of a sharded stage, and how much input @ordered gives
+// each process before it ends the chunk at the next line.
+#define MAX_SHARDS 1024
+#define SHARD_CHUNK RELAY_CHUNK
+
+// How often --stats samples the pipes.
+#define STATS_INTERVAL_NS 10000000
+
+// How long a process may go on after the reader of its output has exited,
+// before the runner sends it SIGPIPE.
+#define STOP_GRACE_NS 100000000
+
+// A parsed pipeline: a list of stages and groups.
+struct node {
+    char **words;            // a stage's program and arguments
+    struct node **branches;  // a group's branches, if words is NULL
+    int nbranches;
+    struct node *next;
+};
+
+// A relay: a thread moving data from in_fd to each of outs.  For @tee, the
+// last of them is file_fd.  It owns and closes all of them.
+struct relay {
+    const char *name;
+    int in_fd;    // -1 for a relay that gathers from ins instead
+    int *ins;
+    int nins;
+    int *outs;
+    int nouts;
+    int file_fd;  // where @tee writes its copy, or -1
+    bool meter;
+    bool deal;    // deal lines out to the outputs in turn, for @par
+    unsigned long long bytes;
+    double seconds;
+    int error;
+    pthread_t thread;
+};
+
+// A process of an @ordered stage, and the pipe its output comes out of.
+struct job {
+    pid_t pid;  // 0 once it has exited and is about to be reaped
+    int out_fd;
+};
+
+// An @ordered stage: a feeder thread cuts the input into chunks of whole
+// lines and starts a process on each, up to max at a time, and a merger
+// thread passes their outputs on in the order of the chunks and waits for
+// them.  The threads own and close in_fd and out_fd.
+struct shards {
+    const char *name;
+    char **words;
+    int in_fd;
+    int out_fd;
+    const struct pipeline_options *options;
+    struct job *jobs;  // a ring of the jobs in flight, oldest at head
+    int max;
+    int head;
+    int count;
+    bool done;         // the feeder has started its last job
+    bool stopped;      // the output has gone, so start no more jobs
+    bool finished;     // the merger has waited for the last job
+    int status;        // the first nonzero exit status of a job, or errno
+    int error;
+    struct rusage usage;  // of the jobs, summed
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    pthread_t feeder;
+    pthread_t merger;
+};
+
+// A process, relay or @ordered stage to start.
+struct stage {
+    char **words;
+    int in_fd;
+    int out_fd;
+    pid_t pid;  // -1 if not started
+    struct relay *relay;
+    struct shards *shards;
+    int pidfd;  // while it runs, or -1
+    double stop_at;  // when to send it SIGPIPE, or 0
+    bool stopped;    // the runner sent it SIGPIPE
+    bool reaped;
+    int status;
+    struct rusage usage;
+    double started;
+    double ended;
+    // With --stats, samples of how full the pipe into the stage was.
+    long long fill_total;
+    int fill_max;
+    int samples;
+    int pipe_size;
+};
+
+// The stages a pipeline is built into, in pipeline order, and the pipe ends
+// made for them, which the runner closes once everything has started.
+struct plan {
+    struct stage *stages;
+    int nstages;
+    int *fds;
+    int nfds;
+    const struct pipeline_options *options;
+    bool hung_up;  // the client has gone, and the stages were sent SIGHUP
+};
+
+static void *xrealloc(void *p, size_t size)
+{
+    p = realloc(p, size);
+    if (!p) {
+        perror("Malloc error");
+        exit(errno);
+    }
+    return p;
+}
+
+static void syntax_error(const char *near)
+{
+    fprintf(stderr, "Syntax error near '%s'\n", near);
+    exit(EINVAL);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool is_blank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n';
+}
+
+// Split ARG into a null-terminated array of words.
+static char **split_words(const char *arg)
+{
+    char **words = NULL;
+    int n = 0;
+    const char *p = arg;
+
+    for (;;) {
+        while (is_blank(*p)) {
+            p++;
+        }
+        if (!*p) {
+            break;
+        }
+        char *word = xrealloc(NULL, strlen(p) + 1), *w = word;
+        while (*p && !is_blank(*p)) {
+            if (*p == '\'') {
+                for (p++; *p && *p != '\''; ) {
+                    *w++ = *p++;
+                }
+                if (!*p++) {
+                    syntax_error(arg);
+                }
+            } else if (*p == '"') {
+                for (p++; *p && *p != '"'; ) {
+                    if (*p == '\\' && (p[1] == '"' || p[1] == '\\')) {
+                        p++;
+                    }
+                    *w++ = *p++;
+                }
+                if (!*p++) {
+                    syntax_error(arg);
+                }
+            } else {
+                if (*p == '\\' && p[1]) {
+                    p++;
+                }
+                *w++ = *p++;
+            }
+        }
+        *w = '\0';
+        words = xrealloc(words, (n + 2) * sizeof(*words));
+        words[n++] = word;
+    }
+    if (!n) {
+        syntax_error(arg);
+    }
+    words[n] = NULL;
+    return words;
+}
+
+// Parse a pipeline from ARGS[*I..N-1], up to the end, a "," or a "]".
+static struct node *parse_pipeline(char *const args[], int n, int *i)
+{
+    struct node *head = NULL, **tail = &head;
+
+    while (*i < n && strcmp(args[*i], ",") && strcmp(args[*i], "]")) {
+        struct node *node = xrealloc(NULL, sizeof(*node));
+        *node = (struct node) {0};
+        if (strcmp(args[*i], "[") == 0) {
+            for ((*i)++; ; ) {
+                node->branches = xrealloc(node->branches,
+                    (node->nbranches + 1) * sizeof(*node->branches));
+                node->branches[node->nbranches++] = parse_pipeline(args, n, i);
+                if (*i == n) {
+                    syntax_error("[");
+                }
+                if (strcmp(args[(*i)++], "]") == 0) {
+                    break;
+                }
+            }
+        } else {
+            node->words = split_words(args[(*i)++]);
+        }
+        *tail = node;
+        tail = &node->next;
+    }
+    if (!head) {
+        syntax_error(*i < n ? args[*i] : args[n - 1]);
+    }
+    return head;
+}
+
+static void free_pipeline(struct node *node)
+{
+    while (node) {
+        struct node *next = node->next;
+        for (char **w = node->words; w && *w; w++) {
+            free(*w);
+        }
+        free(node->words);
+        for (int i = 0; i < node->nbranches; i++) {
+            free_pipeline(node->branches[i]);
+        }
+        free(node->branches);
+        free(node);
+        node = next;
+    }
+}
+
+static struct relay *new_relay(const char *name, int in_fd, int nouts)
+{
+    struct relay *r = xrealloc(NULL, sizeof(*r));
+    *r = (struct relay) {.name = name, .in_fd = in_fd, .nouts = nouts,
+                         .file_fd = -1};
+    // Room for a @tee file on the end.
+    r->outs = xrealloc(NULL, (nouts + 1) * sizeof(*r->outs));
+    return r;
+}
+
+// Make the relay stage WORDS, and open its file, exiting if that fails.
+static struct relay *open_relay(char **words, int in_fd, int out_fd)
+{
+    const char *spec = words[0];
+    struct relay *r = new_relay(spec, in_fd, 1);
+    r->outs[0] = out_fd;
+    if (words[1]) {
+        syntax_error(words[1]);
+    } else if (strcmp(spec, "@meter") == 0) {
+        r->meter = true;
+    } else if (strncmp(spec, "@tee=", 5) == 0 && spec[5]) {
+        r->file_fd = open(spec + 5, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                          0666);
+        if (r->file_fd < 0) {
+            perror(spec + 5);
+            exit(errno);
+        }
+    } else {
+        fprintf(stderr, "Unknown relay: %s\n", spec);
+        exit(EINVAL);
+    }
+    return r;
+}
+
+static void add_stage(struct plan *plan, char **words, struct relay *relay,
+                      int in_fd, int out_fd)
+{
+    plan->stages = xrealloc(plan->stages,
+                            (plan->nstages + 1) * sizeof(*plan->stages));
+    plan->stages[plan->nstages++] = (struct stage) {
+        .words = words,
+        .in_fd = in_fd,
+        .out_fd = out_fd,
+        .pid = -1,
+        .relay = relay,
+        .pidfd = -1,
+    };
+}
+
+static void make_pipe(struct plan *plan, int fd[2])
+{
+    int made = plan->options->make_pipe ? plan->options->make_pipe(fd)
+                                        : pipe2(fd, O_CLOEXEC);
+    if (made < 0) {
+        perror("Pipe creation error");
+        exit(errno);
+    }
+    if (plan->options->pipe_size
+        && fcntl(fd[0], F_SETPIPE_SZ, plan->options->pipe_size) < 0) {
+        perror("Pipe size error");
+        exit(errno);
+    }
+    plan->fds = xrealloc(plan->fds, (plan->nfds + 2) * sizeof(*plan->fds));
+    plan->fds[plan->nfds++] = fd[0];
+    plan->fds[plan->nfds++] = fd[1];
+}
+
+static bool is_pipe(int fd)
+{
+    struct stat st;
+    return fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+// If WORDS is a sharded stage, @par=N or @ordered=N followed by a program
+// and its arguments, return N and set *ORDERED to match.  Otherwise 0.
+static int parse_shards(char **words, bool *ordered)
+{
+    const char *spec = words[0], *count;
+    if (strncmp(spec, "@par=", 5) == 0) {
+        count = spec + 5;
+        *ordered = false;
+    } else if (strncmp(spec, "@ordered=", 9) == 0) {
+        count = spec + 9;
+        *ordered = true;
+    } else {
+        return 0;
+    }
+    char *end;
+    long n = strtol(count, &end, 10);
+    if (end == count || *end || n < 1 || n > MAX_SHARDS || !words[1]) {
+        syntax_error(spec);
+    }
+    return n;
+}
+
+// Add the stages of the sharded stage WORDS, with N copies of the program.
+static void build_shards(struct plan *plan, char **words, int n, bool ordered,
+                         int in_fd, int out_fd)
+{
+    // Lines are found by teeing the input, so it has to be a pipe.
+    if (!is_pipe(in_fd)) {
+        int fd[2];
+        make_pipe(plan, fd);
+        struct relay *r = new_relay(words[0], in_fd, 1);
+        r->outs[0] = fd[1];
+        add_stage(plan, NULL, r, in_fd, fd[1]);
+        in_fd = fd[0];
+    }
+
+    if (ordered) {
+        struct shards *sh = xrealloc(NULL, sizeof(*sh));
+        *sh = (struct shards) {.name = words[0], .words = words + 1,
+                               .in_fd = in_fd, .out_fd = out_fd,
+                               .options = plan->options, .max = n};
+        sh->jobs = xrealloc(NULL, n * sizeof(*sh->jobs));
+        pthread_mutex_init(&sh->lock, NULL);
+        pthread_cond_init(&sh->changed, NULL);
+        add_stage(plan, words, NULL, in_fd, out_fd);
+        plan->stages[plan->nstages - 1].shards = sh;
+        return;
+    }
+
+    // Deal the lines out to a pipe per copy, and gather whole lines from a
+    // pipe per copy: copies sharing OUT_FD could split each other's lines.
+    struct relay *deal = new_relay(words[0], in_fd, n);
+    struct relay *gather = new_relay(words[0], -1, 1);
+    deal->deal = true;
+    gather->ins = xrealloc(NULL, n * sizeof(*gather->ins));
+    gather->nins = n;
+    gather->outs[0] = out_fd;
+    add_stage(plan, NULL, deal, in_fd, -1);
+    for (int i = 0; i < n; i++) {
+        int copy_in[2], copy_out[2];
+        make_pipe(plan, copy_in);
+        make_pipe(plan, copy_out);
+        deal->outs[i] = copy_in[1];
+        gather->ins[i] = copy_out[0];
+        add_stage(plan, words + 1, NULL, copy_in[0], copy_out[1]);
+    }
+    add_stage(plan, NULL, gather, -1, out_fd);
+}
+
+// Add the stages of the pipeline NODE, reading IN_FD and writing OUT_FD.
+static void build(struct plan *plan, struct node *node, int in_fd, int out_fd)
+{
+    for (; node; node = node->next) {
+        int fd[2] = {-1, out_fd}, shards;
+        bool ordered;
+        if (node->next) {
+            make_pipe(plan, fd);
+        }
+
+        if (node->words && (shards = parse_shards(node->words, &ordered))) {
+            build_shards(plan, node->words, shards, ordered, in_fd, fd[1]);
+        } else if (node->words && node->words[0][0] == '@') {
+            add_stage(plan, node->words,
+                      open_relay(node->words, in_fd, fd[1]), in_fd, fd[1]);
+        } else if (node->words) {
+            add_stage(plan, node->words, NULL, in_fd, fd[1]);
+        } else if (node->nbranches == 1) {
+            build(plan, node->branches[0], in_fd, fd[1]);
+        } else {
+            // Fan out to a pipe per branch, and fan in by sharing fd[1].
+            struct relay *r = new_relay("fan-out", in_fd, node->nbranches);
+            add_stage(plan, NULL, r, in_fd, -1);
+            for (int i = 0; i < node->nbranches; i++) {
+                int branch[2];
+                make_pipe(plan, branch);
+                r->outs[i] = branch[1];
+                build(plan, node->branches[i], branch[0], fd[1]);
+            }
+        }
+        in_fd = fd[0];
+    }
+}
+
+static int write_all(int fd, const char *buf, size_t size)
+{
+    while (size) {
+        ssize_t n = write(fd, buf, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        size -= n;
+    }
+    return 0;
+}
+
+static int read_all(int fd, char *buf, size_t size)
+{
+    while (size) {
+        ssize_t n = read(fd, buf, size);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            errno = n < 0 ? errno : EIO;
+            return -1;
+        }
+        buf += n;
+        size -= n;
+    }
+    return 0;
+}
+
+// Whether R still has a stage to pass data on to: a @tee file alone does
+// not count.
+static bool has_readers(const struct relay *r)
+{
+    return r->nouts > (r->file_fd >= 0);
+}
+
+// Whether the error from writing output K of R means its reader has gone.
+static bool reader_gone(const struct relay *r, int k)
+{
+    return errno == EPIPE && r->outs[k] != r->file_fd;
+}
+
+// Close the outputs of R marked in GONE, and take them out of outs.
+static void drop_outputs(struct relay *r, bool *gone)
+{
+    for (int k = r->nouts - 1; k >= 0; k--) {
+        if (gone[k]) {
+            close(r->outs[k]);
+            memmove(&r->outs[k], &r->outs[k + 1],
+                    (r->nouts - k - 1) * sizeof(*r->outs));
+            r->nouts--;
+        }
+        gone[k] = false;
+    }
+}
+
+// Relay through BUF.  Returns 0 at end of input, or errno: EPIPE if every
+// reader has gone.
+static int relay_copy(struct relay *r, char *buf, bool *gone)
+{
+    while (has_readers(r)) {
+        ssize_t n = read(r->in_fd, buf, RELAY_CHUNK);
+        if (n == 0) {
+            return 0;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+        for (int k = 0; k < r->nouts; k++) {
+            if (write_all(r->outs[k], buf, n) < 0) {
+                if (!reader_gone(r, k)) {
+                    return errno;
+                }
+                gone[k] = true;
+            }
+        }
+        drop_outputs(r, gone);
+        r->bytes += n;
+    }
+    return EPIPE;
+}
+
+// Relay with splice, or to several outputs, tee to all but the last and
+// splice to that.  Where tee gives an output less than the others got, or
+// splice turns down the last output, the rest goes through BUF.  Returns as
+// relay_copy does.
+static int relay_splice(struct relay *r, char *buf, ssize_t *got, bool *gone)
+{
+    while (has_readers(r)) {
+        int last = r->nouts - 1;
+        ssize_t n;
+        if (last == 0) {
+            n = splice(r->in_fd, NULL, r->outs[0], NULL, RELAY_CHUNK,
+                       SPLICE_F_MOVE);
+        } else {
+            n = tee(r->in_fd, r->outs[0], RELAY_CHUNK, 0);
+        }
+        if (n == 0) {
+            return 0;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (!reader_gone(r, 0)) {
+                return errno;
+            }
+            gone[0] = true;
+            drop_outputs(r, gone);
+            continue;
+        }
+        if (last == 0) {
+            r->bytes += n;
+            continue;
+        }
+
+        // The other outputs get the same N bytes that output 0 did.
+        bool copy = false, refused = false;
+        for (int k = 1; k < last; k++) {
+            do {
+                got[k] = tee(r->in_fd, r->outs[k], n, 0);
+            } while (got[k] < 0 && errno == EINTR);
+            if (got[k] < 0) {
+                if (!reader_gone(r, k)) {
+                    return errno;
+                }
+                gone[k] = true;
+                got[k] = n;
+            }
+            copy |= got[k] < n;
+        }
+        ssize_t moved = 0;
+        while (!copy && moved < n) {
+            ssize_t m = splice(r->in_fd, NULL, r->outs[last], NULL, n - moved,
+                               SPLICE_F_MOVE);
+            if (m < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (reader_gone(r, last)) {
+                    gone[last] = true;
+                    break;
+                }
+                // Terminals and O_APPEND files, for example.
+                if (errno == EINVAL && moved == 0) {
+                    copy = refused = true;
+                    break;
+                }
+                return errno;
+            }
+            moved += m;
+        }
+        got[last] = moved;
+
+        // Take the rest of the N bytes out of the input, and write them
+        // wherever tee or splice fell short.
+        if (moved < n) {
+            if (read_all(r->in_fd, buf + moved, n - moved) < 0) {
+                return errno;
+            }
+            for (int k = 1; k <= last; k++) {
+                if (!gone[k] && got[k] < n
+                    && write_all(r->outs[k], buf + got[k], n - got[k]) < 0) {
+                    if (!reader_gone(r, k)) {
+                        return errno;
+                    }
+                    gone[k] = true;
+                }
+            }
+        }
+        drop_outputs(r, gone);
+        r->bytes += n;
+        if (refused) {
+            return relay_copy(r, buf, gone);
+        }
+    }
+    return EPIPE;
+}
+
+// Look at what is waiting in pipe IN without taking it out, by teeing it
+// into the empty pipe SCRATCH and reading it back into BUF.  Returns how much
+// of it is whole lines, or all of it if it holds no line end, setting *WHOLE
+// to match; 0 at end of input; or -1.
+static ssize_t peek_lines(int in, int scratch[2], char *buf, bool *whole)
+{
+    ssize_t n;
+    do {
+        n = tee(in, scratch[1], RELAY_CHUNK, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+        return n;
+    }
+    if (read_all(scratch[0], buf, n) < 0) {
+        return -1;
+    }
+    char *end = memrchr(buf, '\n', n);
+    *whole = end != NULL;
+    return end ? end + 1 - buf : n;
+}
+
+// Make a pipe like IN to peek into it with.
+static int scratch_pipe(int in, int scratch[2])
+{
+    if (pipe2(scratch, O_CLOEXEC) < 0) {
+        return -1;
+    }
+    // So that tee can peek at a whole pipeful; it peeks at less otherwise.
+    int size = fcntl(in, F_GETPIPE_SZ);
+    if (size > 0) {
+        fcntl(scratch[0], F_SETPIPE_SZ, size);
+    }
+    return 0;
+}
+
+// Deal the lines of the input out to the outputs in turn, a pipeful of
+// whole lines to each, with splice.  A line longer than a pipeful goes to
+// one output in pieces.  BUF only holds a copy to find the line ends in.
+// Returns as relay_copy does.
+static int relay_deal(struct relay *r, char *buf, bool *gone)
+{
+    int scratch[2];
+    if (scratch_pipe(r->in_fd, scratch) < 0) {
+        return errno;
+    }
+    int k = 0, err = EPIPE;
+    while (r->nouts) {
+        bool whole;
+        ssize_t n = peek_lines(r->in_fd, scratch, buf, &whole);
+        if (n <= 0) {
+            err = n < 0 ? errno : 0;
+            break;
+        }
+        while (n > 0) {
+            ssize_t m = splice(r->in_fd, NULL, r->outs[k], NULL, n,
+                               SPLICE_F_MOVE);
+            if (m < 0 && errno == EINTR) {
+                continue;
+            }
+            if (m < 0) {
+                break;
+            }
+            r->bytes += m;
+            n -= m;
+        }
+        if (n > 0) {
+            // What is left goes to the next output on the next round.
+            if (errno != EPIPE) {
+                err = errno;
+                break;
+            }
+            gone[k] = true;
+            drop_outputs(r, gone);
+            k = r->nouts ? k % r->nouts : 0;
+        } else if (whole) {
+            k = (k + 1) % r->nouts;
+        }
+    }
+    close(scratch[0]);
+    close(scratch[1]);
+    return err;
+}
+
+// Move N bytes from pipe IN to OUT, through BUF where splice turns OUT down.
+static int move_all(int in, int out, size_t n, char *buf)
+{
+    while (n) {
+        ssize_t m = splice(in, NULL, out, NULL, n, SPLICE_F_MOVE);
+        if (m < 0 && errno == EINTR) {
+            continue;
+        }
+        if (m < 0 && errno == EINVAL) {
+            m = n < RELAY_CHUNK ? n : RELAY_CHUNK;
+            if (read_all(in, buf, m) < 0 || write_all(out, buf, m) < 0) {
+                return -1;
+            }
+        } else if (m < 0) {
+            return -1;
+        }
+        n -= m;
+    }
+    return 0;
+}
+
+// Gather whole lines from the inputs as they come, and move them to the
+// output.  Where an input holds only part of a line, that part is read into
+// a carry buffer of its own until the rest comes, so that lines from
+// different inputs do not interleave.  Returns as relay_copy does.
+static int relay_gather(struct relay *r, char *buf)
+{
+    struct pollfd *fds = calloc(r->nins, sizeof(*fds));
+    struct carry {
+        char *data;
+        size_t size;
+    } *carry = calloc(r->nins, sizeof(*carry));
+    int scratch[2] = {-1, -1}, live = r->nins, err = 0, out = r->outs[0];
+
+    if (!fds || !carry) {
+        err = ENOMEM;
+    } else if (scratch_pipe(r->ins[0], scratch) < 0) {
+        err = errno;
+    }
+    for (int i = 0; !err && i < r->nins; i++) {
+        fds[i] = (struct pollfd) {.fd = r->ins[i], .events = POLLIN};
+    }
+    while (!err && live) {
+        if (poll(fds, r->nins, -1) < 0) {
+            err = errno == EINTR ? 0 : errno;
+            continue;
+        }
+        for (int i = 0; !err && i < r->nins; i++) {
+            if (!fds[i].revents) {
+                continue;
+            }
+            struct carry *c = &carry[i];
+            bool whole;
+            ssize_t n = peek_lines(r->ins[i], scratch, buf, &whole);
+            if (n < 0) {
+                err = errno;
+            } else if (n > 0 && !whole) {
+                char *data = realloc(c->data, c->size + n);
+                if (!data) {
+                    err = ENOMEM;
+                } else if (read_all(r->ins[i], data + c->size, n) < 0) {
+                    err = errno;
+                }
+                c->data = data ? data : c->data;
+                c->size += n;
+            } else {
+                // Whole lines, or the end of the input and perhaps of a last
+                // line without a line end.
+                if ((c->size && write_all(out, c->data, c->size) < 0)
+                    || move_all(r->ins[i], out, n, buf) < 0) {
+                    err = errno;
+                }
+                r->bytes += c->size + n;
+                c->size = 0;
+                if (n == 0) {
+                    close(r->ins[i]);
+                    r->ins[i] = fds[i].fd = -1;
+                    live--;
+                }
+            }
+        }
+    }
+
+    if (scratch[0] >= 0) {
+        close(scratch[0]);
+        close(scratch[1]);
+    }
+    for (int i = 0; carry && i < r->nins; i++) {
+        free(carry[i].data);
+    }
+    free(carry);
+    free(fds);
+    return err;
+}
+
+static void *relay_main(void *arg)
+{
+    struct relay *r = arg;
+    double start = now();
+    char *buf = malloc(RELAY_CHUNK);
+    ssize_t *got = calloc(r->nouts, sizeof(*got));
+    bool *gone = calloc(r->nouts, sizeof(*gone));
+
+    // tee needs pipes on both sides, and splice a pipe on one side.
+    bool zero_copy = is_pipe(r->in_fd);
+    for (int k = 0; k < r->nouts - 1; k++) {
+        zero_copy = zero_copy && is_pipe(r->outs[k]);
+    }
+    if (r->nouts == 1) {
+        zero_copy = zero_copy || is_pipe(r->outs[0]);
+    }
+    int err = ENOMEM;
+    if (buf && r->ins) {
+        err = relay_gather(r, buf);
+    } else if (buf && got && gone && r->deal) {
+        err = relay_deal(r, buf, gone);
+    } else if (buf && got && gone) {
+        err = zero_copy ? relay_splice(r, buf, got, gone) : EINVAL;
+        // splice also turns down some files before it moves anything.
+        if (err == EINVAL && r->bytes == 0) {
+            err = relay_copy(r, buf, gone);
+        }
+    }
+    // Like a stage killed by SIGPIPE, a relay stops when the stages after
+    // it go away, and closing its input passes that on upstream.
+    if (err && err != EPIPE) {
+        r->error = err;
+    }
+
+    if (r->in_fd >= 0) {
+        close(r->in_fd);
+    }
+    for (int i = 0; i < r->nins; i++) {
+        if (r->ins[i] >= 0) {
+            close(r->ins[i]);
+        }
+    }
+    for (int k = 0; k < r->nouts; k++) {
+        close(r->outs[k]);
+    }
+    free(buf);
+    free(got);
+    free(gone);
+    r->seconds = now() - start;
+    return NULL;
+}
+
+static int dup_cloexec(int fd)
+{
+    int copy = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (copy < 0) {
+        perror("Dup error");
+        exit(errno);
+    }
+    return copy;
+}
+
+static void start_relay(struct relay *r)
+{
+    // The relay closes its descriptors, so give it its own copies of ours.
+    if (r->in_fd >= 0) {
+        r->in_fd = dup_cloexec(r->in_fd);
+    }
+    for (int i = 0; i < r->nins; i++) {
+        r->ins[i] = dup_cloexec(r->ins[i]);
+    }
+    for (int k = 0; k < r->nouts; k++) {
+        r->outs[k] = dup_cloexec(r->outs[k]);
+    }
+    if (r->file_fd >= 0) {
+        r->outs[r->nouts++] = r->file_fd;
+    }
+    int err = pthread_create(&r->thread, NULL, relay_main, r);
+    if (err) {
+        errno = err;
+        perror("Thread error");
+        exit(errno);
+    }
+}
+
+// Start WORDS reading IN_FD and writing OUT_FD.  All pipe ends are
+// close-on-exec, so only the two the stage needs survive into it.
+// Returns its pid, or -1 with errno set if it could not be started.
+static pid_t launch(char **words, int in_fd, int out_fd,
+                    const struct pipeline_options *options)
+{
+    pid_t pid;
+    // Where the caller knows the program to be, which saves searching PATH.
+    // If it has gone from there since, search anyway.
+    const char *path = options->resolve ? options->resolve(words[0]) : NULL;
+
+    if (options->how == LAUNCH_FORK) {
+        if ((pid = fork()) < 0) {
+            perror("Fork error");
+            exit(errno);
+        }
+        if (pid == 0) { // child
+            signal(SIGPIPE, SIG_DFL);
+            if (in_fd != STDIN_FILENO) {
+                dup2(in_fd, STDIN_FILENO);
+            }
+            if (out_fd != STDOUT_FILENO) {
+                dup2(out_fd, STDOUT_FILENO);
+            }
+            if (path) {
+                execv(path, words);
+            }
+            execvp(words[0], words);
+            perror("Exec error");
+            exit(errno);
+        }
+        return pid;
+    }
+
+    // The dup2 actions also clear close-on-exec on the new descriptors.
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (in_fd != STDIN_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+    }
+    if (out_fd != STDOUT_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+    }
+    // The runner ignores SIGPIPE while relays run; stages should not.
+    posix_spawnattr_t attr;
+    sigset_t sigpipe;
+    posix_spawnattr_init(&attr);
+    sigemptyset(&sigpipe);
+    sigaddset(&sigpipe, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &sigpipe);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+    int err = ENOENT;
+    if (path) {
+        err = posix_spawn(&pid, path, &actions, &attr, words, environ);
+    }
+    if (err == ENOENT) {
+        err = posix_spawnp(&pid, words[0], &actions, &attr, words, environ);
+    }
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return pid;
+}
+
+// Pass everything from pipe IN on to OUT, through BUF where splice turns OUT
+// down.  Returns 0 or errno.
+static int pass_on(int in, int out, char *buf)
+{
+    for (;;) {
+        ssize_t n = splice(in, NULL, out, NULL, RELAY_CHUNK, SPLICE_F_MOVE);
+        if (n == 0) {
+            return 0;
+        }
+        if (n < 0 && errno != EINTR) {
+            if (errno != EINVAL) {
+                return errno;
+            }
+            break;
+        }
+    }
+    for (;;) {
+        ssize_t n = read(in, buf, RELAY_CHUNK);
+        if (n == 0) {
+            return 0;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 || write_all(out, buf, n) < 0) {
+            return errno;
+        }
+    }
+}
+
+// Start a job of SH, once there is room for it, and return the pipe end to
+// feed it through.  Returns -1 if SH has stopped or the job could not be
+// started, setting *ERR if its pipes could not be made.
+static int start_job(struct shards *sh, int *err)
+{
+    pthread_mutex_lock(&sh->lock);
+    while (sh->count == sh->max && !sh->stopped) {
+        pthread_cond_wait(&sh->changed, &sh->lock);
+    }
+    bool stopped = sh->stopped;
+    pthread_mutex_unlock(&sh->lock);
+    if (stopped) {
+        return -1;
+    }
+
+    int in[2], out[2];
+    if (pipe2(in, O_CLOEXEC) < 0) {
+        *err = errno;
+        return -1;
+    }
+    if (pipe2(out, O_CLOEXEC) < 0) {
+        *err = errno;
+        close(in[0]);
+        close(in[1]);
+        return -1;
+    }
+    pid_t pid = launch(sh->words, in[0], out[1], sh->options);
+    int exec_error = errno;
+    close(in[0]);
+    close(out[1]);
+
+    pthread_mutex_lock(&sh->lock);
+    if (pid < 0) {
+        // Like a stage that failed to exec: the rest of the input goes
+        // nowhere.
+        fprintf(stderr, "Exec error: %s: %s\n", sh->words[0],
+                strerror(exec_error));
+        if (!sh->status) {
+            sh->status = exec_error;
+        }
+        close(in[1]);
+        close(out[0]);
+    } else {
+        sh->jobs[(sh->head + sh->count++) % sh->max] = (struct job) {
+            .pid = pid,
+            .out_fd = out[0],
+        };
+        pthread_cond_broadcast(&sh->changed);
+    }
+    pthread_mutex_unlock(&sh->lock);
+    return pid < 0 ? -1 : in[1];
+}
+
+// Cut the input of SH into chunks of at least SHARD_CHUNK bytes of whole
+// lines, and splice each into a job of its own.
+static void *feed_shards(void *arg)
+{
+    struct shards *sh = arg;
+    char *buf = malloc(RELAY_CHUNK);
+    int scratch[2] = {-1, -1}, job = -1, err = 0;
+    size_t fed = 0;
+
+    if (!buf) {
+        err = ENOMEM;
+    } else if (scratch_pipe(sh->in_fd, scratch) < 0) {
+        err = errno;
+    }
+    while (!err) {
+        bool whole;
+        ssize_t n = peek_lines(sh->in_fd, scratch, buf, &whole);
+        if (n <= 0) {
+            err = n < 0 ? errno : 0;
+            break;
+        }
+        if (job < 0 && (job = start_job(sh, &err)) < 0) {
+            break;
+        }
+        while (n > 0) {
+            ssize_t m = splice(sh->in_fd, NULL, job, NULL, n, SPLICE_F_MOVE);
+            if (m < 0 && errno == EINTR) {
+                continue;
+            }
+            if (m < 0) {
+                break;
+            }
+            fed += m;
+            n -= m;
+        }
+        if (n > 0 && errno != EPIPE) {
+            err = errno;
+        } else if (n > 0 || (whole && fed >= SHARD_CHUNK)) {
+            // Done, or the job has exited early; either way the rest of the
+            // input goes to the next one.
+            close(job);
+            job = -1;
+            fed = 0;
+        }
+    }
+
+    if (job >= 0) {
+        close(job);
+    }
+    if (scratch[0] >= 0) {
+        close(scratch[0]);
+        close(scratch[1]);
+    }
+    free(buf);
+    close(sh->in_fd);
+    pthread_mutex_lock(&sh->lock);
+    if (err && !sh->error) {
+        sh->error = err;
+    }
+    sh->done = true;
+    pthread_cond_broadcast(&sh->changed);
+    pthread_mutex_unlock(&sh->lock);
+    return NULL;
+}
+
+// Pass the outputs of the jobs of SH on in order, and wait for each.  Once
+// the output has gone, close theirs instead, which ends them with SIGPIPE.
+static void *merge_shards(void *arg)
+{
+    struct shards *sh = arg;
+    char *buf = malloc(RELAY_CHUNK);
+    int err = buf ? 0 : ENOMEM;
+
+    for (;;) {
+        pthread_mutex_lock(&sh->lock);
+        while (!sh->count && !sh->done) {
+            pthread_cond_wait(&sh->changed, &sh->lock);
+        }
+        if (!sh->count) {
+            pthread_mutex_unlock(&sh->lock);
+            break;
+        }
+        struct job job = sh->jobs[sh->head];
+        pthread_mutex_unlock(&sh->lock);
+
+        if (!err) {
+            err = pass_on(job.out_fd, sh->out_fd, buf);
+        }
+        close(job.out_fd);
+        // Wait for it to exit, but let hang_up see that it has before it
+        // is reaped and its pid can be reused.
+        siginfo_t info;
+        while (waitid(P_PID, job.pid, &info, WEXITED | WNOWAIT) < 0
+               && errno == EINTR) {
+        }
+        pthread_mutex_lock(&sh->lock);
+        sh->jobs[sh->head].pid = 0;
+        pthread_mutex_unlock(&sh->lock);
+        int status = 0;
+        struct rusage usage = {0};
+        while (wait4(job.pid, &status, 0, &usage) < 0 && errno == EINTR) {
+        }
+
+        pthread_mutex_lock(&sh->lock);
+        timeradd(&sh->usage.ru_utime, &usage.ru_utime, &sh->usage.ru_utime);
+        timeradd(&sh->usage.ru_stime, &usage.ru_stime, &sh->usage.ru_stime);
+        if (usage.ru_maxrss > sh->usage.ru_maxrss) {
+            sh->usage.ru_maxrss = usage.ru_maxrss;
+        }
+        if (WIFEXITED(status) && WEXITSTATUS(status) && !sh->status) {
+            sh->status = WEXITSTATUS(status);
+        }
+        sh->stopped = err != 0;
+        sh->head = (sh->head + 1) % sh->max;
+        sh->count--;
+        pthread_cond_broadcast(&sh->changed);
+        pthread_mutex_unlock(&sh->lock);
+    }
+
+    // Like a relay, stop quietly when the stages after this one have gone.
+    pthread_mutex_lock(&sh->lock);
+    if (err && err != EPIPE && !sh->error) {
+        sh->error = err;
+    }
+    sh->finished = true;
+    pthread_mutex_unlock(&sh->lock);
+    free(buf);
+    close(sh->out_fd);
+    return NULL;
+}
+
+static void start_shards(struct shards *sh)
+{
+    sh->in_fd = dup_cloexec(sh->in_fd);
+    sh->out_fd = dup_cloexec(sh->out_fd);
+    int err = pthread_create(&sh->feeder, NULL, feed_shards, sh);
+    if (!err) {
+        err = pthread_create(&sh->merger, NULL, merge_shards, sh);
+    }
+    if (err) {
+        errno = err;
+        perror("Thread error");
+        exit(errno);
+    }
+}
+
+// Sample how full the pipe into each running process stage of PLAN is.  The
+// runner has closed its ends of the pipes, so it opens them again through
+// /proc for a moment.
+static void sample_pipes(struct plan *plan)
+{
+    for (int i = 0; i < plan->nstages; i++) {
+        struct stage *s = &plan->stages[i];
+        if (s->pid < 0 || s->reaped) {
+            continue;
+        }
+        char path[32];
+        snprintf(path, sizeof(path), "/proc/%d/fd/0", (int) s->pid);
+        int fd = open(path, O_RDONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+        int queued;
+        if (fd < 0) {
+            continue;
+        }
+        if (is_pipe(fd) && ioctl(fd, FIONREAD, &queued) == 0) {
+            if (!s->pipe_size) {
+                s->pipe_size = fcntl(fd, F_GETPIPE_SZ);
+            }
+            s->fill_total += queued;
+            s->fill_max = queued > s->fill_max ? queued : s->fill_max;
+            s->samples++;
+        }
+        close(fd);
+    }
+}
+
+// The write end of the pipe PLAN made with read end FD, or -1.
+static int write_end(const struct plan *plan, int fd)
+{
+    for (int i = 0; i < plan->nfds; i += 2) {
+        if (plan->fds[i] == fd) {
+            return plan->fds[i + 1];
+        }
+    }
+    return -1;
+}
+
+// Stage I has exited, and with it the only reader of the pipe into it, as
+// build gives every pipe one reader.  The processes writing into that pipe
+// get SIGPIPE on their next write, but one that is busy computing, or
+// waiting on its own input, may not write for a long time.  Send it SIGPIPE
+// if it is still running after STOP_GRACE_NS; most writers have exited by
+// then, with statuses of their own.  Relays stop on their next write.
+static void stop_writers_later(struct plan *plan, int i)
+{
+    int fd = write_end(plan, plan->stages[i].in_fd);
+    for (int k = 0; fd >= 0 && k < plan->nstages; k++) {
+        struct stage *s = &plan->stages[k];
+        if (s->out_fd == fd && s->pidfd >= 0 && !s->stop_at) {
+            s->stop_at = now() + STOP_GRACE_NS / 1e9;
+        }
+    }
+}
+
+// Send SIGPIPE to the stages of PLAN whose grace is up and that have not
+// exited, even if not yet reaped.  Returns how many milliseconds until the
+// next one is due, or -1 if none is.
+static int stop_writers(struct plan *plan)
+{
+    double next = 0, t = now();
+    for (int i = 0; i < plan->nstages; i++) {
+        struct stage *s = &plan->stages[i];
+        if (!s->stop_at || s->pidfd < 0) {
+            continue;
+        }
+        if (s->stop_at > t) {
+            next = next && next < s->stop_at ? next : s->stop_at;
+            continue;
+        }
+        siginfo_t info = {0};
+        waitid(P_PID, s->pid, &info, WEXITED | WNOHANG | WNOWAIT);
+        if (!info.si_pid) {
+            s->stopped = pidfd_send_signal(s->pidfd, SIGPIPE, NULL, 0) == 0;
+        }
+        s->stop_at = 0;
+    }
+    return next ? (int) ((next - t) * 1000) + 1 : -1;
+}
+
+// Whether an @ordered stage of PLAN may still have jobs running.
+static bool shards_running(struct plan *plan)
+{
+    bool running = false;
+    for (int i = 0; i < plan->nstages && !running; i++) {
+        struct shards *sh = plan->stages[i].shards;
+        if (sh) {
+            pthread_mutex_lock(&sh->lock);
+            running = !sh->finished;
+            pthread_mutex_unlock(&sh->lock);
+        }
+    }
+    return running;
+}
+
+// The client PLAN runs for has hung up.  Send SIGHUP to every process of
+// the pipeline still running, as a terminal hanging up would, and start no
+// more @ordered jobs.
+static void hang_up(struct plan *plan)
+{
+    plan->hung_up = true;
+    for (int i = 0; i < plan->nstages; i++) {
+        struct stage *s = &plan->stages[i];
+        if (s->pidfd >= 0) {
+            pidfd_send_signal(s->pidfd, SIGHUP, NULL, 0);
+        }
+        struct shards *sh = s->shards;
+        if (!sh) {
+            continue;
+        }
+        pthread_mutex_lock(&sh->lock);
+        sh->stopped = true;
+        for (int k = 0; k < sh->count; k++) {
+            pid_t pid = sh->jobs[(sh->head + k) % sh->max].pid;
+            if (pid > 0) {
+                kill(pid, SIGHUP);
+            }
+        }
+        pthread_cond_broadcast(&sh->changed);
+        pthread_mutex_unlock(&sh->lock);
+    }
+}
+
+// Wait for the process stages of PLAN to exit, in whatever order they do,
+// through a pidfd for each in an epoll set, reaping each at once and
+// stopping the stages that were writing to it.  With --stats, sample the
+// pipes every STATS_INTERVAL_NS meanwhile.  A stage left without a pidfd,
+// on a kernel without pidfd_open, is waited for in pipeline order later.
+// The client socket, if there is one, is in the set too, as the event past
+// the last stage, and hanging up on it stops the pipeline.  It is watched
+// until the @ordered jobs are done too, checking on them every
+// STOP_GRACE_NS.
+static void supervise(struct plan *plan)
+{
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC), running = 0;
+    if (epoll_fd < 0) {
+        return;
+    }
+    for (int i = 0; i < plan->nstages; i++) {
+        struct stage *s = &plan->stages[i];
+        if (s->pid < 0 || (s->pidfd = pidfd_open(s->pid, 0)) < 0) {
+            continue;
+        }
+        struct epoll_event event = {.events = EPOLLIN, .data.u32 = i};
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, s->pidfd, &event) < 0) {
+            close(s->pidfd);
+            s->pidfd = -1;
+            continue;
+        }
+        running++;
+    }
+    int client = plan->options->client;
+    struct epoll_event hangup = {.events = EPOLLRDHUP,
+                                 .data.u32 = plan->nstages};
+    bool watch = client > 0
+                 && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client, &hangup) == 0;
+
+    int interval = plan->options->stats ? STATS_INTERVAL_NS / 1000000 : -1;
+    if (watch && shards_running(plan)
+        && (interval < 0 || interval > STOP_GRACE_NS / 1000000)) {
+        interval = STOP_GRACE_NS / 1000000;
+    }
+    int timeout = interval;
+    while (running || (watch && shards_running(plan))) {
+        struct epoll_event events[16];
+        int n = epoll_wait(epoll_fd, events, 16, timeout);
+        if (n < 0 && errno != EINTR) {
+            break;
+        }
+        for (int e = 0; e < n; e++) {
+            int i = events[e].data.u32;
+            if (i == plan->nstages) {
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client, NULL);
+                watch = false;
+                hang_up(plan);
+                continue;
+            }
+            struct stage *s = &plan->stages[i];
+            if (wait4(s->pid, &s->status, WNOHANG, &s->usage) != s->pid) {
+                continue;
+            }
+            s->reaped = true;
+            s->ended = now();
+            close(s->pidfd);
+            s->pidfd = -1;
+            running--;
+            stop_writers_later(plan, i);
+        }
+        if (plan->options->stats) {
+            sample_pipes(plan);
+        }
+        int due = stop_writers(plan);
+        timeout = due >= 0 && (interval < 0 || due < interval) ? due
+                                                               : interval;
+    }
+    close(epoll_fd);
+}
+
+// Describe how stage S ended in BUF.
+static const char *describe_status(const struct stage *s, char *buf,
+                                   size_t size)
+{
+    if (!s->reaped) {
+        return "-";
+    } else if (s->stopped && WIFSIGNALED(s->status)
+               && WTERMSIG(s->status) == SIGPIPE) {
+        return "stopped";
+    } else if (WIFSIGNALED(s->status)) {
+        snprintf(buf, size, "SIG%s", sigabbrev_np(WTERMSIG(s->status)));
+    } else {
+        snprintf(buf, size, "exit %d", WEXITSTATUS(s->status));
+    }
+    return buf;
+}
+
+static double seconds(struct timeval tv)
+{
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// How full the pipe into S was on average, from 0 to 1, or -1 if unknown.
+static double average_fill(const struct stage *s)
+{
+    if (!s->samples || s->pipe_size <= 0) {
+        return -1;
+    }
+    return (double) s->fill_total / s->samples / s->pipe_size;
+}
+
+// Print a line per stage of PLAN, and name the one that limits it: the one
+// whose input pipe was fullest, if one was mostly full, as the stages before
+// it were waiting for it to read; otherwise the one that used the most CPU,
+// as the stages after it were waiting for it to write.
+static void report_stats(const struct plan *plan)
+{
+    int limit = -1;
+    double limit_fill = 0.5, limit_cpu = -1;
+    fprintf(stderr, "%5s %8s %8s %8s %9s %9s %9s %-9s %s\n", "stage",
+            "wall s", "user s", "sys s", "RSS KiB", "in avg", "in max",
+            "status", "command");
+    for (int i = 0; i < plan->nstages; i++) {
+        const struct stage *s = &plan->stages[i];
+        double user = seconds(s->usage.ru_utime);
+        double sys = seconds(s->usage.ru_stime);
+        double fill = average_fill(s);
+        char status[32];
+        fprintf(stderr, "%5d %8.3f", i, s->ended - s->started);
+        if (s->relay) {
+            // A thread of ours: its CPU time is not its own.
+            fprintf(stderr, " %8s %8s %9s", "-", "-", "-");
+        } else {
+            fprintf(stderr, " %8.3f %8.3f %9ld", user, sys,
+                    s->usage.ru_maxrss);
+        }
+        if (fill >= 0) {
+            fprintf(stderr, " %8.0f%% %8.0f%%", 100 * fill,
+                    100.0 * s->fill_max / s->pipe_size);
+        } else {
+            fprintf(stderr, " %9s %9s", "-", "-");
+        }
+        fprintf(stderr, " %-9s", describe_status(s, status, sizeof(status)));
+        for (char **w = s->words; w && *w; w++) {
+            fprintf(stderr, " %s", *w);
+        }
+        if (!s->words) {
+            fprintf(stderr, " %s", s->relay->name);
+        }
+        fprintf(stderr, "\n");
+
+        if (fill > limit_fill) {
+            limit = i;
+            limit_fill = fill;
+        }
+        if (limit_fill == 0.5 && !s->relay && user + sys > limit_cpu) {
+            limit = i;
+            limit_cpu = user + sys;
+        }
+    }
+    if (limit < 0) {
+        return;
+    }
+    const struct stage *s = &plan->stages[limit];
+    fprintf(stderr, "Limiting stage: %d (%s): ", limit,
+            s->words ? s->words[0] : s->relay->name);
+    if (limit_fill > 0.5) {
+        fprintf(stderr, "its input pipe was %.0f%% full on average\n",
+                100 * limit_fill);
+    } else {
+        fprintf(stderr, "it used %.3f s of CPU in %.3f s\n", limit_cpu,
+                s->ended - s->started);
+    }
+}
+
+int run_pipeline(char *const args[], int n,
+                 const struct pipeline_options *options)
+{
+    // Set up everything that can fail first, so nothing is left running.
+    int next = 0;
+    struct node *pipeline = parse_pipeline(args, n, &next);
+    if (next < n) {
+        syntax_error(args[next]);
+    }
+    struct plan plan = {.options = options};
+    build(&plan, pipeline, STDIN_FILENO, STDOUT_FILENO);
+
+    bool relays = false;
+    for (int i = 0; i < plan.nstages; i++) {
+        relays = relays || plan.stages[i].relay || plan.stages[i].shards;
+    }
+    struct sigaction ignore = {.sa_handler = SIG_IGN}, old_sigpipe;
+    if (relays) {
+        sigaction(SIGPIPE, &ignore, &old_sigpipe);
+    }
+
+    int result = 0;
+    for (int i = 0; i < plan.nstages; i++) {
+        struct stage *s = &plan.stages[i];
+        s->started = now();
+        if (s->relay) {
+            start_relay(s->relay);
+            continue;
+        }
+        if (s->shards) {
+            start_shards(s->shards);
+            continue;
+        }
+        s->pid = launch(s->words, s->in_fd, s->out_fd, options);
+        if (s->pid < 0) {
+            // Like a stage that failed to exec: the next one sees EOF.
+            if (!result) {
+                result = errno;
+            }
+            fprintf(stderr, "Exec error: %s: %s\n", s->words[0],
+                    strerror(errno));
+        }
+    }
+    for (int i = 0; i < plan.nfds; i++) {
+        close(plan.fds[i]);
+    }
+
+    supervise(&plan);
+
+    for (int i = 0; i < plan.nstages; i++) {
+        struct stage *s = &plan.stages[i];
+        if (s->relay) {
+            struct relay *r = s->relay;
+            pthread_join(r->thread, NULL);
+            s->ended = s->started + r->seconds;
+            if (r->error) {
+                fprintf(stderr, "Relay error: %s: %s\n", r->name,
+                        strerror(r->error));
+                if (!result) {
+                    result = r->error;
+                }
+            }
+            if (r->meter) {
+                fprintf(stderr, "%s: %llu bytes in %.3f s, %.1f MB/s\n",
+                        r->name, r->bytes, r->seconds,
+                        r->seconds > 0 ? r->bytes / r->seconds / 1e6 : 0);
+            }
+            continue;
+        }
+        if (s->shards) {
+            struct shards *sh = s->shards;
+            pthread_join(sh->feeder, NULL);
+            pthread_join(sh->merger, NULL);
+            s->ended = now();
+            s->usage = sh->usage;
+            if (sh->error) {
+                fprintf(stderr, "Relay error: %s: %s\n", sh->name,
+                        strerror(sh->error));
+            }
+            if (!result) {
+                result = sh->error ? sh->error : sh->status;
+            }
+            continue;
+        }
+        if (s->pid < 0) {
+            continue;
+        }
+        if (!s->reaped) {
+            if (wait4(s->pid, &s->status, 0, &s->usage) < 0) {
+                continue;
+            }
+            s->reaped = true;
+            s->ended = now();
+        }
+        if (WIFEXITED(s->status) && WEXITSTATUS(s->status) != 0 && !result) {
+            result = WEXITSTATUS(s->status);
+        }
+        // As a shell does, say what killed a stage, unless it was SIGPIPE,
+        // or the SIGHUP sent once there is no client left to tell.
+        if (WIFSIGNALED(s->status) && WTERMSIG(s->status) != SIGPIPE
+            && !(plan.hung_up && WTERMSIG(s->status) == SIGHUP)) {
+            fprintf(stderr, "Stage %d: %s: %s\n", i, s->words[0],
+                    strsignal(WTERMSIG(s->status)));
+        }
+    }
+
+    if (options->stats && !plan.hung_up) {
+        report_stats(&plan);
+    }
+    for (int i = 0; i < plan.nstages; i++) {
+        struct relay *r = plan.stages[i].relay;
+        struct shards *sh = plan.stages[i].shards;
+        if (r) {
+            free(r->ins);
+            free(r->outs);
+            free(r);
+        }
+        if (sh) {
+            pthread_mutex_destroy(&sh->lock);
+            pthread_cond_destroy(&sh->changed);
+            free(sh->jobs);
+            free(sh);
+        }
+    }
+
+    if (relays) {
+        sigaction(SIGPIPE, &old_sigpipe, NULL);
+    }
+    free(plan.fds);
+    free(plan.stages);
+    free_pipeline(pipeline);
+    return result;
+}
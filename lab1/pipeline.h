@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdbool.h>
+
+// How the stages of a pipeline are started.
+enum launcher {
+    LAUNCH_SPAWN,  // posix_spawnp, which vforks: no page tables to copy
+    LAUNCH_FORK,   // fork and execvp, for comparison
+};
+
+struct pipeline_options {
+    enum launcher how;
+    int pipe_size;  // grow every pipe to this many bytes, if nonzero
+    bool stats;     // report each stage's times and input pipe on stderr
+
+    // For a server running many pipelines, or NULL.  Where to find a
+    // program, or NULL to search PATH for it; and a source of close-on-exec
+    // pipes, returning -1 with errno set like pipe2.
+    const char *(*resolve)(const char *program);
+    int (*make_pipe)(int fd[2]);
+    // For a server, the socket of the client the pipeline runs for, or 0.
+    // When the client hangs up, every process still running gets SIGHUP.
+    int client;
+};
+
+// Run the pipeline described by ARGS[0..N-1] and wait for all of it.
+//
+// Each argument is a stage: a program and its arguments, split on blanks,
+// with '...' and "..." quoting and \ escaping.  Each stage's standard output
+// feeds the next one's standard input.  A stage may instead be one of these
+// relays, run on a thread of the caller, that move the data without copying
+// it through userspace:
+//
+//   @meter       pass the data on, and report its size and rate on stderr
+//   @tee=FILE    pass the data on, and write a copy of it to FILE
+//
+// A stage "@par=N PROGRAM ARGS..." runs N copies of the program.  A relay
+// deals its input out to them in turn, a pipeful of whole lines at a time,
+// and another gathers whole lines from their outputs in the order they come.
+// "@ordered=N PROGRAM ARGS..." instead cuts its input into chunks of whole
+// lines, runs a process on each, up to N at a time, and passes their outputs
+// on in the order of the chunks.
+//
+// The arguments "[", "," and "]" make a group of branches, each a pipeline
+// of its own: "[ a b , c ]".  Every branch gets a copy of the group's input
+// and runs concurrently with the others.  Their outputs are merged into the
+// group's output in whatever order they write it.
+//
+// Every stage is waited for as soon as it exits.  The processes writing
+// into the pipe of a stage that has exited are sent SIGPIPE if they are
+// still running a moment later, without waiting for their next write.
+//
+// Returns the first nonzero exit status in pipeline order, or errno for a
+// stage that could not be started or a relay that failed, or 0.  Exits with
+// EINVAL on a syntax error, or errno if the pipes or files cannot be set up,
+// before starting anything.
+int run_pipeline(char *const args[], int n,
+                 const struct pipeline_options *options);
@@ -0,0 +1,471 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "server.h"
+
+// How many workers may wait for requests, how many pipes each makes while it
+// waits, and how many programs the path cache holds.
+#define IDLE_WORKERS 4
+#define POOL_PIPES 32
+#define CACHE_ENTRIES 256
+
+// How often the server reaps workers and checks that one is waiting when no
+// worker asks it for another.
+#define REAP_INTERVAL_MS 1000
+
+// The most argument bytes a request may carry.
+#define MAX_REQUEST_SIZE (1 << 20)
+
+// A request: this, with the client's working directory, standard input,
+// output and error as SCM_RIGHTS, then SIZE bytes of NARGS arguments, each
+// ending in '\0'.  The reply is the pipeline's exit status, an int32_t.
+struct request {
+    uint32_t nargs;
+    uint32_t size;
+    int32_t pipe_size;
+    uint8_t stats;
+};
+
+#define REQUEST_FDS 4
+
+// Where programs were found on PATH, in memory shared by the workers.
+// Entries are only ever added, so a worker may keep a pointer to one.
+struct path_cache {
+    pthread_mutex_t lock;
+    int count;
+    struct {
+        char program[64];
+        char path[256];
+    } entries[CACHE_ENTRIES];
+};
+
+static struct path_cache *cache;
+static atomic_int *idle;  // workers waiting in accept, shared
+static int pool[POOL_PIPES][2];
+static int pooled;
+static int connection = -1;  // the worker's client, while it has one
+static int home[REQUEST_FDS];  // the server's directory, stdin, out and err
+
+// Like write_all, but a server that has gone away gives EPIPE, not SIGPIPE.
+static int send_all(int fd, const void *buf, size_t size)
+{
+    const char *p = buf;
+    while (size) {
+        ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+static int read_all(int fd, void *buf, size_t size)
+{
+    char *p = buf;
+    while (size) {
+        ssize_t n = read(fd, p, size);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            errno = n < 0 ? errno : EPIPE;
+            return -1;
+        }
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+static void socket_address(const char *path, struct sockaddr_un *addr)
+{
+    *addr = (struct sockaddr_un) {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        errno = ENAMETOOLONG;
+        perror(path);
+        exit(errno);
+    }
+    strcpy(addr->sun_path, path);
+}
+
+static void lock_cache(void)
+{
+    // A worker killed while holding the lock leaves the cache as it was
+    // before it, as it only adds an entry by bumping count last.
+    if (pthread_mutex_lock(&cache->lock) == EOWNERDEAD) {
+        pthread_mutex_consistent(&cache->lock);
+    }
+}
+
+static bool executable(const char *path)
+{
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISREG(st.st_mode)
+           && access(path, X_OK) == 0;
+}
+
+// Where PROGRAM is on PATH, from the cache or found and added to it, or
+// NULL to let the launcher search.
+static const char *resolve(const char *program)
+{
+    // Names with a slash are not searched for.  A search that comes to a
+    // cwd-relative PATH entry before finding the program is left to the
+    // launcher, in the client's directory, and not cached; so an entry is
+    // only cached if every entry before it is absolute.
+    if (strchr(program, '/')
+        || strlen(program) >= sizeof(cache->entries[0].program)) {
+        return NULL;
+    }
+    lock_cache();
+    for (int i = 0; i < cache->count; i++) {
+        if (strcmp(cache->entries[i].program, program) == 0) {
+            pthread_mutex_unlock(&cache->lock);
+            return cache->entries[i].path;
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    char path[sizeof(cache->entries[0].path)] = "";
+    for (const char *dir = getenv("PATH"); !path[0]; ) {
+        // Stop at a relative or empty entry, which means the current
+        // directory, or at the end of PATH.
+        if (!dir || *dir != '/') {
+            return NULL;
+        }
+        size_t len = strcspn(dir, ":");
+        int n = snprintf(path, sizeof(path), "%.*s/%s", (int) len, dir,
+                         program);
+        // Too long to cache: let the launcher search from here.
+        if (n >= (int) sizeof(path)) {
+            return NULL;
+        }
+        if (!executable(path)) {
+            path[0] = '\0';
+        }
+        dir += len + (dir[len] == ':');
+    }
+
+    const char *found = NULL;
+    lock_cache();
+    for (int i = 0; i < cache->count && !found; i++) {
+        if (strcmp(cache->entries[i].program, program) == 0) {
+            found = cache->entries[i].path;
+        }
+    }
+    if (!found && cache->count < CACHE_ENTRIES) {
+        strcpy(cache->entries[cache->count].program, program);
+        strcpy(cache->entries[cache->count].path, path);
+        found = cache->entries[cache->count++].path;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return found;
+}
+
+// Make pipes for this worker, while no request is waiting on them.
+static void fill_pool(void)
+{
+    while (pooled < POOL_PIPES && pipe2(pool[pooled], O_CLOEXEC) == 0) {
+        pooled++;
+    }
+}
+
+static int pool_pipe(int fd[2])
+{
+    if (!pooled) {
+        return pipe2(fd, O_CLOEXEC);
+    }
+    pooled--;
+    fd[0] = pool[pooled][0];
+    fd[1] = pool[pooled][1];
+    return 0;
+}
+
+// Send STATUS to the worker's client, if it has one, and let it go.  Also
+// run if the worker exits: run_pipeline exits on a syntax error, for one.
+static void reply(int status, void *arg)
+{
+    (void) arg;
+    int32_t result = status;
+    if (connection >= 0) {
+        send(connection, &result, sizeof(result), MSG_NOSIGNAL);
+        close(connection);
+        connection = -1;
+    }
+}
+
+// Read a request from CONN into REQ and FDS, exiting if that fails.
+static void receive_request(int conn, struct request *req, int fds[])
+{
+    char control[CMSG_SPACE(REQUEST_FDS * sizeof(int))];
+    struct iovec iov = {.iov_base = req, .iov_len = sizeof(*req)};
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    ssize_t n;
+    do {
+        n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+    } while (n < 0 && errno == EINTR);
+    struct cmsghdr *cmsg = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (n < 0) {
+        perror("Request error");
+        exit(errno);
+    }
+    if (n != sizeof(*req) || !cmsg || cmsg->cmsg_type != SCM_RIGHTS
+        || cmsg->cmsg_len != CMSG_LEN(REQUEST_FDS * sizeof(int))
+        || req->nargs == 0 || req->nargs > req->size
+        || req->size > MAX_REQUEST_SIZE) {
+        fprintf(stderr, "Request error: malformed request\n");
+        exit(EPROTO);
+    }
+    memcpy(fds, CMSG_DATA(cmsg), REQUEST_FDS * sizeof(int));
+}
+
+// Run the request on CONN in this worker, and return its exit status with
+// the worker back in the server's directory, with the server's stdio.
+static int work(int conn)
+{
+    struct request req;
+    int fds[REQUEST_FDS];
+    receive_request(conn, &req, fds);
+
+    char *buf = malloc(req.size);
+    char **args = calloc(req.nargs, sizeof(*args));
+    if (!buf || !args) {
+        perror("Malloc error");
+        exit(errno);
+    }
+    if (read_all(conn, buf, req.size) < 0) {
+        perror("Request error");
+        exit(errno);
+    }
+    char *p = buf, *end = buf + req.size;
+    for (uint32_t i = 0; i < req.nargs; i++) {
+        char *nul = memchr(p, '\0', end - p);
+        if (!nul) {
+            fprintf(stderr, "Request error: malformed request\n");
+            exit(EPROTO);
+        }
+        args[i] = p;
+        p = nul + 1;
+    }
+
+    if (fchdir(fds[0]) < 0) {
+        perror("Chdir error");
+        exit(errno);
+    }
+    for (int i = 1; i < REQUEST_FDS; i++) {
+        dup2(fds[i], i - 1);
+    }
+    for (int i = 0; i < REQUEST_FDS; i++) {
+        if (fds[i] > STDERR_FILENO) {
+            close(fds[i]);
+        }
+    }
+
+    struct pipeline_options options = {
+        .how = LAUNCH_SPAWN,
+        .pipe_size = req.pipe_size,
+        .stats = req.stats,
+        .resolve = resolve,
+        .make_pipe = pool_pipe,
+        .client = conn,
+    };
+    int status = run_pipeline(args, req.nargs, &options);
+    free(args);
+    free(buf);
+
+    fflush(NULL);
+    fchdir(home[0]);
+    for (int i = 1; i < REQUEST_FDS; i++) {
+        dup2(home[i], i - 1);
+    }
+    return status;
+}
+
+// Fork a worker, counted as idle.  It makes its pipes, waits for a request
+// on LISTEN_FD and runs it, then waits for another, unless enough others are
+// waiting: so requests one after another need no fork.  The last idle worker
+// to take a request writes to TAKEN for the server to start another.  An idle
+// worker dies with the server, a busy one finishes its request first.
+static void start_worker(int listen_fd, int taken)
+{
+    pid_t server = getpid();
+    atomic_fetch_add(idle, 1);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Fork error");
+        atomic_fetch_sub(idle, 1);
+    }
+    if (pid != 0) {
+        return;
+    }
+
+    on_exit(reply, NULL);
+    for (;;) {
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (getppid() != server) {
+            atomic_fetch_sub(idle, 1);
+            exit(0);
+        }
+        fill_pool();
+        int conn;
+        do {
+            conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        } while (conn < 0 && (errno == EINTR || errno == ECONNABORTED));
+        if (conn < 0) {
+            perror("Accept error");
+            atomic_fetch_sub(idle, 1);
+            exit(errno);
+        }
+        prctl(PR_SET_PDEATHSIG, 0);
+        if (atomic_fetch_sub(idle, 1) == 1) {
+            write(taken, "", 1);
+        }
+        connection = conn;
+        reply(work(conn), NULL);
+        if (atomic_fetch_add(idle, 1) >= IDLE_WORKERS) {
+            atomic_fetch_sub(idle, 1);
+            exit(0);
+        }
+    }
+}
+
+void serve(const char *path)
+{
+    cache = mmap(NULL, sizeof(*cache), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    idle = mmap(NULL, sizeof(*idle), PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (cache == MAP_FAILED || idle == MAP_FAILED) {
+        perror("Mmap error");
+        exit(errno);
+    }
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&cache->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    struct sockaddr_un addr;
+    socket_address(path, &addr);
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    unlink(path);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *) &addr,
+                              sizeof(addr)) < 0
+        || listen(listen_fd, SOMAXCONN) < 0) {
+        perror(path);
+        exit(errno);
+    }
+
+    // The server's own directory and stdio, for workers to go back to.
+    home[0] = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    for (int i = 1; i < REQUEST_FDS; i++) {
+        home[i] = fcntl(i - 1, F_DUPFD_CLOEXEC, REQUEST_FDS);
+    }
+    int taken[2];
+    if (home[0] < 0 || pipe2(taken, O_CLOEXEC) < 0) {
+        perror("Serve error");
+        exit(errno);
+    }
+    for (int i = 0; i < IDLE_WORKERS; i++) {
+        start_worker(listen_fd, taken[1]);
+    }
+    for (;;) {
+        struct pollfd pfd = {.fd = taken[0], .events = POLLIN};
+        char c;
+        if (poll(&pfd, 1, REAP_INTERVAL_MS) > 0) {
+            read(taken[0], &c, 1);
+        }
+        while (waitpid(-1, NULL, WNOHANG) > 0) {
+        }
+        // Start a worker if none is waiting: the last one took a request,
+        // or the fork for it failed last time.
+        if (atomic_load(idle) < 1) {
+            start_worker(listen_fd, taken[1]);
+        }
+    }
+}
+
+int run_remote(const char *path, char *const args[], int n,
+               const struct pipeline_options *options)
+{
+    struct sockaddr_un addr;
+    socket_address(path, &addr);
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0
+        || connect(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "Connect error: %s: %s\n", path, strerror(errno));
+        return errno;
+    }
+
+    struct request req = {
+        .nargs = n,
+        .pipe_size = options->pipe_size,
+        .stats = options->stats,
+    };
+    for (int i = 0; i < n; i++) {
+        req.size += strlen(args[i]) + 1;
+    }
+    int cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    int fds[REQUEST_FDS] = {cwd, STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    char control[CMSG_SPACE(sizeof(fds))] = {0};
+    struct iovec iov = {.iov_base = &req, .iov_len = sizeof(req)};
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    int32_t status;
+    int err = 0;
+    if (cwd < 0 || sendmsg(sock, &msg, MSG_NOSIGNAL) != sizeof(req)) {
+        err = errno;
+    }
+    for (int i = 0; !err && i < n; i++) {
+        if (send_all(sock, args[i], strlen(args[i]) + 1) < 0) {
+            err = errno;
+        }
+    }
+    if (!err && read_all(sock, &status, sizeof(status)) < 0) {
+        err = errno;
+    }
+    if (err) {
+        fprintf(stderr, "Server error: %s: %s\n", path, strerror(err));
+    }
+    if (cwd >= 0) {
+        close(cwd);
+    }
+    close(sock);
+    return err ? err : status;
+}
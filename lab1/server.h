@@ -0,0 +1,20 @@
+#pragma once
+
+#include "pipeline.h"
+
+// Serve pipelines on a Unix socket at PATH, replacing whatever is there, and
+// never return.  Each request runs in one of a pool of worker processes
+// forked from the server, with the client's working directory, standard
+// input, output and error, and the server's environment.  A worker goes back
+// to waiting after a request, with pipes made for the next one; the server
+// forks another only when none is waiting.  The workers share a cache of
+// where on PATH they found their programs.  Exits with errno if the socket
+// cannot be set up.
+void serve(const char *path);
+
+// Run the pipeline ARGS[0..N-1] on the server at PATH, with our working
+// directory, standard input, output and error, and OPTIONS' pipe size and
+// stats.  Returns as run_pipeline would, or errno if the server cannot be
+// reached or gives no reply.
+int run_remote(const char *path, char *const args[], int n,
+               const struct pipeline_options *options);
@@ -1,6 +1,10 @@
+import os
 import pathlib
 import re
+import signal
 import subprocess
+import tempfile
+import time
 import unittest
 
 class TestLab1(unittest.TestCase):
@@ -60,3 +64,142 @@ class TestLab1(unittest.TestCase):
         self.assertNotEqual(pipe_result.stderr, '', msg='Error should be reported to standard error.')
         self.assertTrue(self._make_clean, msg='make clean failed')
 
+    def test_exit_status(self):
+        self.assertTrue(self.make, msg='make failed')
+        result = subprocess.run(('./pipe', 'true', 'false', 'true'))
+        self.assertEqual(result.returncode, 1,
+            msg='The first failing stage should set the exit status.')
+        self.assertTrue(self._make_clean, msg='make clean failed')
+
+    def test_exit_status_repeated(self):
+        self.assertTrue(self.make, msg='make failed')
+        # A failing writer must keep its status when its reader exits first.
+        for _ in range(100):
+            for cmd in (('false', 'true'), ('true', 'false', 'true')):
+                result = subprocess.run(('./pipe',) + cmd)
+                self.assertEqual(result.returncode, 1, msg=' | '.join(cmd))
+        self.assertTrue(self._make_clean, msg='make clean failed')
+
+    def test_relays(self):
+        self.assertTrue(self.make, msg='make failed')
+        data = b'relay\n' * 100000
+        result = subprocess.run(('./pipe', '-b', '256K', 'cat', '@meter',
+                                 '@tee=tee.out', 'cat'),
+                                input=data, capture_output=True)
+        with open('tee.out', 'rb') as f:
+            copy = f.read()
+        subprocess.call(['rm', 'tee.out'])
+        self.assertEqual(result.returncode, 0)
+        self.assertEqual(result.stdout, data)
+        self.assertEqual(copy, data, msg='@tee should write a copy of the data.')
+        self.assertIn(b'@meter: 600000 bytes', result.stderr)
+        self.assertTrue(self._make_clean, msg='make clean failed')
+
+    def test_fan_out(self):
+        self.assertTrue(self.make, msg='make failed')
+        data = ''.join(f'{i}\n' for i in range(10000))
+        pipe_result = subprocess.run(('./pipe', 'cat', '[', 'grep 7', 'wc -l', ',',
+                                      "grep -c '^1'", ']', 'sort -n'),
+                                     input=data, capture_output=True, text=True)
+        lines = data.splitlines()
+        expected = sorted([sum('7' in l for l in lines),
+                           sum(l.startswith('1') for l in lines)])
+        self.assertEqual(pipe_result.returncode, 0)
+        self.assertEqual([int(l) for l in pipe_result.stdout.split()], expected)
+        self.assertTrue(self._make_clean, msg='make clean failed')
+
+    def test_shards(self):
+        self.assertTrue(self.make, msg='make failed')
+        data = ''.join(f'{i}\n' for i in range(300000))
+        par = subprocess.run(('./pipe', 'cat', '@par=3 cat'),
+                             input=data, capture_output=True, text=True)
+        ordered = subprocess.run(('./pipe', 'cat', '@ordered=3 cat'),
+                                 input=data, capture_output=True, text=True)
+        self.assertEqual(par.returncode, 0)
+        self.assertEqual(sorted(par.stdout.splitlines(), key=int),
+                         data.splitlines(), msg='@par should keep lines whole.')
+        self.assertEqual(ordered.returncode, 0)
+        self.assertEqual(ordered.stdout, data)
+        self.assertTrue(self._make_clean, msg='make clean failed')
+
+    def test_stats(self):
+        self.assertTrue(self.make, msg='make failed')
+        data = 'stats\n' * 100000
+        result = subprocess.run(('./pipe', '--stats', 'cat', 'wc -l'),
+                                input=data, capture_output=True, text=True)
+        self.assertEqual(result.returncode, 0)
+        self.assertEqual(result.stdout.strip(), '100000')
+        self.assertRegex(result.stderr, r'\n +1 .* wc -l\n')
+        self.assertIn('Limiting stage:', result.stderr)
+        self.assertTrue(self._make_clean, msg='make clean failed')
+
+    def test_stop_upstream(self):
+        self.assertTrue(self.make, msg='make failed')
+        # The first stage never writes, so only a signal from the runner
+        # stops it once the second has exited.
+        result = subprocess.run(('./pipe', "sh -c 'while :; do :; done'",
+                                 'true'), capture_output=True, timeout=10)
+        self.assertEqual(result.returncode, 0)
+        self.assertEqual(result.stderr, b'', msg='SIGPIPE should go unreported.')
+        self.assertTrue(self._make_clean, msg='make clean failed')
+
+    def test_server(self):
+        self.assertTrue(self.make, msg='make failed')
+        socket = pathlib.Path('test.sock').resolve()
+        pipe = str(pathlib.Path('pipe').resolve())
+        tmp = tempfile.TemporaryDirectory()
+        # A program on PATH after a relative entry, and another of the same
+        # name where that entry leads.
+        bin_dir = pathlib.Path(tmp.name, 'bin')
+        here = pathlib.Path(tmp.name, 'here')
+        for d, word in ((bin_dir, 'global'), (here, 'local')):
+            d.mkdir()
+            tool = d / 'lab1-tool'
+            tool.write_text(f'#!/bin/sh\necho {word}\n')
+            tool.chmod(0o755)
+        env = dict(os.environ, PATH=f'.:{bin_dir}:{os.environ["PATH"]}')
+        server = subprocess.Popen((pipe, '--serve', str(socket)), env=env)
+        try:
+            for _ in range(100):
+                if socket.exists():
+                    break
+                time.sleep(0.05)
+            data = ''.join(f'{i}\n' for i in range(10000))
+            result = subprocess.run(('./pipe', '--connect', str(socket),
+                                     'cat', 'grep 7', 'wc -l'),
+                                    input=data, capture_output=True, text=True)
+            self.assertEqual(result.returncode, 0)
+            self.assertEqual(int(result.stdout), sum('7' in l for l in data.splitlines()))
+            result = subprocess.run(('./pipe', '--connect', str(socket),
+                                     'true', 'false'))
+            self.assertEqual(result.returncode, 1)
+
+            # As one-shot ./pipe would, from the client's directory, and
+            # letting go of the client's output once done with it, though
+            # the worker stays for the next request.
+            for cwd, word in ((here, 'local'), (tmp.name, 'global')):
+                result = subprocess.run((pipe, '--connect', str(socket),
+                                         'lab1-tool'), cwd=cwd, env=env,
+                                        capture_output=True, text=True,
+                                        timeout=10)
+                self.assertEqual(result.stdout, word + '\n')
+
+            # An interrupted client takes its pipeline with it.
+            client = subprocess.Popen(('./pipe', '--connect', str(socket),
+                                       'sleep 29.5', 'cat'))
+            time.sleep(0.3)
+            client.send_signal(signal.SIGINT)
+            client.wait()
+            for _ in range(40):
+                if subprocess.run(('pgrep', '-fx', 'sleep 29.5'),
+                                  capture_output=True).returncode:
+                    break
+                time.sleep(0.05)
+            else:
+                self.fail('pipeline still running after its client went')
+        finally:
+            server.terminate()
+            server.wait()
+            socket.unlink(missing_ok=True)
+            tmp.cleanup()
+        self.assertTrue(self._make_clean, msg='make clean failed')
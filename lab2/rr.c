@@ -1,33 +1,48 @@
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdckdint.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
-#include <sys/queue.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
-/* A process table entry.  */
-struct process
-{
-  long pid;
-  long arrival_time;
-  long burst_time;
+/* Binary trace format, as written by "rr -c".  A header is followed by
+   three little columns of NPROCESSES 32-bit values each: the pids, the
+   arrival times and the burst times.  Processes are stored already
+   sorted by arrival time, and each arrival is stored as the delta from
+   the previous one, so that the column stays small and non-negative.
+   Version 2 adds the phases of processes that do I/O; traces without
+   I/O are still written as version 1.  */
+#define TRACE_MAGIC "RRTRACE"
+#define TRACE_VERSION 2
+#define TRACE_SORTED 0x1
 
-  TAILQ_ENTRY (process) pointers;
+struct trace_header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t flags;
+  uint64_t nprocesses;
+  uint64_t pid_offset;
+  uint64_t arrival_offset;
+  uint64_t burst_offset;
 
-  /* Additional fields here */
-  long response_time;    // amount of time between arrival and first run
-  long start_exec_time;  // set when process runs for first time
-  long end_exec_time;         // the time at which the process finishes
-  long cpu_time;     // cpu time consumed by process
-  long wait_time;        // queue wait time of process
-  /* End of "Additional fields here" */
+  /* Version 2: the phase count column holds the number of phases of
+     each process, and the phase column holds all NPHASES phases back to
+     back.  The burst column still holds the total CPU time.  */
+  uint64_t nphases;
+  uint64_t phase_count_offset;
+  uint64_t phase_offset;
 };
 
-TAILQ_HEAD (process_list, process);
+#define TRACE_V1_HEADER_SIZE offsetof (struct trace_header, nphases)
+
 static long
 next_int (char const **data, char const *data_end)
 {
@@ -62,6 +77,17 @@ next_int (char const **data, char const *data_end)
   return current;
 }
 
+/* Return true if an unsigned decimal integer starts in DATA before
+   DATA_END.  */
+static bool
+has_int (char const *data, char const *data_end)
+{
+  for (; data < data_end; data++)
+    if ('0' <= *data && *data <= '9')
+      return true;
+  return false;
+}
+
 /* Return the first unsigned decimal integer scanned from DATA.
    Report an error and exit if no integer is found, or if it overflows.  */
 static long
@@ -70,14 +96,180 @@ next_int_from_c_str (char const *data)
   return next_int (&data, strchr (data, 0));
 }
 
-/* A vector of processes of length NPROCESSES; the vector consists of
-   PROCESS[0], ..., PROCESS[NPROCESSES - 1].  */
+/* A set of NPROCESSES processes, stored as columns: process I has pid
+   PID[I], arrives at ARRIVAL_TIME[I] and needs BURST_TIME[I] units of
+   CPU time and IO_TIME[I] units of I/O time in all.  Its NPHASES[I]
+   phases are PHASE[FIRST_PHASE[I]], PHASE[FIRST_PHASE[I] + 1], ...;
+   they alternate CPU and I/O bursts, starting and ending with a CPU
+   burst, so a process without I/O has the single phase BURST_TIME[I].
+   The columns share one allocation, which starts at PID.  */
 struct process_set
 {
   long nprocesses;
-  struct process *process;
+  long *pid;
+  long *arrival_time;
+  long *burst_time;
+  long *io_time;
+  long *first_phase;
+  long *nphases;
+  long *phase;
+  long total_phases;	// the phases allocated at PHASE
+  bool sorted;		// already in arrival order
 };
 
+/* Return an unsorted set of NPROCESSES zeroed processes, with room for
+   TOTAL_PHASES phases.  Report an error and exit on failure.  */
+static struct process_set
+alloc_process_set (long nprocesses, long total_phases)
+{
+  long *column = calloc (6 * sizeof *column, nprocesses);
+  long *phase = calloc (sizeof *phase, total_phases);
+  if (!column || !phase)
+    {
+      perror ("calloc");
+      exit (1);
+    }
+  return (struct process_set) {nprocesses, column, column + nprocesses,
+			       column + 2 * nprocesses,
+			       column + 3 * nprocesses,
+			       column + 4 * nprocesses,
+			       column + 5 * nprocesses,
+			       phase, total_phases, false};
+}
+
+/* Append to PS the phase VALUE of process I, which is a CPU burst if
+   CPU, growing the phase storage if needed.  Report an error and exit
+   on failure.  */
+static void
+add_phase (struct process_set *ps, long i, long value, bool cpu)
+{
+  long k = ps->first_phase[i] + ps->nphases[i]++;
+  if (ps->total_phases <= k)
+    {
+      ps->total_phases = 2 * ps->total_phases + 1;
+      ps->phase = realloc (ps->phase, ps->total_phases * sizeof *ps->phase);
+      if (!ps->phase)
+	{
+	  perror ("realloc");
+	  exit (1);
+	}
+    }
+  ps->phase[k] = value;
+  if (ckd_add (cpu ? &ps->burst_time[i] : &ps->io_time[i],
+	       cpu ? ps->burst_time[i] : ps->io_time[i], value))
+    {
+      fprintf (stderr, "integer overflow\n");
+      exit (1);
+    }
+  if (cpu && value == 0)
+    {
+      fprintf (stderr, "process %ld has zero burst time\n", ps->pid[i]);
+      exit (1);
+    }
+}
+
+static void
+free_process_set (struct process_set ps)
+{
+  free (ps.phase);
+  free (ps.pid);
+}
+
+/* Return the column of NPROCESSES values at OFFSET in the binary trace
+   DATA of SIZE bytes, named NAME in diagnostics.  Report an error and
+   exit if the column does not lie within the trace.  */
+static uint32_t const *
+trace_column (char const *data, size_t size, uint64_t offset,
+	      uint64_t nprocesses, char const *name)
+{
+  uint64_t end;
+  if (offset % sizeof (uint32_t) != 0
+      || ckd_mul (&end, nprocesses, sizeof (uint32_t))
+      || ckd_add (&end, end, offset) || size < end)
+    {
+      fprintf (stderr, "%s column out of range\n", name);
+      exit (1);
+    }
+  return (uint32_t const *) (data + offset);
+}
+
+/* Fill a vector of processes from the binary trace DATA of SIZE bytes.
+   The columns are read straight out of the mapping; no parsing or
+   sorting is needed.  Report an error and exit on a malformed trace.  */
+static struct process_set
+init_processes_binary (char const *data, size_t size)
+{
+  struct trace_header const *h = (struct trace_header const *) data;
+  if (h->version < 1 || TRACE_VERSION < h->version)
+    {
+      fprintf (stderr, "unsupported trace version %u\n",
+	       (unsigned) h->version);
+      exit (1);
+    }
+  /* The caller has only checked for a version 1 header.  */
+  if (1 < h->version && size < sizeof *h)
+    {
+      fprintf (stderr, "truncated trace header\n");
+      exit (1);
+    }
+
+  long nprocesses;
+  if (h->nprocesses == 0 || ckd_add (&nprocesses, h->nprocesses, 0))
+    {
+      fprintf (stderr, "no processes\n");
+      exit (1);
+    }
+
+  uint32_t const *pid = trace_column (data, size, h->pid_offset,
+				      h->nprocesses, "pid");
+  uint32_t const *arrival = trace_column (data, size, h->arrival_offset,
+					  h->nprocesses, "arrival");
+  uint32_t const *burst = trace_column (data, size, h->burst_offset,
+					h->nprocesses, "burst");
+  uint64_t nphases = 1 < h->version ? h->nphases : h->nprocesses;
+  uint32_t const *phase_count = NULL;
+  uint32_t const *phase = burst;
+  if (1 < h->version)
+    {
+      phase_count = trace_column (data, size, h->phase_count_offset,
+				  h->nprocesses, "phase count");
+      phase = trace_column (data, size, h->phase_offset, nphases, "phase");
+    }
+
+  struct process_set ps = alloc_process_set (nprocesses, nphases);
+  ps.sorted = (h->flags & TRACE_SORTED) != 0;
+  uint64_t k = 0;
+
+  long arrival_time = 0;
+  for (long i = 0; i < nprocesses; i++)
+    {
+      ps.pid[i] = pid[i];
+      if (ckd_add (&arrival_time, arrival_time, arrival[i]))
+	{
+	  fprintf (stderr, "integer overflow\n");
+	  exit (1);
+	}
+      ps.arrival_time[i] = arrival_time;
+      ps.first_phase[i] = k;
+      uint32_t count = phase_count ? phase_count[i] : 1;
+      if (count % 2 == 0 || nphases - k < count)
+	{
+	  fprintf (stderr, "process %ld has bad phases\n", ps.pid[i]);
+	  exit (1);
+	}
+      for (uint32_t j = 0; j < count; j++)
+	add_phase (&ps, i, phase[k++], j % 2 == 0);
+      if (ps.burst_time[i] != burst[i])
+	{
+	  fprintf (stderr, "process %ld has inconsistent burst time\n",
+		   ps.pid[i]);
+	  exit (1);
+	}
+    }
+
+  return ps;
+}
+
 /* Return a vector of processes scanned from the file named FILENAME.
    Report an error and exit on failure.  */
 static struct process_set
@@ -111,6 +303,23 @@ init_processes (char const *filename)
       exit (1);
     }
 
+  if (TRACE_V1_HEADER_SIZE <= size
+      && memcmp (data_start, TRACE_MAGIC, sizeof TRACE_MAGIC) == 0)
+    {
+      struct process_set ps = init_processes_binary (data_start, size);
+      if (munmap (data_start, size) < 0)
+	{
+	  perror ("munmap");
+	  exit (1);
+	}
+      if (close (fd) < 0)
+	{
+	  perror ("close");
+	  exit (1);
+	}
+      return ps;
+    }
+
   char const *data_end = data_start + size;
   char const *data = data_start;
 
@@ -121,37 +330,139 @@ init_processes (char const *filename)
       exit (1);
     }
 
-  struct process *process = calloc (sizeof *process, nprocesses);
-  if (!process)
+  /* Each process is on a line of its own: "pid, arrival, burst", where
+     the burst may be followed by any number of "io, burst" pairs.  */
+  struct process_set ps = alloc_process_set (nprocesses, nprocesses);
+  for (long i = 0; i < nprocesses; i++)
+    {
+      ps.pid[i] = next_int (&data, data_end);
+      char const *line_end = memchr (data, '\n', data_end - data);
+      if (!line_end)
+	line_end = data_end;
+      ps.arrival_time[i] = next_int (&data, line_end);
+      ps.first_phase[i] = i ? ps.first_phase[i - 1] + ps.nphases[i - 1] : 0;
+      add_phase (&ps, i, next_int (&data, line_end), true);
+      while (has_int (data, line_end))
+	{
+	  add_phase (&ps, i, next_int (&data, line_end), false);
+	  if (!has_int (data, line_end))
+	    {
+	      fprintf (stderr, "process %ld ends with an I/O burst\n",
+		       ps.pid[i]);
+	      exit (1);
+	    }
+	  add_phase (&ps, i, next_int (&data, line_end), true);
+	}
+    }
+
+  if (munmap (data_start, size) < 0)
+    {
+      perror ("munmap");
+      exit (1);
+    }
+  if (close (fd) < 0)
+    {
+      perror ("close");
+      exit (1);
+    }
+  return ps;
+}
+
+/* Store VALUE into *COLUMN_ENTRY, reporting an error and exiting if it
+   does not fit the 32-bit columns of the binary trace format.  */
+static void
+trace_store (uint32_t *column_entry, long value, char const *name)
+{
+  if (ckd_add (column_entry, value, 0))
+    {
+      fprintf (stderr, "%s %ld does not fit in a binary trace\n",
+	       name, value);
+      exit (1);
+    }
+}
+
+/* Write the sorted process set PS to the file named FILENAME in the
+   binary trace format.  Report an error and exit on failure.  */
+static void
+write_trace (struct process_set ps, char const *filename)
+{
+  long nphases = 0;
+  for (long i = 0; i < ps.nprocesses; i++)
+    nphases += ps.nphases[i];
+  bool has_io = nphases != ps.nprocesses;
+
+  size_t column_size = ps.nprocesses * sizeof (uint32_t);
+  size_t header_size = has_io ? sizeof (struct trace_header)
+			      : TRACE_V1_HEADER_SIZE;
+  size_t size = header_size + 3 * column_size;
+  if (has_io)
+    size += column_size + nphases * sizeof (uint32_t);
+  char *buf = calloc (1, size);
+  if (!buf)
     {
       perror ("calloc");
       exit (1);
     }
 
-  for (long i = 0; i < nprocesses; i++)
+  struct trace_header *h = (struct trace_header *) buf;
+  memcpy (h->magic, TRACE_MAGIC, sizeof TRACE_MAGIC);
+  h->version = has_io ? TRACE_VERSION : 1;
+  h->flags = TRACE_SORTED;
+  h->nprocesses = ps.nprocesses;
+  h->pid_offset = header_size;
+  h->arrival_offset = h->pid_offset + column_size;
+  h->burst_offset = h->arrival_offset + column_size;
+  if (has_io)
     {
-      process[i].pid = next_int (&data, data_end);
-      process[i].arrival_time = next_int (&data, data_end);
-      process[i].burst_time = next_int (&data, data_end);
-      if (process[i].burst_time == 0)
+      h->nphases = nphases;
+      h->phase_count_offset = h->burst_offset + column_size;
+      h->phase_offset = h->phase_count_offset + column_size;
+      uint32_t *phase_count = (uint32_t *) (buf + h->phase_count_offset);
+      uint32_t *phase = (uint32_t *) (buf + h->phase_offset);
+      for (long i = 0, k = 0; i < ps.nprocesses; i++)
 	{
-	  fprintf (stderr, "process %ld has zero burst time\n",
-		   process[i].pid);
-	  exit (1);
+	  trace_store (&phase_count[i], ps.nphases[i], "phase count");
+	  for (long j = 0; j < ps.nphases[i]; j++)
+	    trace_store (&phase[k++], ps.phase[ps.first_phase[i] + j],
+			 "phase");
 	}
     }
 
-  if (munmap (data_start, size) < 0)
+  uint32_t *pid = (uint32_t *) (buf + h->pid_offset);
+  uint32_t *arrival = (uint32_t *) (buf + h->arrival_offset);
+  uint32_t *burst = (uint32_t *) (buf + h->burst_offset);
+  long previous_arrival = 0;
+  for (long i = 0; i < ps.nprocesses; i++)
     {
-      perror ("munmap");
+      trace_store (&pid[i], ps.pid[i], "pid");
+      trace_store (&arrival[i], ps.arrival_time[i] - previous_arrival,
+		   "arrival time delta");
+      trace_store (&burst[i], ps.burst_time[i], "burst time");
+      previous_arrival = ps.arrival_time[i];
+    }
+
+  int fd = open (filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0)
+    {
+      perror ("open");
       exit (1);
     }
+  for (char const *p = buf; p < buf + size; )
+    {
+      ssize_t n = write (fd, p, buf + size - p);
+      if (n < 0)
+	{
+	  perror ("write");
+	  exit (1);
+	}
+      p += n;
+    }
   if (close (fd) < 0)
     {
       perror ("close");
       exit (1);
     }
-  return (struct process_set) {nprocesses, process};
+  free (buf);
 }
 
 // Sorting the process set by the arrival time
@@ -166,11 +477,15 @@ void sort_process_set(struct process_set ps) {
     // Perform a pass of bubble sort
     for (long j = 0; j < ps.nprocesses - i - 1; j++) {
       // Compare adjacent processes by their arrival time
-      if (ps.process[j].arrival_time > ps.process[j + 1].arrival_time) {
-        // Swap the processes if they are out of order
-        struct process temp = ps.process[j];
-        ps.process[j] = ps.process[j + 1];
-        ps.process[j + 1] = temp;
+      if (ps.arrival_time[j] > ps.arrival_time[j + 1]) {
+        // Swap the processes if they are out of order, column by column
+        long *column[] = {ps.pid, ps.arrival_time, ps.burst_time,
+                          ps.io_time, ps.first_phase, ps.nphases};
+        for (int k = 0; k < 6; k++) {
+          long temp = column[k][j];
+          column[k][j] = column[k][j + 1];
+          column[k][j + 1] = temp;
+        }
 
         // Set swapped to one (true) to indicate that a swap occurred
         swapped = 1;
@@ -185,157 +500,684 @@ void sort_process_set(struct process_set ps) {
 }
 
 
-// Here, we compute the median of all the cpu times in oricess queue, rounding to even
-long compute_median_runtime(struct process_list *pl) {
-    if (TAILQ_EMPTY(pl)) {
-        return 1; // If the list is empty, return the median as 1!
-    }
-    long nprocs = 0;
-    struct process *current;
-    // Count the number of processes
-    TAILQ_FOREACH(current, pl, pointers) {
-        nprocs++;
-    }
-    long* cpu_times = malloc(sizeof(long) * nprocs);
-    if (cpu_times == NULL) {
-        // Handle malloc failure; depending on the system specifics,
-        // you may want to return an error code or exit.
-        return -1; // or handle memory allocation error appropriately
+/* A FIFO run queue of process indexes, kept in a ring buffer of
+   CAPACITY slots.  A process is queued at most once, so one slot per
+   process always suffices.  */
+struct run_queue
+{
+  long *slot;
+  long capacity;
+  long head;
+  long count;
+};
+
+static void
+run_queue_push (struct run_queue *q, long i)
+{
+  long tail = q->head + q->count++;
+  q->slot[tail < q->capacity ? tail : tail - q->capacity] = i;
+}
+
+static long
+run_queue_pop (struct run_queue *q)
+{
+  long i = q->slot[q->head];
+  q->head = q->head + 1 < q->capacity ? q->head + 1 : 0;
+  q->count--;
+  return i;
+}
+
+static int
+compare_long (void const *a, void const *b)
+{
+  long x = *(long const *) a;
+  long y = *(long const *) b;
+  return (x > y) - (x < y);
+}
+
+// Here, we compute the median of all the cpu times in the run queue Q, rounding to even.
+// CPU_TIME is the per-process cpu time column, and SCRATCH has room for Q->count longs.
+long compute_median_runtime(struct run_queue const *q, long const *cpu_time, long *scratch) {
+    if (q->count == 0) {
+        return 1; // If the queue is empty, return the median as 1!
     }
+    long nprocs = q->count;
     // Collect CPU times
-    int i = 0;
-    TAILQ_FOREACH(current, pl, pointers) {
-        cpu_times[i++] = current->cpu_time;
-    }
-    // Bubble sort CPU times
-    for (int i = 0; i < nprocs - 1; i++) {
-        for (int j = 0; j < nprocs - i - 1; j++) {
-            if (cpu_times[j] > cpu_times[j + 1]) {
-                long temp = cpu_times[j];
-                cpu_times[j] = cpu_times[j + 1];
-                cpu_times[j + 1] = temp;
-            }
-        }
+    for (long i = 0; i < nprocs; i++) {
+        long k = q->head + i;
+        scratch[i] = cpu_time[q->slot[k < q->capacity ? k : k - q->capacity]];
     }
+    qsort(scratch, nprocs, sizeof *scratch, compare_long);
     double median = 0.0;
     // Compute the median
     if (nprocs % 2 != 0) {
-        median = cpu_times[nprocs / 2];
+        median = scratch[nprocs / 2];
     } else {
         // For an even number of elements, take the average of the two middle elements
-        median = (cpu_times[(nprocs / 2) - 1] + cpu_times[nprocs / 2]) / 2.0;
-        
+        median = (scratch[(nprocs / 2) - 1] + scratch[nprocs / 2]) / 2.0;
+
         // If the median is not an integer, round it to the nearest even number
         if (median != (long)median) {
             median = ((long)(median + 0.5)) & ~1;
         }
     }
-    free(cpu_times);
-    return (long)median;
+    // A zero quantum would never let anything run
+    return median < 1 ? 1 : (long)median;
 }
 
 
+/* A streaming quantile sketch over non-negative integers.  It is a
+   log-linear histogram with SKETCH_SUB_BUCKETS buckets per power of two,
+   so its size is fixed however many values are added, and a quantile
+   is off by at most 1/SKETCH_SUB_BUCKETS of its true value.  */
+#define SKETCH_SUB_BITS 7
+#define SKETCH_SUB_BUCKETS (1L << SKETCH_SUB_BITS)
+#define SKETCH_BUCKETS ((64 - SKETCH_SUB_BITS) * SKETCH_SUB_BUCKETS)
+
+struct sketch
+{
+  long count;
+  long min;
+  long max;
+  long bucket[SKETCH_BUCKETS];
+};
+
+/* Return the index of the bucket of SKETCH holding VALUE.  */
+static long
+sketch_index (long value)
+{
+  if (value < SKETCH_SUB_BUCKETS)
+    return value;
+  int shift = 63 - __builtin_clzl (value) - SKETCH_SUB_BITS;
+  return ((shift + 1) * SKETCH_SUB_BUCKETS
+	  + (value >> shift) - SKETCH_SUB_BUCKETS);
+}
+
+static void
+sketch_add (struct sketch *sketch, long value)
+{
+  if (sketch->count == 0 || value < sketch->min)
+    sketch->min = value;
+  if (sketch->count == 0 || sketch->max < value)
+    sketch->max = value;
+  sketch->count++;
+  sketch->bucket[sketch_index (value)]++;
+}
+
+/* Return an estimate of the Q-quantile of the values added to SKETCH,
+   where 0 < Q <= 1: the midpoint of the bucket holding that rank.  */
+static long
+sketch_quantile (struct sketch const *sketch, double q)
+{
+  if (sketch->count == 0)
+    return 0;
+  long rank = (long) (q * sketch->count + 0.999999);
+  long seen = 0;
+  long i;
+  for (i = 0; i < SKETCH_BUCKETS - 1; i++)
+    if (rank <= (seen += sketch->bucket[i]))
+      break;
+
+  long value = i;
+  if (SKETCH_SUB_BUCKETS <= i)
+    {
+      int shift = i / SKETCH_SUB_BUCKETS - 1;
+      value = ((SKETCH_SUB_BUCKETS + i % SKETCH_SUB_BUCKETS) << shift)
+	      + ((1L << shift) - 1) / 2;
+    }
+  return (value < sketch->min ? sketch->min
+	  : sketch->max < value ? sketch->max : value);
+}
+
+/* Formats of the per-process records written by "rr -o".  */
+enum record_format
+{
+  RECORD_CSV,
+  RECORD_JSON
+};
+
+/* Distribution metrics gathered while simulating.  Everything is
+   recorded as each process completes, so memory use does not grow with
+   the number of processes: the percentiles come from sketches, and the
+   per-process records, if wanted, are streamed to RECORDS.  */
+struct metrics
+{
+  struct sketch wait_time;
+  struct sketch response_time;
+  struct sketch turnaround_time;
+
+  /* Completions per WINDOW time units, if WINDOW is nonzero.  */
+  long window;
+  long nwindows;
+  long *completions;
+
+  FILE *records;
+  enum record_format format;
+  long nrecords;
+};
+
+/* Record in METRICS process I of PS, which started at START_TIME and
+   completed at END_TIME.  Report an error and exit on failure.  */
+static void
+metrics_record (struct metrics *metrics, struct process_set const *ps,
+		long i, long start_time, long end_time)
+{
+  long response_time = start_time - ps->arrival_time[i];
+  long turnaround_time = end_time - ps->arrival_time[i];
+  long wait_time = turnaround_time - ps->burst_time[i] - ps->io_time[i];
+  sketch_add (&metrics->wait_time, wait_time);
+  sketch_add (&metrics->response_time, response_time);
+  sketch_add (&metrics->turnaround_time, turnaround_time);
+
+  if (metrics->window)
+    {
+      long w = end_time / metrics->window;
+      if (metrics->nwindows <= w)
+	{
+	  long nwindows = 2 * w + 1;
+	  long *completions = realloc (metrics->completions,
+				       nwindows * sizeof *completions);
+	  if (!completions)
+	    {
+	      perror ("realloc");
+	      exit (1);
+	    }
+	  memset (completions + metrics->nwindows, 0,
+		  (nwindows - metrics->nwindows) * sizeof *completions);
+	  metrics->completions = completions;
+	  metrics->nwindows = nwindows;
+	}
+      metrics->completions[w]++;
+    }
+
+  if (metrics->records)
+    {
+      if (metrics->format == RECORD_JSON)
+	fprintf (metrics->records,
+		 "%s\n  {\"pid\": %ld, \"arrival_time\": %ld, "
+		 "\"burst_time\": %ld, \"io_time\": %ld, "
+		 "\"start_time\": %ld, \"end_time\": %ld, "
+		 "\"response_time\": %ld, \"wait_time\": %ld, "
+		 "\"turnaround_time\": %ld}",
+		 metrics->nrecords ? "," : "[", ps->pid[i],
+		 ps->arrival_time[i], ps->burst_time[i], ps->io_time[i],
+		 start_time, end_time, response_time, wait_time,
+		 turnaround_time);
+      else
+	fprintf (metrics->records, "%ld,%ld,%ld,%ld,%ld,%ld,%ld,%ld,%ld\n",
+		 ps->pid[i], ps->arrival_time[i], ps->burst_time[i],
+		 ps->io_time[i], start_time, end_time, response_time,
+		 wait_time, turnaround_time);
+      metrics->nrecords++;
+    }
+}
+
+/* A min-heap of the processes blocked on I/O, keyed by the time their
+   I/O completes.  A process blocks at most once at a time, so one entry
+   per process always suffices.  */
+struct blocked_heap
+{
+  struct blocked
+  {
+    long wake_time;
+    long i;
+  } *entry;
+  long count;
+};
+
+static void
+blocked_push (struct blocked_heap *heap, long wake_time, long i)
+{
+  long k = heap->count++;
+  while (0 < k && wake_time < heap->entry[(k - 1) / 2].wake_time)
+    {
+      heap->entry[k] = heap->entry[(k - 1) / 2];
+      k = (k - 1) / 2;
+    }
+  heap->entry[k] = (struct blocked) {wake_time, i};
+}
+
+static long
+blocked_pop (struct blocked_heap *heap)
+{
+  long i = heap->entry[0].i;
+  struct blocked last = heap->entry[--heap->count];
+  long k = 0;
+  for (long child; (child = 2 * k + 1) < heap->count; k = child)
+    {
+      if (child + 1 < heap->count
+	  && heap->entry[child + 1].wake_time < heap->entry[child].wake_time)
+	child++;
+      if (last.wake_time <= heap->entry[child].wake_time)
+	break;
+      heap->entry[k] = heap->entry[child];
+    }
+  heap->entry[k] = last;
+  return i;
+}
+
+/* The cost of a context switch: DISPATCH time units, plus MIGRATION
+   more if the incoming process is cold because it just came back from
+   I/O, so its cache state is gone.  */
+struct switch_cost
+{
+  long dispatch;
+  long migration;
+};
+
+/* The outcome of simulating one quantum length over a process set.  */
+struct simulation_result
+{
+  long total_wait_time;
+  long total_response_time;
+  long context_switches;
+  long busy_time;	// time spent running processes
+  long end_time;	// the time at which the last process finishes
+  struct metrics *metrics;	// if nonnull, filled in as processes finish
+};
+
+/* Simulate round-robin scheduling of the processes in PS, which must be
+   sorted by arrival time, with quantum QUANTUM_LENGTH (or the median
+   runtime if -1) and context switches costing COST, and store the
+   outcome in *RESULT.  PS itself is only read, so several simulations
+   may share it.  The mutable state lives in per-simulation columns
+   indexed like PS, and the run queue holds indexes rather than
+   pointers.  Processes blocked on I/O wait in a heap, so that the
+   simulation can jump straight to the next arrival or I/O completion
+   whenever the run queue is empty.  */
+static void
+simulate (struct process_set const *ps, long quantum_length,
+	  struct switch_cost cost, struct simulation_result *result)
+{
+  long n = ps->nprocesses;
+  long *column = malloc (8 * n * sizeof *column);
+  struct blocked_heap blocked = {malloc (n * sizeof *blocked.entry), 0};
+  if (!column || !blocked.entry)
+    {
+      perror ("malloc");
+      exit (1);
+    }
+  long *cpu_time = column;              // cpu time consumed by process
+  long *start_exec_time = column + n;   // set when process runs for first time
+  long *end_exec_time = column + 2 * n; // the time at which the process finishes
+  long *scratch = column + 3 * n;       // room for computing medians
+  struct run_queue queue = {column + 4 * n, n, 0, 0};
+  long *phase = column + 5 * n;          // index of the current phase
+  long *phase_cpu_time = column + 6 * n; // cpu time consumed in that phase
+  long *cold = column + 7 * n;           // nonzero if back from I/O
+
+  result->context_switches = 0;
+  result->busy_time = 0;
+
+  // Initialize start and cpu times for each process
+  for (long i = 0; i < n; i++) {
+    start_exec_time[i] = -1;  // -1 denotes that the process has not started yet
+    cpu_time[i] = 0;          // Initialize with 0 CPU time as none has been used yet
+    phase[i] = 0;
+    phase_cpu_time[i] = 0;
+    cold[i] = 0;
+  }
+  long qt = quantum_length; // Time slice of each process
+  long next = 0;            // Index of process that is arriving next
+  long time = 0;            // Time counter
+  long previous = -1;       // Previously executed process, or -1
+  long current = -1;        // Currently executing process, or -1
+
+  // Main round-robin scheduling loop
+  while (true) {
+    // Add processes that have arrived or finished their I/O before or at
+    // the current time, earliest first
+    while (true) {
+      bool arrived = next < n && ps->arrival_time[next] <= time;
+      bool woke = blocked.count && blocked.entry[0].wake_time <= time;
+      if (arrived && (!woke || ps->arrival_time[next] <= blocked.entry[0].wake_time)) {
+        run_queue_push(&queue, next);
+        next++;
+      } else if (woke) {
+        run_queue_push(&queue, blocked_pop(&blocked));
+      } else {
+        break;
+      }
+    }
+    // Process switching logic
+    if (previous >= 0) {
+      run_queue_pop(&queue); // Remove the previous process from the front of the queue
+      long k = ps->first_phase[previous] + phase[previous];
+      if (phase_cpu_time[previous] < ps->phase[k]) {
+        // If the CPU burst has not finished, re-queue the process
+        run_queue_push(&queue, previous);
+      } else if (phase[previous] + 1 < ps->nphases[previous]) {
+        // If an I/O burst follows, block until it completes
+        blocked_push(&blocked, time + ps->phase[k + 1], previous);
+        phase[previous] += 2;
+        phase_cpu_time[previous] = 0;
+        cold[previous] = 1;
+      } else {
+        // If the process has finished execution
+        end_exec_time[previous] = time;
+        if (result->metrics) {
+          metrics_record(result->metrics, ps, previous,
+                         start_exec_time[previous], time);
+        }
+      }
+    }
+    // Fetch the process at the front of the queue
+    current = queue.count ? queue.slot[queue.head] : -1;
+    // If no processes are in the queue, jump forward in time to the next
+    // process arrival or I/O completion
+    if (current < 0) {
+      if (next < n && (!blocked.count || ps->arrival_time[next] <= blocked.entry[0].wake_time)) {
+        time = ps->arrival_time[next];
+      } else if (blocked.count) {
+        time = blocked.entry[0].wake_time;
+      } else {
+        // If there is nothing more to run, break out of the loop
+        break;
+      }
+    } else {
+      // Context switch overhead if we're switching processes
+      if (previous >= 0 && current != previous) {
+        time += cost.dispatch; // Account for the context switch
+        if (cold[current]) {
+          time += cost.migration;
+        }
+        result->context_switches++;
+      }
+      cold[current] = 0;
+      // If the process is running for the first time, set its start time
+      if (start_exec_time[current] == -1) {
+        start_exec_time[current] = time;
+      }
+      // Compute new quantum using median runtime if quantum_length is set to -1
+      if (quantum_length == -1) {
+        qt = compute_median_runtime(&queue, cpu_time, scratch);
+      }
+      // Determine run time for the current process
+      long remaining_time = ps->phase[ps->first_phase[current] + phase[current]]
+                            - phase_cpu_time[current];
+      long run_time = (qt < remaining_time) ? qt : remaining_time;
+      cpu_time[current] += run_time; // Update process' CPU time
+      phase_cpu_time[current] += run_time;
+      time += run_time; // Move forward in time by the run time
+      result->busy_time += run_time;
+    }
+    // Set the previous process to the current one for the next iteration
+    previous = current;
+  }
+
+  // After the loop, scheduling is complete; reduce the columns to totals.
+  long total_wait_time = 0;
+  long total_response_time = 0;
+  for (long i = 0; i < n; i++) {
+    total_wait_time += (end_exec_time[i] - ps->arrival_time[i]
+                        - ps->burst_time[i] - ps->io_time[i]);
+    total_response_time += start_exec_time[i] - ps->arrival_time[i];
+  }
+  result->total_wait_time = total_wait_time;
+  result->total_response_time = total_response_time;
+  result->end_time = time;
+  free (blocked.entry);
+  free (column);
+}
+
+/* Print to stdout the distribution metrics of RESULT, a simulation of
+   the sorted process set PS.  */
+static void
+print_metrics (struct process_set const *ps,
+	       struct simulation_result const *result)
+{
+  struct metrics const *metrics = result->metrics;
+  struct
+  {
+    char const *name;
+    struct sketch const *sketch;
+  } const dist[] = {
+    {"Wait time", &metrics->wait_time},
+    {"Response time", &metrics->response_time},
+    {"Turnaround time", &metrics->turnaround_time},
+  };
+  for (size_t i = 0; i < sizeof dist / sizeof *dist; i++)
+    printf ("%s p50/p95/p99: %ld/%ld/%ld\n", dist[i].name,
+	    sketch_quantile (dist[i].sketch, 0.50),
+	    sketch_quantile (dist[i].sketch, 0.95),
+	    sketch_quantile (dist[i].sketch, 0.99));
+
+  long span = result->end_time - ps->arrival_time[0];
+  printf ("Context switches: %ld\n", result->context_switches);
+  printf ("CPU utilization: %.2f%%\n", 100.0 * result->busy_time / span);
+  printf ("Throughput: %.4f processes per time unit\n",
+	  ps->nprocesses / (double) span);
+  if (metrics->window)
+    {
+      long last = result->end_time / metrics->window;
+      for (long w = ps->arrival_time[0] / metrics->window;
+	   w <= last; w++)
+	printf ("Completions in [%ld, %ld): %ld\n", w * metrics->window,
+		(w + 1) * metrics->window,
+		w < metrics->nwindows ? metrics->completions[w] : 0);
+    }
+}
+
+/* A sweep over the quantum lengths FIRST..LAST.  Worker threads claim
+   quantum lengths from NEXT and store their outcomes in RESULT, indexed
+   by quantum length minus FIRST; the process set is shared read-only.  */
+struct sweep
+{
+  struct process_set const *ps;
+  long first;
+  long last;
+  struct switch_cost cost;
+  atomic_long next;
+  struct simulation_result *result;
+};
+
+static void *
+sweep_worker (void *arg)
+{
+  struct sweep *sweep = arg;
+  long quantum_length;
+  while ((quantum_length = atomic_fetch_add (&sweep->next, 1)) <= sweep->last)
+    simulate (sweep->ps, quantum_length, sweep->cost,
+	      &sweep->result[quantum_length - sweep->first]);
+  return NULL;
+}
+
+/* Simulate every quantum length from FIRST through LAST over the sorted
+   process set PS with context switches costing COST, one thread per
+   online CPU, and print a table of the average wait and response times.
+   Report an error and exit on failure.  */
+static void
+run_sweep (struct process_set const *ps, long first, long last,
+	   struct switch_cost cost)
+{
+  long nquanta = last - first + 1;
+  struct sweep sweep = {ps, first, last, cost, first,
+			calloc (nquanta, sizeof *sweep.result)};
+  if (!sweep.result)
+    {
+      perror ("calloc");
+      exit (1);
+    }
+
+  long nthreads = sysconf (_SC_NPROCESSORS_ONLN);
+  if (nthreads < 1)
+    nthreads = 1;
+  if (nquanta < nthreads)
+    nthreads = nquanta;
+  pthread_t *threads = calloc (nthreads, sizeof *threads);
+  if (!threads)
+    {
+      perror ("calloc");
+      exit (1);
+    }
+
+  for (long i = 0; i < nthreads; i++)
+    {
+      int err = pthread_create (&threads[i], NULL, sweep_worker, &sweep);
+      if (err)
+	{
+	  fprintf (stderr, "pthread_create: %s\n", strerror (err));
+	  exit (1);
+	}
+    }
+  for (long i = 0; i < nthreads; i++)
+    pthread_join (threads[i], NULL);
+
+  printf ("%8s %17s %21s\n", "Quantum", "Average wait time",
+	  "Average response time");
+  for (long i = 0; i < nquanta; i++)
+    printf ("%8ld %17.2f %21.2f\n", first + i,
+	    sweep.result[i].total_wait_time / (double) ps->nprocesses,
+	    sweep.result[i].total_response_time / (double) ps->nprocesses);
+
+  free (threads);
+  free (sweep.result);
+}
+
 int
 main (int argc, char *argv[])
 {
-  if (argc != 3)
+  char const *convert_output = NULL;
+  char const *records_output = NULL;
+  bool print_stats = false;
+  static struct metrics metrics;
+  struct switch_cost cost = {1, 0};
+  int c;
+  while ((c = getopt (argc, argv, "c:o:F:sw:C:M:")) != -1)
+    switch (c)
+      {
+      case 'C':
+	cost.dispatch = next_int_from_c_str (optarg);
+	break;
+      case 'M':
+	cost.migration = next_int_from_c_str (optarg);
+	break;
+      case 'c':
+	convert_output = optarg;
+	break;
+      case 'o':
+	records_output = optarg;
+	break;
+      case 'F':
+	if (strcmp (optarg, "csv") == 0)
+	  metrics.format = RECORD_CSV;
+	else if (strcmp (optarg, "json") == 0)
+	  metrics.format = RECORD_JSON;
+	else
+	  goto usage;
+	break;
+      case 's':
+	print_stats = true;
+	break;
+      case 'w':
+	metrics.window = next_int_from_c_str (optarg);
+	if (metrics.window == 0)
+	  goto usage;
+	break;
+      default:
+	goto usage;
+      }
+
+  if (convert_output && argc - optind == 1)
     {
-      fprintf (stderr, "%s: usage: %s file quantum\n", argv[0], argv[0]);
+      struct process_set ps = init_processes (argv[optind]);
+      if (!ps.sorted)
+	sort_process_set (ps);
+      write_trace (ps, convert_output);
+      free_process_set (ps);
+      return 0;
+    }
+  if (convert_output || argc - optind != 2)
+    {
+    usage:
+      fprintf (stderr, "%s: usage: %s [-C cost] [-M cost] [-s] [-w window]"
+	       " [-o output [-F csv|json]] file quantum\n"
+	       "       %s [-C cost] [-M cost] file first..last\n"
+	       "       %s -c output file\n", argv[0], argv[0], argv[0], argv[0]);
       return 1;
     }
 
-  struct process_set ps = init_processes (argv[1]);
-  long quantum_length = (strcmp (argv[2], "median") == 0 ? -1
-			 : next_int_from_c_str (argv[2]));
+  struct process_set ps = init_processes (argv[optind]);
+  char const *quantum_arg = argv[optind + 1];
+  char const *range = strstr (quantum_arg, "..");
+  long quantum_length = (strcmp (quantum_arg, "median") == 0 ? -1
+			 : next_int_from_c_str (quantum_arg));
+  long last_quantum_length = (range ? next_int_from_c_str (range + 2)
+			      : quantum_length);
   if (quantum_length == 0)
     {
       fprintf (stderr, "%s: zero quantum length\n", argv[0]);
       return 1;
     }
-
-  struct process_list list;
-  TAILQ_INIT (&list);
-
-  long total_wait_time = 0;
-  long total_response_time = 0;
+  if (last_quantum_length < quantum_length)
+    {
+      fprintf (stderr, "%s: empty quantum range\n", argv[0]);
+      return 1;
+    }
 
   /* Your code here */
 
- // Sort processes by arrival time
-sort_process_set(ps);
-
-// Initialize start and cpu times for each process
-for (int i = 0; i < ps.nprocesses; i++) {
-  ps.process[i].start_exec_time = -1;  // -1 denotes that the process has not started yet
-  ps.process[i].cpu_time = 0;     // Initialize with 0 CPU time as none has been used yet
+ // Sort processes by arrival time, unless the trace was stored sorted
+if (!ps.sorted) {
+  sort_process_set(ps);
 }
-long qt = quantum_length;        // Time slice of each process
-long next = 0;                   // Index of process that is arriving next
-long time = 0;                   // Time counter
-struct process *previous = NULL; // Previously executed process
-struct process *current = NULL;  // Currently executing process
-
-// Main round-robin scheduling loop
-while (true) {
-  // Add processes that have arrived before or at the current time
-  while (next < ps.nprocesses && time >= ps.process[next].arrival_time) {
-    TAILQ_INSERT_TAIL(&list, &ps.process[next], pointers);
-    next++;
-  }
-  // Process switching logic
-  if (previous) {
-    TAILQ_REMOVE(&list, previous, pointers); // Remove the previous process from the queue
-    if (previous->burst_time == previous->cpu_time) {
-      // If the process has finished execution
-      previous->end_exec_time = time;
-      previous->wait_time = previous->end_exec_time - previous->arrival_time - previous->burst_time;
-      total_wait_time += previous->wait_time;
-    } else {
-      // If the process has not finished, re-queue it
-      TAILQ_INSERT_TAIL(&list, previous, pointers);
+
+  if (range && (print_stats || records_output))
+    {
+      fprintf (stderr, "%s: -s and -o need a single quantum length\n",
+	       argv[0]);
+      return 1;
     }
-  }
-  current = TAILQ_FIRST(&list); // Fetch the process at the front of the queue
-  // If no processes are in the queue, jump forward in time to the next process arrival
-  if (!current) {
-    if (next < ps.nprocesses) {
-      time = ps.process[next].arrival_time;
-    } else {
-      // If there are no more processes to arrive, break out of the loop
-      break;
+  if (range)
+    {
+      run_sweep (&ps, quantum_length, last_quantum_length, cost);
+      if (fflush (stdout) < 0 || ferror (stdout))
+	{
+	  perror ("stdout");
+	  return 1;
+	}
+      free_process_set (ps);
+      return 0;
     }
-  } else {
-    // Context switch overhead if we're switching processes
-    if (previous && current != previous) {
-      time++; // Increment time to account for context switch
-    }
-    // If the process is running for the first time, set its start time
-    if (current->start_exec_time == -1) {
-      current->start_exec_time = time;
-      current->response_time = time - current->arrival_time;
-      total_response_time += current->response_time;
-    }
-    // Compute new quantum using median runtime if quantum_length is set to -1
-    if (quantum_length == -1) {
-      qt = compute_median_runtime(&list);
-    }
-    // Determine run time for the current process
-    long remaining_time = current->burst_time - current->cpu_time;
-    long run_time = (qt < remaining_time) ? qt : remaining_time;
-    current->cpu_time += run_time; // Update process' CPU time
-    time += run_time; // Move forward in time by the run time
-  }
-  // Set the previous process to the current one for the next iteration
-  previous = current;
-}
 
-// After the loop, scheduling is complete and all processes have been handled.
+  if (records_output)
+    {
+      metrics.records = fopen (records_output, "w");
+      if (!metrics.records)
+	{
+	  perror (records_output);
+	  return 1;
+	}
+      if (metrics.format == RECORD_CSV)
+	fprintf (metrics.records, "pid,arrival_time,burst_time,io_time,"
+		 "start_time,end_time,response_time,wait_time,"
+		 "turnaround_time\n");
+    }
+
+  struct simulation_result result = {0};
+  result.metrics = &metrics;
+  simulate (&ps, quantum_length, cost, &result);
+  long total_wait_time = result.total_wait_time;
+  long total_response_time = result.total_response_time;
   /* End of "Your code here" */
 
   printf ("Average wait time: %.2f\n",
 	  total_wait_time / (double) ps.nprocesses);
   printf ("Average response time: %.2f\n",
 	  total_response_time / (double) ps.nprocesses);
+  if (print_stats)
+    print_metrics (&ps, &result);
+
+  if (metrics.records)
+    {
+      if (metrics.format == RECORD_JSON)
+	fprintf (metrics.records, "\n]\n");
+      if (fclose (metrics.records) != 0)
+	{
+	  perror (records_output);
+	  return 1;
+	}
+    }
 
   if (fflush (stdout) < 0 || ferror (stdout))
     {
@@ -343,6 +1185,7 @@ while (true) {
       return 1;
     }
 
-  free (ps.process);
+  free (metrics.completions);
+  free_process_set (ps);
   return 0;
 }
\ No newline at end of file
@@ -0,0 +1,48 @@
+import pathlib
+import subprocess
+import tempfile
+import unittest
+
+class TestLab2(unittest.TestCase):
+
+    def _make():
+        result = subprocess.run(['make'], capture_output=True, text=True)
+        return result
+
+    def _make_clean():
+        result = subprocess.run(['make', 'clean'],
+                                capture_output=True, text=True)
+        return result
+
+    @classmethod
+    def setUpClass(cls):
+        cls.make = cls._make().returncode == 0
+
+    @classmethod
+    def tearDownClass(cls):
+        cls._make_clean()
+
+    def _round_trip(self, text):
+        with tempfile.TemporaryDirectory() as tmp:
+            source = pathlib.Path(tmp, 'processes.txt')
+            trace = pathlib.Path(tmp, 'processes.trace')
+            source.write_text(text)
+            convert = subprocess.run(('./rr', '-c', trace, source),
+                                     capture_output=True, text=True)
+            self.assertEqual(convert.returncode, 0, msg=convert.stderr)
+            from_text = subprocess.run(('./rr', source, '3'),
+                                       capture_output=True, text=True)
+            from_trace = subprocess.run(('./rr', trace, '3'),
+                                        capture_output=True, text=True)
+        self.assertEqual(from_trace.returncode, 0, msg=from_trace.stderr)
+        self.assertEqual(from_trace.stdout, from_text.stdout)
+
+    def test_trace_round_trip(self):
+        self.assertTrue(self.make, msg='make failed')
+        self._round_trip(pathlib.Path('processes.txt').read_text())
+
+    def test_one_process_trace(self):
+        self.assertTrue(self.make, msg='make failed')
+        # A version 1 trace of one process is shorter than a version 2
+        # header.
+        self._round_trip('1\n\n1, 0, 5\n')
@@ -0,0 +1,151 @@
+"""Throughput benchmark for ext2-create.
+
+Generates synthetic source trees (many small files, a few huge files, and
+deep directories), builds an image of each with every writer, and reports
+the best wall time of a few runs, the throughput in MB of file contents
+per second, the I/O system calls ext2-create made and the bytes it wrote
+(from -v), and its peak RSS.  Run it with `make bench`.
+
+The trees stay in the page cache between runs, so this measures the
+builder, not the source disk.
+"""
+
+import argparse
+import os
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+WRITERS = ['copy', 'pwrite', 'write', 'pwritev', 'mmap', 'io_uring']
+
+MB = 1 << 20
+
+
+def write_file(path, size, chunk):
+    with open(path, 'wb') as f:
+        while size > 0:
+            f.write(chunk[:size])
+            size -= len(chunk)
+
+
+def make_small(root, scale, chunk):
+    """20000 files of up to 16K, 200 to a directory."""
+    for i in range(int(20000 * scale)):
+        d = os.path.join(root, 'd%03d' % (i // 200))
+        if i % 200 == 0:
+            os.mkdir(d)
+        write_file(os.path.join(d, 'f%d' % i), i * 7919 % 16384 + 1, chunk)
+
+
+def make_huge(root, scale, chunk):
+    """Four files of 256M."""
+    for i in range(4):
+        write_file(os.path.join(root, 'huge%d' % i), int(256 * MB * scale),
+                   chunk)
+
+
+def make_deep(root, scale, chunk):
+    """A chain of 500 directories, each with a few files of a few K.
+
+    The directories have one-letter names, so that the deepest path
+    stays well under PATH_MAX.
+    """
+    d = root
+    for i in range(int(500 * scale)):
+        d = os.path.join(d, 'd')
+        os.mkdir(d)
+        for j in range(4):
+            write_file(os.path.join(d, 'f%d' % j), 4096 * (j + 1), chunk)
+
+
+TREES = {'small': make_small, 'huge': make_huge, 'deep': make_deep}
+
+
+def tree_stats(root):
+    files = 0
+    size = 0
+    for dirpath, dirnames, filenames in os.walk(root):
+        files += len(dirnames) + len(filenames)
+        for name in filenames:
+            size += os.lstat(os.path.join(dirpath, name)).st_size
+    return files, size
+
+
+def image_size(files, size):
+    """Room for the contents, their indirect blocks and an inode each."""
+    return (size + files * 8192) * 5 // 4 + 64 * MB
+
+
+def run(args, image, tree, writer, size):
+    cmd = [os.path.abspath(args.ext2_create), '-d', tree, '-o', image,
+           '-s', str(size), '-b', '4096', '-i', '4096',
+           '-j', str(args.jobs), '-q', str(args.depth), '-w', writer, '-v']
+    start = time.perf_counter()
+    p = subprocess.Popen(cmd, stderr=subprocess.PIPE, text=True)
+    err = p.stderr.read()
+    _, status, rusage = os.wait4(p.pid, 0)
+    elapsed = time.perf_counter() - start
+    p.returncode = os.waitstatus_to_exitcode(status)
+    if p.returncode:
+        sys.exit('%s failed:\n%s' % (' '.join(cmd), err))
+    m = re.search(r'io_syscalls=(\d+) bytes_written=(\d+)', err)
+    # ru_maxrss is in kilobytes on Linux.
+    return elapsed, int(m.group(1)), int(m.group(2)), rusage.ru_maxrss
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('--scale', type=float,
+                        default=float(os.environ.get('BENCH_SCALE', 1)),
+                        help='scale the trees by this (default: $BENCH_SCALE or 1)')
+    parser.add_argument('--runs', type=int, default=3,
+                        help='report the best of this many runs')
+    parser.add_argument('--jobs', type=int, default=1,
+                        help='pass -j JOBS to ext2-create')
+    parser.add_argument('--depth', type=int, default=32,
+                        help='pass -q DEPTH to ext2-create')
+    parser.add_argument('--trees', default=','.join(TREES),
+                        help='comma-separated trees to build')
+    parser.add_argument('--writers', default=','.join(WRITERS),
+                        help='comma-separated writers to compare')
+    parser.add_argument('--dir', default=None,
+                        help='make the trees and images under this directory')
+    parser.add_argument('--ext2-create', default='./ext2-create')
+    args = parser.parse_args()
+
+    chunk = os.urandom(MB)
+    work = tempfile.mkdtemp(prefix='bench-lab4-', dir=args.dir)
+    try:
+        print('%-6s %-8s %9s %9s %10s %10s %9s'
+              % ('tree', 'writer', 'seconds', 'MB/s', 'syscalls',
+                 'MB written', 'RSS MB'))
+        for name in args.trees.split(','):
+            tree = os.path.join(work, name)
+            os.mkdir(tree)
+            TREES[name](tree, args.scale, chunk)
+            files, size = tree_stats(tree)
+            image = os.path.join(work, name + '.img')
+            for writer in args.writers.split(','):
+                best = None
+                for _ in range(args.runs):
+                    if os.path.exists(image):
+                        os.unlink(image)
+                    result = run(args, image, tree, writer,
+                                 image_size(files, size))
+                    if best is None or result[0] < best[0]:
+                        best = result
+                elapsed, syscalls, written, rss = best
+                print('%-6s %-8s %9.3f %9.1f %10d %10.1f %9.1f'
+                      % (name, writer, elapsed, size / MB / elapsed,
+                         syscalls, written / MB, rss / 1024))
+            shutil.rmtree(tree)
+            os.unlink(image)
+    finally:
+        shutil.rmtree(work)
+
+
+if __name__ == '__main__':
+    main()
@@ -1,187 +1,586 @@
+#define _GNU_SOURCE
+
 #include <assert.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <linux/fs.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
-typedef uint8_t u8;
-typedef uint16_t u16;
-typedef uint32_t u32;
-typedef int16_t i16;
-typedef int32_t i32;
+#include "ext2.h"
+
+#define DEFAULT_IMAGE_SIZE     (1024 * 1024)
+#define DEFAULT_BLOCK_SIZE     1024
+#define DEFAULT_INODE_RATIO    8192
+#define DEFAULT_IMAGE_NAME     "cs111-base.img"
 
-#define BLOCK_SIZE 1024
-#define BLOCK_OFFSET(i) (i * BLOCK_SIZE)
-#define NUM_BLOCKS 1024
-#define NUM_INODES 128
-#define BLOCKS_EACH_GROUP 8192
-#define FRAGS_EACH_GROUP  8192
-#define INODES_EACH_GROUP 128
+#undef BLOCK_SIZE               /* from <linux/fs.h> */
+#define BLOCK_SIZE geo.block_size
+#define BLOCK_OFFSET(i) ((off_t) (i) * BLOCK_SIZE)
 
 #define LOST_AND_FOUND_INO 11
-#define HELLO_WORLD_INO    12
-#define HELLO_INO          13
-#define LAST_INO           HELLO_INO
-
-#define SUPERBLOCK_BLOCKNO             1
-#define BLOCK_GROUP_DESCRIPTOR_BLOCKNO 2
-#define BLOCK_BITMAP_BLOCKNO           3
-#define INODE_BITMAP_BLOCKNO           4
-#define INODE_TABLE_BLOCKNO            5
-#define ROOT_DIR_BLOCKNO               21
-#define LOST_AND_FOUND_DIR_BLOCKNO     22
-#define HELLO_WORLD_FILE_BLOCKNO       23
-#define LAST_BLOCK                     HELLO_WORLD_FILE_BLOCKNO
-
-#define NUM_FREE_BLOCKS (NUM_BLOCKS - LAST_BLOCK - 1)
-#define NUM_FREE_INODES (NUM_INODES - LAST_INO)
-
-#define EXT2_SUPER_MAGIC 0xEF53
-
-/* http://www.nongnu.org/ext2-doc/ext2.html */
-/* http://www.science.smith.edu/~nhowe/262/oldlabs/ext2.html */
-
-#define	EXT2_BAD_INO             1
-#define EXT2_ROOT_INO            2
-#define EXT2_GOOD_OLD_FIRST_INO 11
-
-#define EXT2_GOOD_OLD_REV 0
-
-#define EXT2_S_IFSOCK 0xC000
-#define EXT2_S_IFLNK  0xA000
-#define EXT2_S_IFREG  0x8000
-#define EXT2_S_IFBLK  0x6000
-#define EXT2_S_IFDIR  0x4000
-#define EXT2_S_IFCHR  0x2000
-#define EXT2_S_IFIFO  0x1000
-#define EXT2_S_ISUID  0x0800
-#define EXT2_S_ISGID  0x0400
-#define EXT2_S_ISVTX  0x0200
-#define EXT2_S_IRUSR  0x0100
-#define EXT2_S_IWUSR  0x0080
-#define EXT2_S_IXUSR  0x0040
-#define EXT2_S_IRGRP  0x0020
-#define EXT2_S_IWGRP  0x0010
-#define EXT2_S_IXGRP  0x0008
-#define EXT2_S_IROTH  0x0004
-#define EXT2_S_IWOTH  0x0002
-#define EXT2_S_IXOTH  0x0001
-
-#define	EXT2_NDIR_BLOCKS 12
-#define	EXT2_IND_BLOCK   EXT2_NDIR_BLOCKS
-#define	EXT2_DIND_BLOCK  (EXT2_IND_BLOCK + 1)
-#define	EXT2_TIND_BLOCK  (EXT2_DIND_BLOCK + 1)
-#define	EXT2_N_BLOCKS    (EXT2_TIND_BLOCK + 1)
-
-#define EXT2_NAME_LEN 255
-
-struct ext2_superblock {
-	u32 s_inodes_count;
-	u32 s_blocks_count;
-	u32 s_r_blocks_count;
-	u32 s_free_blocks_count;
-	u32 s_free_inodes_count;
-	u32 s_first_data_block;
-	u32 s_log_block_size;
-	i32 s_log_frag_size;
-	u32 s_blocks_per_group;
-	u32 s_frags_per_group;
-	u32 s_inodes_per_group;
-	u32 s_mtime;
-	u32 s_wtime;
-	u16 s_mnt_count;
-	i16 s_max_mnt_count;
-	u16 s_magic;
-	u16 s_state;
-	u16 s_errors;
-	u16 s_minor_rev_level;
-	u32 s_lastcheck;
-	u32 s_checkinterval;
-	u32 s_creator_os;
-	u32 s_rev_level;
-	u16 s_def_resuid;
-	u16 s_def_resgid;
-	u32 s_pad[5];
-	u8 s_uuid[16];
-	u8 s_volume_name[16];
-	u32 s_reserved[229];
+
+/* Regular file contents are copied into the image through a pipeline
+   of PIPELINE_BUFFERS buffers of PIPELINE_BUFFER_SIZE bytes each.  */
+#define PIPELINE_BUFFERS     8
+#define PIPELINE_BUFFER_SIZE (1 << 20)
+
+/* The shape of the file system being built.  Every group but the last
+   has blocks_per_group blocks; each has inodes_per_group inodes, whose
+   table takes inode_table_blocks blocks.  */
+struct geometry {
+	u32 block_size;
+	u32 log_block_size;     /* block_size == 1024 << log_block_size */
+	u32 blocks_count;
+	u32 first_data_block;
+	u32 blocks_per_group;
+	u32 inodes_per_group;
+	u32 inode_table_blocks;
+	u32 groups_count;
+	u32 gdt_blocks;         /* blocks taken by the descriptor table */
+	u32 inodes_count;
+};
+
+static struct geometry geo;
+
+/* A run of COUNT blocks of a file, from logical block LOGICAL on, that
+   sits at blocks PHYSICAL, PHYSICAL + 1, ... of the image.  */
+struct extent {
+	u64 logical;
+	u32 physical;
+	u32 count;
 };
 
-struct ext2_block_group_descriptor
-{
-	u32 bg_block_bitmap;
-	u32 bg_inode_bitmap;
-	u32 bg_inode_table;
-	u16 bg_free_blocks_count;
-	u16 bg_free_inodes_count;
-	u16 bg_used_dirs_count;
-	u16 bg_pad;
-	u32 bg_reserved[3];
+/* An indirect block being filled in, and the child of it that was
+   filled in last.  Blocks are mapped in logical order, so that child is
+   the only one that can still gain entries.  */
+struct indirect {
+	u32 blockno;
+	u32 *entries;
+	struct indirect *last_child;
 };
 
-struct ext2_inode {
-	u16 i_mode;
-	u16 i_uid;
-	u32 i_size;
-	u32 i_atime;
-	u32 i_ctime;
-	u32 i_mtime;
-	u32 i_dtime;
-	u16 i_gid;
-	u16 i_links_count;
-	u32 i_blocks;
-	u32 i_flags;
-	u32 i_reserved1;
+/* Where the blocks of a file went: its i_block array, the extents of
+   its data, and the indirect blocks to be written.  NBLOCKS counts both
+   data and indirect blocks.  */
+struct blockmap {
 	u32 i_block[EXT2_N_BLOCKS];
-	u32 i_version;
-	u32 i_file_acl;
-	u32 i_dir_acl;
-	u32 i_faddr;
-	u8  i_frag;
-	u8  i_fsize;
-	u16 i_pad1;
-	u32 i_reserved2[2];
+	u32 nblocks;
+	struct extent *extents;
+	size_t nextents;
+	struct indirect *root[3];    /* under IND, DIND and TIND */
+	struct indirect **indirect;
+	size_t nindirect;
+};
+
+/* A file, directory, symlink or special file to be put in the image.
+   A regular file's contents come from the host file PATH or, for the
+   built-in contents, from DATA; a symlink's target is in DATA.  A
+   further hard link to a host file already in the tree is only a
+   directory entry for the inode of LINK, the node of its first link.
+
+   For incremental builds, HOST_INO, MTIME_NS and CTIME_NS tell whether
+   the host file may have changed since the last build, and HASH is a
+   hash of the contents (of a directory, its entries).  OLD is the
+   node's record in the last build's manifest.  IN_IMAGE nodes keep the
+   blocks they already have in the image, and their inode is only
+   rewritten if CHANGED.  */
+struct node {
+	char *name;
+	char *path;
+	const char *data;
+	u64 size;
+	u16 mode;
+	u32 uid;
+	u32 gid;
+	u16 links_count;
+	u32 atime;
+	u32 ctime;
+	u32 mtime;
+	dev_t rdev;
+	u32 ino;
+	struct node *link;
+	struct node *parent;
+	struct node **children;
+	size_t nchildren;
+	struct blockmap map;
+	bool indexed;
+	u64 host_ino;
+	u64 mtime_ns;
+	u64 ctime_ns;
+	u64 hash;
+	struct record *old;
+	bool in_image;
+	bool changed;
 };
 
-struct ext2_dir_entry {
-	u32 inode;
-	u16 rec_len;
-	u16 name_len;
-	u8  name[EXT2_NAME_LEN];
+/* A bitmap of NBITS bits, held in 64-bit words so that it can be
+   scanned and filled a word at a time.  On a little-endian host the
+   words are laid out just like an ext2 bitmap block.  DIRTY is set
+   once it differs from the bitmap block in the image.  */
+struct bitmap {
+	u64 *words;
+	u32 nbits;
+	bool dirty;
 };
 
+/* The block and inode bitmaps of each group, and where the allocators
+   start looking: blocks are handed out in order from block_goal, and
+   inodes from inode_goal.  MAX_INO is the largest inode in use.  */
+static struct bitmap *block_bitmaps;
+static struct bitmap *inode_bitmaps;
+static u32 block_goal;
+static u32 inode_goal = EXT2_GOOD_OLD_FIRST_INO;
+static u32 max_ino;
+static u32 *group_dirs;
+
+/* The run of blocks set aside for the file being allocated, and how
+   many more blocks that file needs.  */
+static u32 run_start;
+static u32 run_count;
+static u64 blocks_wanted;
+
+/* The group descriptors, each filled in by whichever worker builds the
+   group, and the node of each inode in use, indexed by inode number.  */
+static struct ext2_block_group_descriptor *group_desc;
+static struct node **inode_nodes;
+static u32 feature_compat;
+static bool made_lost_and_found;
+
+/* In reproducible mode (-T or SOURCE_DATE_EPOCH) the image depends only
+   on its source: EPOCH stands in for the current time and bounds the
+   times taken from the host, and UUID is derived from the tree.  */
+static bool reproducible;
+static u32 epoch;
+static u8 uuid[16] = {
+	0x5A, 0x1E, 0xAB, 0x1E, 0x13, 0x37, 0x13, 0x37,
+	0x13, 0x37, 0xC0, 0xFF, 0xEE, 0xC0, 0xFF, 0xEE,
+};
+
+/* With -D, file blocks of nothing but zeroes are left as holes, and
+   other blocks seen before are shared through block_index.  */
+static bool dedup;
+
+/* How host file contents get into the image (-w).  COPY copies them in
+   the kernel where it can, and otherwise does as PWRITE does; the rest
+   always read them into buffers and write them with pwrite, lseek and
+   write, pwritev of the runs that follow on from each other, a copy
+   into the mapping, or writes queued on an io_uring.  */
+enum writer {
+	WRITER_COPY,
+	WRITER_PWRITE,
+	WRITER_WRITE,
+	WRITER_PWRITEV,
+	WRITER_MMAP,
+	WRITER_IO_URING,
+	WRITERS_COUNT,
+};
+
+static const char *const writer_names[] = {
+	[WRITER_COPY] = "copy",
+	[WRITER_PWRITE] = "pwrite",
+	[WRITER_WRITE] = "write",
+	[WRITER_PWRITEV] = "pwritev",
+	[WRITER_MMAP] = "mmap",
+	[WRITER_IO_URING] = "io_uring",
+};
+
+static enum writer writer = WRITER_COPY;
+
+/* How many writes the io_uring writer keeps in flight (-q).  */
+static unsigned queue_depth = 32;
+
+/* For -v: the system calls made to read and write file contents, and
+   the bytes of contents written to the image.  */
+static atomic_ullong io_syscalls;
+static atomic_ullong io_bytes;
+static u32 feature_ro_compat = EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER;
+
+/* The image file and its shared mapping.  Metadata is stored straight
+   into the mapping by offset, so pages that are never touched stay
+   holes in the file.  */
+static int image_fd;
+static u8 *image_base;
+
 #define errno_exit(str)                                                        \
 	do { int err = errno; perror(str); exit(err); } while (0)
 
-#define dir_entry_set(entry, inode_num, str)                                   \
-	do {                                                                   \
-		char *s = str;                                                 \
-		size_t len = strlen(s);                                        \
-		entry.inode = inode_num;                                       \
-		entry.name_len = len;                                          \
-		memcpy(&entry.name, s, len);                                   \
-		if ((len % 4) != 0) {                                          \
-			entry.rec_len = 12 + len / 4 * 4;                      \
-		}                                                              \
-		else {                                                         \
-			entry.rec_len = 8 + len;                               \
-		}                                                              \
-	} while (0)
-
-#define dir_entry_write(entry, fd)                                             \
-	do {                                                                   \
-		size_t size = entry.rec_len;                                   \
-		if (write(fd, &entry, size) != size) {                         \
-			errno_exit("write");                                   \
-		}                                                              \
-	} while (0)
+/* Return whether group G holds a copy of the superblock and group
+   descriptor table.  With sparse_super these are groups 0 and 1 and the
+   powers of 3, 5 and 7.  */
+static bool group_has_super(u32 g) {
+	if (g <= 1) {
+		return true;
+	}
+	for (u32 base = 3; base <= 7; base += 2) {
+		u32 n = base;
+		while (n < g) {
+			n *= base;
+		}
+		if (n == g) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static u32 group_first_block(u32 g) {
+	return geo.first_data_block + g * geo.blocks_per_group;
+}
+
+static u32 group_blocks_count(u32 g) {
+	if (g + 1 < geo.groups_count) {
+		return geo.blocks_per_group;
+	}
+	return geo.blocks_count - group_first_block(g);
+}
+
+static u32 group_block_bitmap(u32 g) {
+	return group_first_block(g)
+	       + (group_has_super(g) ? 1 + geo.gdt_blocks : 0);
+}
+
+static u32 group_inode_bitmap(u32 g) {
+	return group_block_bitmap(g) + 1;
+}
+
+static u32 group_inode_table(u32 g) {
+	return group_block_bitmap(g) + 2;
+}
+
+/* The first block of group G past its metadata.  */
+static u32 group_data_block(u32 g) {
+	return group_inode_table(g) + geo.inode_table_blocks;
+}
+
+/* Lay out a file system of SIZE bytes in blocks of BLOCK_SIZE bytes,
+   with one inode per INODE_RATIO bytes, into geo.  Exit with EINVAL if
+   that does not make a usable file system.  */
+void compute_geometry(u64 size, u32 block_size, u32 inode_ratio) {
+	if (block_size != 1024 && block_size != 2048 && block_size != 4096) {
+		fprintf(stderr, "block size must be 1024, 2048 or 4096\n");
+		exit(EINVAL);
+	}
+	if (inode_ratio < block_size) {
+		fprintf(stderr, "inode ratio must be at least the block size\n");
+		exit(EINVAL);
+	}
+	if (size / block_size > UINT32_MAX) {
+		fprintf(stderr, "image too large for block size %u\n", block_size);
+		exit(EINVAL);
+	}
+
+	geo.block_size = block_size;
+	geo.log_block_size = __builtin_ctz(block_size) - 10;
+	geo.blocks_count = size / block_size;
+	geo.first_data_block = block_size == 1024 ? 1 : 0;
+	geo.blocks_per_group = 8 * block_size;
+	if (geo.blocks_count <= geo.first_data_block) {
+		fprintf(stderr, "image too small\n");
+		exit(EINVAL);
+	}
+
+	u32 data_blocks = geo.blocks_count - geo.first_data_block;
+	geo.groups_count = (data_blocks + geo.blocks_per_group - 1)
+	                   / geo.blocks_per_group;
+
+	u32 inodes_per_block = block_size / EXT2_GOOD_OLD_INODE_SIZE;
+	u64 inodes = size / inode_ratio;
+	for (;;) {
+		/* Spread the inodes evenly over the groups there are now,
+		   filling whole inode table blocks.  */
+		u64 ipg = (inodes + geo.groups_count - 1) / geo.groups_count;
+		if (ipg < LOST_AND_FOUND_INO) {
+			ipg = LOST_AND_FOUND_INO;
+		}
+		ipg = (ipg + inodes_per_block - 1) / inodes_per_block
+		      * inodes_per_block;
+		ipg = (ipg + 7) / 8 * 8;
+		if (ipg > 8 * block_size) {
+			ipg = 8 * block_size;
+		}
+		geo.inodes_per_group = ipg;
+		geo.inode_table_blocks = ipg / inodes_per_block;
+
+		geo.gdt_blocks = (geo.groups_count
+		                  * sizeof(struct ext2_block_group_descriptor)
+		                  + block_size - 1) / block_size;
+
+		/* Drop a last group too small to hold its own metadata and
+		   some data, as mke2fs does, and spread the inodes again.  */
+		u32 g = geo.groups_count - 1;
+		u32 overhead = group_data_block(g) - group_first_block(g);
+		if (g == 0 || group_blocks_count(g) >= overhead + 50) {
+			break;
+		}
+		geo.blocks_count = group_first_block(g);
+		geo.groups_count--;
+	}
+
+	/* Group 0 must hold its metadata and the fixed contents.  */
+	if (group_data_block(0) + 3 > group_first_block(0)
+	                              + group_blocks_count(0)) {
+		fprintf(stderr, "image too small\n");
+		exit(EINVAL);
+	}
+	if ((u64) geo.inodes_per_group * geo.groups_count > UINT32_MAX) {
+		fprintf(stderr, "too many inodes\n");
+		exit(EINVAL);
+	}
+	geo.inodes_count = geo.inodes_per_group * geo.groups_count;
+}
+
+/* Set bits FIRST through LAST - 1 of WORDS, or clear them if not SET,
+   and return whether any of them changed.  */
+static bool words_change_range(u64 *words, u32 first, u32 last, bool set) {
+	bool changed = false;
+	while (first < last) {
+		u32 bit = first % 64;
+		u32 n = last - first < 64 - bit ? last - first : 64 - bit;
+		u64 mask = n == 64 ? ~0ULL : ((1ULL << n) - 1) << bit;
+		u64 old = words[first / 64];
+		words[first / 64] = set ? old | mask : old & ~mask;
+		changed |= words[first / 64] != old;
+		first += n;
+	}
+	return changed;
+}
+
+/* Set bits FIRST through LAST - 1 of WORDS.  */
+static void words_set_range(u64 *words, u32 first, u32 last) {
+	words_change_range(words, first, last, true);
+}
+
+static void bitmap_init(struct bitmap *bm, u32 nbits) {
+	bm->words = calloc((nbits + 63) / 64, sizeof(u64));
+	if (!bm->words) {
+		errno_exit("calloc");
+	}
+	bm->nbits = nbits;
+	bm->dirty = true;
+}
+
+static void bitmap_set_range(struct bitmap *bm, u32 first, u32 last) {
+	bm->dirty |= words_change_range(bm->words, first, last, true);
+}
+
+static void bitmap_clear_range(struct bitmap *bm, u32 first, u32 last) {
+	bm->dirty |= words_change_range(bm->words, first, last, false);
+}
+
+/* Return the first bit of BM from FROM on that is set if SET, or clear
+   otherwise, or BM->nbits if there is none.  */
+static u32 bitmap_find(const struct bitmap *bm, u32 from, bool set) {
+	if (from >= bm->nbits) {
+		return bm->nbits;
+	}
+	u64 flip = set ? 0 : ~0ULL;
+	u32 w = from / 64;
+	u64 word = (bm->words[w] ^ flip) & (~0ULL << (from % 64));
+	while (!word) {
+		if (++w == (bm->nbits + 63) / 64) {
+			return bm->nbits;
+		}
+		word = bm->words[w] ^ flip;
+	}
+	u32 bit = w * 64 + __builtin_ctzll(word);
+	return bit < bm->nbits ? bit : bm->nbits;
+}
+
+/* Return the number of bits set in BM.  */
+static u32 bitmap_count(const struct bitmap *bm) {
+	u32 count = 0;
+	for (u32 w = 0; w < (bm->nbits + 63) / 64; ++w) {
+		count += __builtin_popcountll(bm->words[w]);
+	}
+	return count;
+}
+
+/* Set up the bitmaps with the metadata of every group and the reserved
+   inodes marked in use.  */
+static void init_bitmaps() {
+	block_bitmaps = calloc(geo.groups_count, sizeof(*block_bitmaps));
+	inode_bitmaps = calloc(geo.groups_count, sizeof(*inode_bitmaps));
+	if (!block_bitmaps || !inode_bitmaps) {
+		errno_exit("calloc");
+	}
+	for (u32 g = 0; g < geo.groups_count; ++g) {
+		bitmap_init(&block_bitmaps[g], group_blocks_count(g));
+		bitmap_set_range(&block_bitmaps[g], 0,
+		                 group_data_block(g) - group_first_block(g));
+		bitmap_init(&inode_bitmaps[g], geo.inodes_per_group);
+	}
+	bitmap_set_range(&inode_bitmaps[0], 0, EXT2_GOOD_OLD_FIRST_INO - 1);
+	block_goal = group_data_block(0);
+}
+
+/* Allocate a run of up to WANT free blocks, the first at or after the
+   goal, and return its first block; store its length in *COUNT.  Exit
+   with ENOSPC if the image is full.  */
+static u32 alloc_blocks(u64 want, u32 *count) {
+	u32 g = (block_goal - geo.first_data_block) / geo.blocks_per_group;
+	u32 from = block_goal - group_first_block(g);
+	for (u32 i = 0; i < geo.groups_count; ++i) {
+		struct bitmap *bm = &block_bitmaps[g];
+		u32 first = bitmap_find(bm, from, false);
+		if (first < bm->nbits) {
+			u32 end = bitmap_find(bm, first, true);
+			if (end - first > want) {
+				end = first + want;
+			}
+			bitmap_set_range(bm, first, end);
+			*count = end - first;
+			block_goal = group_first_block(g) + end;
+			return group_first_block(g) + first;
+		}
+		g = (g + 1) % geo.groups_count;
+		from = 0;
+	}
+	fprintf(stderr, "image full: use a larger -s\n");
+	exit(ENOSPC);
+}
+
+/* Return a new block for the file being allocated, from the run set
+   aside for it.  */
+static u32 alloc_block() {
+	if (!run_count) {
+		run_start = alloc_blocks(blocks_wanted ? blocks_wanted : 1,
+		                         &run_count);
+	}
+	if (blocks_wanted) {
+		blocks_wanted--;
+	}
+	run_count--;
+	return run_start++;
+}
+
+/* Mark inode INO in use.  */
+static void mark_inode(u32 ino) {
+	u32 g = (ino - 1) / geo.inodes_per_group;
+	u32 i = (ino - 1) % geo.inodes_per_group;
+	bitmap_set_range(&inode_bitmaps[g], i, i + 1);
+	if (ino > max_ino) {
+		max_ino = ino;
+	}
+}
+
+/* Return a new inode number.  Exit with ENOSPC if there are none left.  */
+static u32 alloc_inode() {
+	for (u32 g = (inode_goal - 1) / geo.inodes_per_group;
+	     g < geo.groups_count; ++g) {
+		u32 from = g == (inode_goal - 1) / geo.inodes_per_group
+		           ? (inode_goal - 1) % geo.inodes_per_group : 0;
+		u32 i = bitmap_find(&inode_bitmaps[g], from, false);
+		if (i < geo.inodes_per_group) {
+			u32 ino = g * geo.inodes_per_group + i + 1;
+			mark_inode(ino);
+			inode_goal = ino + 1;
+			return ino;
+		}
+	}
+	fprintf(stderr, "out of inodes: use a larger -s or smaller -i\n");
+	exit(ENOSPC);
+}
+
+/* Mark the COUNT blocks from START on in use if USED, or free
+   otherwise.  */
+static void mark_blocks(u32 start, u32 count, bool used) {
+	while (count) {
+		u32 g = (start - geo.first_data_block) / geo.blocks_per_group;
+		u32 first = start - group_first_block(g);
+		u32 n = group_blocks_count(g) - first;
+		if (n > count) {
+			n = count;
+		}
+		if (used) {
+			bitmap_set_range(&block_bitmaps[g], first, first + n);
+		} else {
+			bitmap_clear_range(&block_bitmaps[g], first, first + n);
+		}
+		start += n;
+		count -= n;
+	}
+}
+
+static void free_inode(u32 ino) {
+	u32 g = (ino - 1) / geo.inodes_per_group;
+	u32 i = (ino - 1) % geo.inodes_per_group;
+	bitmap_clear_range(&inode_bitmaps[g], i, i + 1);
+}
+
+static u32 group_free_blocks_count(u32 g) {
+	return group_blocks_count(g) - bitmap_count(&block_bitmaps[g]);
+}
+
+static u32 group_free_inodes_count(u32 g) {
+	return geo.inodes_per_group - bitmap_count(&inode_bitmaps[g]);
+}
+
+static u32 group_used_dirs_count(u32 g) {
+	return group_dirs[g];
+}
+
+/* Create the image file NAME, sized for the geometry but all holes, and
+   map it.  If KEEP, map the image already there instead.  */
+static void open_image(const char *name, bool keep) {
+	image_fd = open(name, keep ? O_RDWR : O_CREAT | O_RDWR, 0666);
+	if (image_fd == -1) {
+		errno_exit("open");
+	}
+
+	if (!keep && ftruncate(image_fd, 0)) {
+		errno_exit("ftruncate");
+	}
+	if (ftruncate(image_fd, BLOCK_OFFSET(geo.blocks_count))) {
+		errno_exit("ftruncate");
+	}
+
+	image_base = mmap(NULL, BLOCK_OFFSET(geo.blocks_count),
+	                  PROT_READ | PROT_WRITE, MAP_SHARED, image_fd, 0);
+	if (image_base == MAP_FAILED) {
+		errno_exit("mmap");
+	}
+}
+
+/* Flush the mapping of the image and close it.  */
+static void close_image() {
+	size_t size = BLOCK_OFFSET(geo.blocks_count);
+	if (msync(image_base, size, MS_ASYNC)) {
+		errno_exit("msync");
+	}
+	if (munmap(image_base, size)) {
+		errno_exit("munmap");
+	}
+	if (close(image_fd)) {
+		errno_exit("close");
+	}
+}
+
+/* Return where byte OFF of the image is mapped.  */
+static void *image_at(off_t off) {
+	return image_base + off;
+}
 
 u32 get_current_time() {
+	if (reproducible) {
+		return epoch;
+	}
 	time_t t = time(NULL);
 	if (t == ((time_t) -1)) {
 		errno_exit("time");
@@ -189,26 +588,30 @@ u32 get_current_time() {
 	return t;
 }
 
-void write_superblock(int fd) {
-    off_t off = lseek(fd, BLOCK_OFFSET(1), SEEK_SET);
-    if (off == -1) {
-        errno_exit("lseek");
-    }
-
+/* Write the copy of the superblock held by group G.  */
+void write_superblock(u32 g) {
+    off_t off = g == 0 ? SUPERBLOCK_OFFSET : BLOCK_OFFSET(group_first_block(g));
     u32 current_time = get_current_time();
 
+    u32 free_blocks = 0;
+    u32 free_inodes = 0;
+    for (u32 i = 0; i < geo.groups_count; ++i) {
+        free_blocks += group_desc[i].bg_free_blocks_count;
+        free_inodes += group_desc[i].bg_free_inodes_count;
+    }
+
     struct ext2_superblock superblock = {0};
-    superblock.s_inodes_count = NUM_INODES;
-    superblock.s_blocks_count = NUM_BLOCKS;
+    superblock.s_inodes_count = geo.inodes_count;
+    superblock.s_blocks_count = geo.blocks_count;
     superblock.s_r_blocks_count = 0;
-    superblock.s_free_blocks_count = NUM_FREE_BLOCKS;
-    superblock.s_free_inodes_count = NUM_FREE_INODES;
-    superblock.s_first_data_block = SUPERBLOCK_BLOCKNO; /* First Data Block */
-    superblock.s_log_block_size = 0;                    /* 1024 */
-    superblock.s_log_frag_size = 0;                     /* 1024 */
-    superblock.s_blocks_per_group = BLOCKS_EACH_GROUP;
-    superblock.s_frags_per_group = FRAGS_EACH_GROUP;
-    superblock.s_inodes_per_group = INODES_EACH_GROUP;
+    superblock.s_free_blocks_count = free_blocks;
+    superblock.s_free_inodes_count = free_inodes;
+    superblock.s_first_data_block = geo.first_data_block; /* First Data Block */
+    superblock.s_log_block_size = geo.log_block_size;     /* 1024 << n */
+    superblock.s_log_frag_size = geo.log_block_size;      /* 1024 << n */
+    superblock.s_blocks_per_group = geo.blocks_per_group;
+    superblock.s_frags_per_group = geo.blocks_per_group;
+    superblock.s_inodes_per_group = geo.inodes_per_group;
     superblock.s_mtime = 0;                             /* Mount time */
     superblock.s_wtime = current_time;                  /* Write time */
     superblock.s_mnt_count = 0;                         /* Number of times mounted so far */
@@ -220,335 +623,2760 @@ void write_superblock(int fd) {
     superblock.s_lastcheck = current_time;              /* Last check time */
     superblock.s_checkinterval = 1;                     /* Force checks by making them every 1 second */
     superblock.s_creator_os = 0;                        /* Linux */
-    superblock.s_rev_level = 0;                         /* Leave this as 0 */
+    superblock.s_rev_level = EXT2_DYNAMIC_REV;          /* For sparse_super */
     superblock.s_def_resuid = 0;                        /* root */
     superblock.s_def_resgid = 0;                        /* root */
+    superblock.s_first_ino = EXT2_GOOD_OLD_FIRST_INO;
+    superblock.s_inode_size = EXT2_GOOD_OLD_INODE_SIZE;
+    superblock.s_block_group_nr = g;                    /* Group holding this copy */
+    superblock.s_feature_compat = feature_compat;
+    superblock.s_feature_ro_compat = feature_ro_compat;
 
-    superblock.s_uuid[0] = 0x5A;
-    superblock.s_uuid[1] = 0x1E;
-    superblock.s_uuid[2] = 0xAB;
-    superblock.s_uuid[3] = 0x1E;
-    superblock.s_uuid[4] = 0x13;
-    superblock.s_uuid[5] = 0x37;
-    superblock.s_uuid[6] = 0x13;
-    superblock.s_uuid[7] = 0x37;
-    superblock.s_uuid[8] = 0x13;
-    superblock.s_uuid[9] = 0x37;
-    superblock.s_uuid[10] = 0xC0;
-    superblock.s_uuid[11] = 0xFF;
-    superblock.s_uuid[12] = 0xEE;
-    superblock.s_uuid[13] = 0xC0;
-    superblock.s_uuid[14] = 0xFF;
-    superblock.s_uuid[15] = 0xEE;
+    memcpy(superblock.s_uuid, uuid, sizeof(uuid));
 
     memcpy(&superblock.s_volume_name, "cs111-base", 10);
 
-    ssize_t size = sizeof(superblock);
-    if (write(fd, &superblock, size) != size) {
-        errno_exit("write");
-    }
+    superblock.s_def_hash_version = EXT2_HASH_HALF_MD4; /* For new htree directories */
+    superblock.s_flags = EXT2_FLAGS_UNSIGNED_HASH;      /* What dx_hash assumes */
+
+    memcpy(image_at(off), &superblock, sizeof(superblock));
 }
 
 
-void write_block_group_descriptor_table(int fd) {
-    off_t off = lseek(fd, BLOCK_OFFSET(BLOCK_GROUP_DESCRIPTOR_BLOCKNO), SEEK_SET);
-    if (off == -1) {
-        errno_exit("lseek");
-    }
+/* Write the copy of the group descriptor table held by group G.  */
+void write_block_group_descriptor_table(u32 g) {
+    memcpy(image_at(BLOCK_OFFSET(group_first_block(g) + 1)), group_desc,
+           geo.groups_count * sizeof(*group_desc));
+}
 
-    struct ext2_block_group_descriptor block_group_descriptor = {0};
-    block_group_descriptor.bg_block_bitmap = BLOCK_BITMAP_BLOCKNO;
-    block_group_descriptor.bg_inode_bitmap = INODE_BITMAP_BLOCKNO;
-    block_group_descriptor.bg_inode_table = INODE_TABLE_BLOCKNO;
-    block_group_descriptor.bg_free_blocks_count = NUM_FREE_BLOCKS;
-    block_group_descriptor.bg_free_inodes_count = NUM_FREE_INODES;
-    block_group_descriptor.bg_used_dirs_count = 2;
-
-    ssize_t size = sizeof(block_group_descriptor);
-    if (write(fd, &block_group_descriptor, size) != size) {
-        errno_exit("write");
-    }
+void fill_block_group_descriptor(u32 g) {
+    group_desc[g].bg_block_bitmap = group_block_bitmap(g);
+    group_desc[g].bg_inode_bitmap = group_inode_bitmap(g);
+    group_desc[g].bg_inode_table = group_inode_table(g);
+    group_desc[g].bg_free_blocks_count = group_free_blocks_count(g);
+    group_desc[g].bg_free_inodes_count = group_free_inodes_count(g);
+    group_desc[g].bg_used_dirs_count = group_used_dirs_count(g);
 }
 
-void write_block_bitmap(int fd) {
-    unsigned char *bitmap = calloc(BLOCK_SIZE, sizeof(unsigned char));
-    if (!bitmap) {
-        errno_exit("calloc");
+/* Copy bitmap BM into the bitmap block BLOCKNO, with the bits past its
+   end set as padding, unless the block already holds it.  */
+static void write_bitmap(const struct bitmap *bm, u32 blockno) {
+    if (!bm->dirty) {
+        return;
     }
+    u64 *words = image_at(BLOCK_OFFSET(blockno));
+    memcpy(words, bm->words, (bm->nbits + 63) / 64 * sizeof(u64));
+    words_set_range(words, bm->nbits, 8 * BLOCK_SIZE);
+}
 
-    for (int i = 0; i < BLOCK_SIZE; ++i) {
-        int cur_start = i * 8;
-        int cur_end = (i + 1) * 8;
-
-        if (cur_end <= LAST_BLOCK) {
-            bitmap[i] = 0xFF;
-        } else if (cur_start < LAST_BLOCK && cur_end >= LAST_BLOCK) {
-            bitmap[i] = (2 << (LAST_BLOCK - cur_start - 1)) - 1;
-        } else if (cur_start < (NUM_BLOCKS - 1) && cur_end >= (NUM_BLOCKS - 1)) {
-            bitmap[i] = (2 << 7) - (2 << (NUM_BLOCKS - 1 - cur_start - 1));
-        } else if (cur_end >= (NUM_BLOCKS - 1)) {
-            bitmap[i] = 0xFF;
-        }
-    }
+void write_block_bitmap(u32 g) {
+    /* Bit i stands for block group_first_block(g) + i.  */
+    write_bitmap(&block_bitmaps[g], group_block_bitmap(g));
+}
 
-    off_t off = lseek(fd, BLOCK_OFFSET(BLOCK_BITMAP_BLOCKNO), SEEK_SET);
-    if (off == -1) {
-        free(bitmap);
-        errno_exit("lseek");
-    }
 
-    ssize_t size = BLOCK_SIZE * sizeof(unsigned char);
-    if (write(fd, bitmap, size) != size) {
-        free(bitmap);
-        errno_exit("write");
-    }
+void write_inode_bitmap(u32 g) {
+    /* Bit i stands for inode g * inodes_per_group + i + 1.  */
+    write_bitmap(&inode_bitmaps[g], group_inode_bitmap(g));
+}
 
-    free(bitmap);
+
+/* Return where inode INDEX is mapped.  */
+static struct ext2_inode *inode_at(u32 index) {
+	u32 g = (index - 1) / geo.inodes_per_group;
+	off_t off = BLOCK_OFFSET(group_inode_table(g))
+	            + (index - 1) % geo.inodes_per_group
+	              * sizeof(struct ext2_inode);
+	return image_at(off);
 }
 
+void write_inode(u32 index, struct ext2_inode *inode) {
+	memcpy(inode_at(index), inode, sizeof(*inode));
+}
 
-void write_inode_bitmap(int fd) {
-    off_t off = lseek(fd, BLOCK_OFFSET(INODE_BITMAP_BLOCKNO), SEEK_SET);
-    if (off == -1) {
-        errno_exit("lseek");
-    }
+static void *xcalloc(size_t nmemb, size_t size) {
+	void *p = calloc(nmemb, size);
+	if (!p) {
+		errno_exit("calloc");
+	}
+	return p;
+}
 
-    u8 map_value[BLOCK_SIZE] = {0};
-
-    for (int i = 0; i < BLOCK_SIZE; ++i) {
-        int cur_start = i * 8;
-        int cur_end = (i + 1) * 8;
-
-        if (cur_end <= LAST_INO) {
-            map_value[i] = 0xFF;
-        } else if (cur_start < LAST_INO && cur_end > LAST_INO) {
-            map_value[i] = (2 << (LAST_INO - cur_start - 1)) - 1;
-        } else if (cur_start < NUM_INODES && cur_end > NUM_INODES) {
-            map_value[i] = 0xFF - ((2 << (NUM_INODES - cur_start - 1)) - 1);
-        } else if (cur_end > NUM_INODES) {
-            map_value[i] = 0xFF;
-        }
-    }
+/* Make room for one more element at the end of ARRAY, which has N
+   elements of SIZE bytes.  Arrays grow by doubling, so they only need
+   to be reallocated when N is zero or a power of two.  */
+static void *grow(void *array, size_t n, size_t size) {
+	if (n & (n - 1)) {
+		return array;
+	}
+	array = realloc(array, (n ? 2 * n : 1) * size);
+	if (!array) {
+		errno_exit("realloc");
+	}
+	return array;
+}
 
-    if (write(fd, map_value, BLOCK_SIZE) != BLOCK_SIZE) {
-        errno_exit("write");
-    }
+static bool is_dir(const struct node *node) {
+	return (node->mode & 0xF000) == EXT2_S_IFDIR;
 }
 
+static bool is_reg(const struct node *node) {
+	return (node->mode & 0xF000) == EXT2_S_IFREG;
+}
 
-void write_inode(int fd, u32 index, struct ext2_inode *inode) {
-	off_t off = BLOCK_OFFSET(INODE_TABLE_BLOCKNO)
-	            + (index - 1) * sizeof(struct ext2_inode);
-	off = lseek(fd, off, SEEK_SET);
-	if (off == -1) {
-		errno_exit("lseek");
-	}
+static bool is_symlink(const struct node *node) {
+	return (node->mode & 0xF000) == EXT2_S_IFLNK;
+}
+
+static bool is_device(const struct node *node) {
+	return (node->mode & 0xF000) == EXT2_S_IFCHR
+	       || (node->mode & 0xF000) == EXT2_S_IFBLK;
+}
 
-	ssize_t size = sizeof(struct ext2_inode);
-	if (write(fd, inode, size) != size) {
-		errno_exit("write");
+/* Return a new node with MODE, named NAME in directory PARENT, or a
+   root directory if PARENT is null.  */
+static struct node *new_node(struct node *parent, const char *name, u16 mode) {
+	struct node *node = xcalloc(1, sizeof(*node));
+	node->mode = mode;
+	node->links_count = is_dir(node) ? 2 : 1;
+	if (parent) {
+		node->name = strdup(name);
+		if (!node->name) {
+			errno_exit("strdup");
+		}
+		node->parent = parent;
+		parent->children = grow(parent->children, parent->nchildren,
+		                        sizeof(*parent->children));
+		parent->children[parent->nchildren++] = node;
+		if (is_dir(node)) {
+			parent->links_count++;
+		}
 	}
+	return node;
+}
+
+static void set_times(struct node *node, u32 time) {
+	node->atime = time;
+	node->ctime = time;
+	node->mtime = time;
+}
+
+static void add_lost_and_found(struct node *root, u32 time) {
+	struct node *lost_and_found = new_node(root, "lost+found",
+	                                       EXT2_S_IFDIR
+	                                       | EXT2_S_IRUSR
+	                                       | EXT2_S_IWUSR
+	                                       | EXT2_S_IXUSR
+	                                       | EXT2_S_IRGRP
+	                                       | EXT2_S_IXGRP
+	                                       | EXT2_S_IROTH
+	                                       | EXT2_S_IXOTH);
+	set_times(lost_and_found, time);
+	lost_and_found->ino = LOST_AND_FOUND_INO;
+	mark_inode(LOST_AND_FOUND_INO);
+	made_lost_and_found = true;
 }
 
-void write_inode_table(int fd) {
+/* Return the built-in tree: a root directory holding lost+found, the
+   file hello-world and the symlink hello to it.  */
+static struct node *build_default_tree() {
 	u32 current_time = get_current_time();
 
-	struct ext2_inode lost_and_found_inode = {0};
-	lost_and_found_inode.i_mode = EXT2_S_IFDIR
-	                              | EXT2_S_IRUSR
-	                              | EXT2_S_IWUSR
-	                              | EXT2_S_IXUSR
-	                              | EXT2_S_IRGRP
-	                              | EXT2_S_IXGRP
-	                              | EXT2_S_IROTH
-	                              | EXT2_S_IXOTH;
-	lost_and_found_inode.i_uid = 0;
-	lost_and_found_inode.i_size = 1024;
-	lost_and_found_inode.i_atime = current_time;
-	lost_and_found_inode.i_ctime = current_time;
-	lost_and_found_inode.i_mtime = current_time;
-	lost_and_found_inode.i_dtime = 0;
-	lost_and_found_inode.i_gid = 0;
-	lost_and_found_inode.i_links_count = 2;
-	lost_and_found_inode.i_blocks = 2;
-	lost_and_found_inode.i_block[0] = LOST_AND_FOUND_DIR_BLOCKNO;
-	write_inode(fd, LOST_AND_FOUND_INO, &lost_and_found_inode);
-
-	// TODO It's all yours
-	// TODO finish the inode entries for the other files
-	struct ext2_inode root_inode = {0};
-	root_inode.i_mode = EXT2_S_IFDIR
-	                              | EXT2_S_IRUSR
-	                              | EXT2_S_IWUSR
-	                              | EXT2_S_IXUSR
-	                              | EXT2_S_IRGRP
-	                              | EXT2_S_IXGRP
-	                              | EXT2_S_IROTH
-	                              | EXT2_S_IXOTH;
-	root_inode.i_uid = 0;
-	root_inode.i_size = 1024;
-	root_inode.i_atime = current_time;
-	root_inode.i_ctime = current_time;
-	root_inode.i_mtime = current_time;
-	root_inode.i_dtime = 0;
-	root_inode.i_gid = 0;
-	root_inode.i_links_count = 3;
-	root_inode.i_blocks = 2;
-	root_inode.i_block[0] = ROOT_DIR_BLOCKNO;
-	write_inode(fd, EXT2_ROOT_INO, &root_inode);
-	struct ext2_inode hello_world_inode = {0};
-	hello_world_inode.i_mode = EXT2_S_IFREG
-	                              | EXT2_S_IRUSR
-	                              | EXT2_S_IWUSR
-	                              | EXT2_S_IRGRP
-	                              | EXT2_S_IROTH;
-	hello_world_inode.i_uid = 1000;
-	hello_world_inode.i_size = 12;
-	hello_world_inode.i_atime = current_time;
-	hello_world_inode.i_ctime = current_time;
-	hello_world_inode.i_mtime = current_time;
-	hello_world_inode.i_dtime = 0;
-	hello_world_inode.i_gid = 1000;
-	hello_world_inode.i_links_count = 1;
-	hello_world_inode.i_blocks = 2;
-	hello_world_inode.i_block[0] = HELLO_WORLD_FILE_BLOCKNO;
-	write_inode(fd, HELLO_WORLD_INO, &hello_world_inode);
-
-	struct ext2_inode hello_sym_link_inode = {0};
-	hello_sym_link_inode.i_mode = EXT2_S_IFLNK
+	struct node *root = new_node(NULL, NULL, EXT2_S_IFDIR
+	                                         | EXT2_S_IRUSR
+	                                         | EXT2_S_IWUSR
+	                                         | EXT2_S_IXUSR
+	                                         | EXT2_S_IRGRP
+	                                         | EXT2_S_IXGRP
+	                                         | EXT2_S_IROTH
+	                                         | EXT2_S_IXOTH);
+	set_times(root, current_time);
+	root->ino = EXT2_ROOT_INO;
+
+	struct node *hello_world = new_node(root, "hello-world",
+	                                    EXT2_S_IFREG
+	                                    | EXT2_S_IRUSR
+	                                    | EXT2_S_IWUSR
+	                                    | EXT2_S_IRGRP
+	                                    | EXT2_S_IROTH);
+	set_times(hello_world, current_time);
+	hello_world->uid = 1000;
+	hello_world->gid = 1000;
+	hello_world->data = "Hello world\n";
+	hello_world->size = strlen(hello_world->data);
+
+	struct node *hello = new_node(root, "hello",
+	                              EXT2_S_IFLNK
 	                              | EXT2_S_IRUSR
 	                              | EXT2_S_IWUSR
 	                              | EXT2_S_IRGRP
-	                              | EXT2_S_IROTH;
-	hello_sym_link_inode.i_uid = 1000;
-	hello_sym_link_inode.i_size = 11;
-	hello_sym_link_inode.i_atime = current_time;
-	hello_sym_link_inode.i_ctime = current_time;
-	hello_sym_link_inode.i_mtime = current_time;
-	hello_sym_link_inode.i_dtime = 0;
-	hello_sym_link_inode.i_gid = 1000;
-	hello_sym_link_inode.i_links_count = 1;
-	hello_sym_link_inode.i_blocks = 0;
-	memcpy(hello_sym_link_inode.i_block, "hello-world", 11);
-	write_inode(fd, HELLO_INO, &hello_sym_link_inode);
+	                              | EXT2_S_IROTH);
+	set_times(hello, current_time);
+	hello->uid = 1000;
+	hello->gid = 1000;
+	hello->data = "hello-world";
+	hello->size = strlen(hello->data);
+
+	add_lost_and_found(root, current_time);
+	return root;
+}
+
+/* Return the ext2 file type bits for the host mode MODE, or 0 if ext2
+   cannot hold such a file.  */
+static u16 ext2_file_type(mode_t mode) {
+	switch (mode & S_IFMT) {
+	case S_IFSOCK: return EXT2_S_IFSOCK;
+	case S_IFLNK:  return EXT2_S_IFLNK;
+	case S_IFREG:  return EXT2_S_IFREG;
+	case S_IFBLK:  return EXT2_S_IFBLK;
+	case S_IFDIR:  return EXT2_S_IFDIR;
+	case S_IFCHR:  return EXT2_S_IFCHR;
+	case S_IFIFO:  return EXT2_S_IFIFO;
+	}
+	return 0;
+}
+
+static void set_stat(struct node *node, const struct stat *st) {
+	node->mode = ext2_file_type(st->st_mode) | (st->st_mode & 07777);
+	node->uid = st->st_uid;
+	node->gid = st->st_gid;
+	node->atime = st->st_atime;
+	node->ctime = st->st_ctime;
+	node->mtime = st->st_mtime;
+	node->rdev = st->st_rdev;
+	node->host_ino = st->st_ino;
+	node->mtime_ns = st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec;
+	node->ctime_ns = st->st_ctim.tv_sec * 1000000000ULL + st->st_ctim.tv_nsec;
+
+	/* Access and change times say when the source was read and
+	   checked out rather than what is in it, so in reproducible mode
+	   they follow the modification time, clamped to the epoch.  */
+	if (reproducible) {
+		if (st->st_mtime < 0 || st->st_mtime > epoch) {
+			node->mtime = epoch;
+		}
+		node->atime = node->mtime;
+		node->ctime = node->mtime;
+	}
+}
+
+/* The node of the first link found to each host file with more than
+   one, in an open addressing table keyed on its device and inode.  */
+struct host_link {
+	dev_t dev;
+	ino_t ino;
+	struct node *node;      /* null for an empty slot */
+};
+
+static struct host_link *host_links;
+static size_t host_links_mask;
+static size_t host_links_count;
+
+static struct host_link *host_link_slot(dev_t dev, ino_t ino) {
+	size_t i = ((u64) dev << 32 ^ ino) * 0x9e3779b97f4a7c15ULL >> 32;
+	for (;; ++i) {
+		struct host_link *l = &host_links[i & host_links_mask];
+		if (!l->node || (l->dev == dev && l->ino == ino)) {
+			return l;
+		}
+	}
+}
+
+/* Return the node already in the tree for the host file ST, which has
+   more than one link, or make NODE that node and return null.  A file
+   with more links than ext2 allows starts over with a new inode.  */
+static struct node *find_host_link(struct node *node, const struct stat *st) {
+	if (2 * (host_links_count + 1) > host_links_mask + 1) {
+		struct host_link *old = host_links;
+		size_t old_size = old ? host_links_mask + 1 : 0;
+		host_links_mask = old ? 2 * host_links_mask + 1 : 63;
+		host_links = xcalloc(host_links_mask + 1, sizeof(*host_links));
+		for (size_t i = 0; i < old_size; ++i) {
+			if (old[i].node) {
+				*host_link_slot(old[i].dev, old[i].ino) = old[i];
+			}
+		}
+		free(old);
+	}
+
+	struct host_link *l = host_link_slot(st->st_dev, st->st_ino);
+	if (l->node && l->node->links_count < EXT2_LINK_MAX) {
+		return l->node;
+	}
+	if (!l->node) {
+		host_links_count++;
+	}
+	*l = (struct host_link) {st->st_dev, st->st_ino, node};
+	return NULL;
+}
+
+static int compare_names(const void *a, const void *b) {
+	return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+/* Add to directory DIR the contents of the host directory PATH, open
+   on FD, in name order, recursively.  Entries are looked up relative to
+   FD, so the depth of the tree is not bounded by PATH_MAX.  Closes
+   FD.  */
+static void scan_dir(struct node *dir, int fd, const char *path) {
+	DIR *d = fdopendir(fd);
+	if (!d) {
+		errno_exit(path);
+	}
+
+	char **names = NULL;
+	size_t nnames = 0;
+	struct dirent *entry;
+	while ((entry = readdir(d))) {
+		if (strcmp(entry->d_name, ".") == 0
+		    || strcmp(entry->d_name, "..") == 0) {
+			continue;
+		}
+		names = grow(names, nnames, sizeof(*names));
+		names[nnames] = strdup(entry->d_name);
+		if (!names[nnames++]) {
+			errno_exit("strdup");
+		}
+	}
+	qsort(names, nnames, sizeof(*names), compare_names);
+
+	for (size_t i = 0; i < nnames; ++i) {
+		char *child_path = xcalloc(strlen(path) + strlen(names[i]) + 2, 1);
+		sprintf(child_path, "%s/%s", path, names[i]);
+
+		struct stat st;
+		if (fstatat(fd, names[i], &st, AT_SYMLINK_NOFOLLOW)) {
+			errno_exit(child_path);
+		}
+		if (!ext2_file_type(st.st_mode)) {
+			fprintf(stderr, "%s: unsupported file type\n", child_path);
+			exit(EINVAL);
+		}
+
+		struct node *child = new_node(dir, names[i],
+		                              ext2_file_type(st.st_mode));
+		set_stat(child, &st);
+		if (!S_ISDIR(st.st_mode) && st.st_nlink > 1) {
+			child->link = find_host_link(child, &st);
+		}
+		if (child->link) {
+			child->link->links_count++;
+		} else if (S_ISREG(st.st_mode)) {
+			child->path = child_path;
+			child->size = st.st_size;
+			if (child->size > INT32_MAX) {
+				feature_ro_compat |= EXT2_FEATURE_RO_COMPAT_LARGE_FILE;
+			}
+			child_path = NULL;
+		} else if (S_ISLNK(st.st_mode)) {
+			char *target = xcalloc(st.st_size + 1, 1);
+			ssize_t len = readlinkat(fd, names[i], target,
+			                         st.st_size + 1);
+			if (len < 0) {
+				errno_exit(child_path);
+			}
+			if (len > st.st_size) {
+				fprintf(stderr, "%s: symlink changed\n", child_path);
+				exit(EAGAIN);
+			}
+			child->data = target;
+			child->size = len;
+		} else if (S_ISDIR(st.st_mode)) {
+			int child_fd = openat(fd, names[i],
+			                      O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+			if (child_fd == -1) {
+				errno_exit(child_path);
+			}
+			scan_dir(child, child_fd, child_path);
+		}
+		free(child_path);
+		free(names[i]);
+	}
+	free(names);
+	if (closedir(d)) {
+		errno_exit("closedir");
+	}
+}
+
+/* Open the host file at PATH for reading.  A path too long for the
+   kernel is opened a piece at a time, each piece shorter than PATH_MAX
+   and relative to the directory the last one led to.  */
+static int open_host(const char *path) {
+	int dir_fd = AT_FDCWD;
+	char piece[PATH_MAX];
+	while (strlen(path) >= PATH_MAX) {
+		const char *end = memrchr(path, '/', PATH_MAX - 1);
+		int fd = -1;
+		if (!end || end == path) {
+			errno = ENAMETOOLONG;
+		} else {
+			memcpy(piece, path, end - path);
+			piece[end - path] = '\0';
+			fd = openat(dir_fd, piece, O_PATH | O_DIRECTORY);
+		}
+		if (dir_fd != AT_FDCWD) {
+			close(dir_fd);
+		}
+		if (fd == -1) {
+			return -1;
+		}
+		dir_fd = fd;
+		path = end + 1;
+	}
+	int fd = openat(dir_fd, path, O_RDONLY);
+	if (dir_fd != AT_FDCWD) {
+		int err = errno;
+		close(dir_fd);
+		errno = err;
+	}
+	return fd;
+}
+
+/* Return a tree holding the contents of the host directory SOURCE, and
+   a lost+found if SOURCE has none.  */
+static struct node *build_source_tree(const char *source) {
+	struct stat st;
+	if (stat(source, &st)) {
+		errno_exit(source);
+	}
+	if (!S_ISDIR(st.st_mode)) {
+		fprintf(stderr, "%s: not a directory\n", source);
+		exit(ENOTDIR);
+	}
+
+	struct node *root = new_node(NULL, NULL, EXT2_S_IFDIR);
+	set_stat(root, &st);
+	root->ino = EXT2_ROOT_INO;
+	int fd = open(source, O_RDONLY | O_DIRECTORY);
+	if (fd == -1) {
+		errno_exit(source);
+	}
+	scan_dir(root, fd, source);
+
+	for (size_t i = 0; i < root->nchildren; ++i) {
+		if (strcmp(root->children[i]->name, "lost+found") == 0) {
+			return root;
+		}
+	}
+	add_lost_and_found(root, get_current_time());
+	return root;
 }
 
-void write_root_dir_block(int fd)
-{
-	//TODO it's all yours
-	off_t offset = BLOCK_OFFSET(ROOT_DIR_BLOCKNO);
-	offset = lseek(fd, offset, SEEK_SET);
-	if (offset == -1) {
-		errno_exit("lseek");
+/* Give every node in the tree under NODE an inode, in depth-first
+   order, and count the directories of each group.  Further hard links
+   come after their first and share its inode.  */
+static void assign_inodes(struct node *node) {
+	if (node->link) {
+		node->ino = node->link->ino;
+	} else if (!node->ino) {
+		node->ino = alloc_inode();
 	}
-	ssize_t bytes_remaining = BLOCK_SIZE;
-	struct ext2_dir_entry current_entry = {0};
-	dir_entry_set(current_entry, EXT2_ROOT_INO, ".");
-	dir_entry_write(current_entry, fd);
+	if (is_dir(node)) {
+		group_dirs[(node->ino - 1) / geo.inodes_per_group]++;
+	}
+	for (size_t i = 0; i < node->nchildren; ++i) {
+		assign_inodes(node->children[i]);
+	}
+}
 
-	bytes_remaining -= current_entry.rec_len;
+static void index_inodes(struct node *node) {
+	if (!node->link) {
+		inode_nodes[node->ino] = node;
+	}
+	for (size_t i = 0; i < node->nchildren; ++i) {
+		index_inodes(node->children[i]);
+	}
+}
 
-	struct ext2_dir_entry parent_entry = {0};
-	dir_entry_set(parent_entry, EXT2_ROOT_INO, "..");
-	dir_entry_write(parent_entry, fd);
+/* An entry to be packed into a directory block: its name of LEN bytes,
+   its inode and, in an indexed directory, the hash of its name.  */
+struct dir_item {
+	const char *name;
+	u32 len;
+	u32 ino;
+	u32 hash;
+};
 
-	bytes_remaining -= parent_entry.rec_len;
+/* Pack the N entries of ITEMS into consecutive blocks and return how
+   many blocks they take.  An entry never crosses a block, and the last
+   entry in each block stretches to its end.  If BUF is nonnull, also
+   fill it in with the blocks, and if FIRST is nonnull, store there the
+   index of the first entry of each block.  */
+static u64 pack_entries(const struct dir_item *items, size_t n,
+                        u8 *buf, size_t *first) {
+	u64 block = 0;
+	u32 used = 0;
+	struct ext2_dir_entry *last = NULL;
+
+	for (size_t i = 0; i < n; ++i) {
+		u32 rec_len = (8 + items[i].len + 3) & ~3;
+
+		if (used + rec_len > BLOCK_SIZE) {
+			if (last) {
+				last->rec_len += BLOCK_SIZE - used;
+			}
+			++block;
+			used = 0;
+		}
+		if (first && used == 0) {
+			first[block] = i;
+		}
+		if (buf) {
+			last = (struct ext2_dir_entry *) (buf + block * BLOCK_SIZE + used);
+			last->inode = items[i].ino;
+			last->rec_len = rec_len;
+			last->name_len = items[i].len;
+			memcpy(last->name, items[i].name, items[i].len);
+		}
+		used += rec_len;
+	}
+	if (last) {
+		last->rec_len += BLOCK_SIZE - used;
+	}
+	return block + 1;
+}
 
-	struct ext2_dir_entry hello_world_entry = {0};
-	dir_entry_set(hello_world_entry, HELLO_WORLD_INO, "hello-world");
-	dir_entry_write(hello_world_entry, fd);
+#define F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define H(x, y, z) ((x) ^ (y) ^ (z))
+#define ROUND(f, a, b, c, d, x, s) \
+	(a += f(b, c, d) + (x), a = a << (s) | a >> (32 - (s)))
+#define K2 013240474631U
+#define K3 015666365641U
+
+/* Mix the eight words of IN into BUF with the first three rounds of
+   MD4, as the kernel's half_md4_transform does.  */
+static void half_md4_transform(u32 buf[4], const u32 in[8]) {
+	u32 a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+	ROUND(F, a, b, c, d, in[0],  3);
+	ROUND(F, d, a, b, c, in[1],  7);
+	ROUND(F, c, d, a, b, in[2], 11);
+	ROUND(F, b, c, d, a, in[3], 19);
+	ROUND(F, a, b, c, d, in[4],  3);
+	ROUND(F, d, a, b, c, in[5],  7);
+	ROUND(F, c, d, a, b, in[6], 11);
+	ROUND(F, b, c, d, a, in[7], 19);
+
+	ROUND(G, a, b, c, d, in[1] + K2,  3);
+	ROUND(G, d, a, b, c, in[3] + K2,  5);
+	ROUND(G, c, d, a, b, in[5] + K2,  9);
+	ROUND(G, b, c, d, a, in[7] + K2, 13);
+	ROUND(G, a, b, c, d, in[0] + K2,  3);
+	ROUND(G, d, a, b, c, in[2] + K2,  5);
+	ROUND(G, c, d, a, b, in[4] + K2,  9);
+	ROUND(G, b, c, d, a, in[6] + K2, 13);
+
+	ROUND(H, a, b, c, d, in[3] + K3,  3);
+	ROUND(H, d, a, b, c, in[7] + K3,  9);
+	ROUND(H, c, d, a, b, in[2] + K3, 11);
+	ROUND(H, b, c, d, a, in[6] + K3, 15);
+	ROUND(H, a, b, c, d, in[1] + K3,  3);
+	ROUND(H, d, a, b, c, in[5] + K3,  9);
+	ROUND(H, c, d, a, b, in[0] + K3, 11);
+	ROUND(H, b, c, d, a, in[4] + K3, 15);
+
+	buf[0] += a;
+	buf[1] += b;
+	buf[2] += c;
+	buf[3] += d;
+}
 
-	bytes_remaining -= hello_world_entry.rec_len;
-	
-	struct ext2_dir_entry hello_entry = {0};
-	dir_entry_set(hello_entry, HELLO_INO, "hello");
-	dir_entry_write(hello_entry, fd);
+#undef F
+#undef G
+#undef H
+#undef ROUND
+#undef K2
+#undef K3
+
+/* Return the half-MD4 hash of the LEN bytes of NAME, with the default
+   seed and bytes taken as unsigned (EXT2_FLAGS_UNSIGNED_HASH).  The
+   name is hashed 32 bytes at a time, each piece padded out with a word
+   made from the number of bytes left.  */
+static u32 dx_hash(const char *name, u32 len) {
+	u32 buf[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+	const u8 *p = (const u8 *) name;
+
+	for (u32 left = len; left > 0; left = left > 32 ? left - 32 : 0, p += 32) {
+		u32 pad = left | left << 8;
+		pad |= pad << 16;
+		u32 in[8];
+		u32 val = pad;
+		u32 n = left < 32 ? left : 32;
+		int w = 0;
+		for (u32 i = 0; i < n; ++i) {
+			val = p[i] + (val << 8);
+			if (i % 4 == 3) {
+				in[w++] = val;
+				val = pad;
+			}
+		}
+		if (w < 8) {
+			in[w++] = val;
+		}
+		while (w < 8) {
+			in[w++] = pad;
+		}
+		half_md4_transform(buf, in);
+	}
 
-	bytes_remaining -= hello_entry.rec_len;
+	/* Bit 0 is kept for marking runs of equal hashes split across
+	   leaves, and the top hash for the end of directory in readdir.  */
+	u32 hash = buf[1] & ~1U;
+	if (hash == 0xfffffffe) {
+		hash = 0xfffffffc;
+	}
+	return hash;
+}
 
-	struct ext2_dir_entry lost_and_found = {0};
-	dir_entry_set(lost_and_found, LOST_AND_FOUND_INO, "lost+found");
-	dir_entry_write(lost_and_found, fd);
+static int compare_items(const void *a, const void *b) {
+	const struct dir_item *x = a, *y = b;
+	if (x->hash != y->hash) {
+		return x->hash < y->hash ? -1 : 1;
+	}
+	int c = memcmp(x->name, y->name, x->len < y->len ? x->len : y->len);
+	return c ? c : (int) x->len - (int) y->len;
+}
 
-	bytes_remaining -= lost_and_found.rec_len;
+/* Store the count and limit of a dx entry array at P, and return the
+   array.  The first entry's hash is not to be written.  */
+static struct ext2_dx_entry *dx_entries(u8 *p, u32 limit, u32 count) {
+	struct ext2_dx_countlimit *countlimit = (struct ext2_dx_countlimit *) p;
+	countlimit->limit = limit;
+	countlimit->count = count;
+	return (struct ext2_dx_entry *) p;
+}
 
-	struct ext2_dir_entry fill_entry = {0};
-	fill_entry.rec_len = bytes_remaining;
-	dir_entry_write(fill_entry, fd);
+/* Lay out directory NODE with an htree index and return the size it
+   takes, or 0 if it has too many entries for two levels of index.  The
+   children are sorted by hash into leaf blocks after the root block
+   and, with two levels, the interior index blocks.  If BUF is nonnull,
+   also fill it in with the blocks.  */
+static u64 pack_htree(const struct node *node, u8 *buf) {
+	size_t n = node->nchildren;
+	struct dir_item *items = xcalloc(n, sizeof(*items));
+	for (size_t i = 0; i < n; ++i) {
+		const struct node *child = node->children[i];
+		items[i].name = child->name;
+		items[i].len = strlen(child->name);
+		items[i].ino = child->ino;
+		items[i].hash = dx_hash(child->name, items[i].len);
+	}
+	qsort(items, n, sizeof(*items), compare_items);
+
+	size_t *first = xcalloc(n, sizeof(*first));
+	u64 nleaves = pack_entries(items, n, NULL, first);
+	u32 root_limit = (BLOCK_SIZE - 32) / sizeof(struct ext2_dx_entry);
+	u32 node_limit = (BLOCK_SIZE - 8) / sizeof(struct ext2_dx_entry);
+	u64 nnodes = 0;
+	if (nleaves > root_limit) {
+		nnodes = (nleaves + node_limit - 1) / node_limit;
+	}
+	u64 size = 0;
+	if (nnodes <= root_limit) {
+		size = (1 + nnodes + nleaves) * BLOCK_SIZE;
+	}
 
+	if (size && buf) {
+		pack_entries(items, n, buf + (1 + nnodes) * BLOCK_SIZE, NULL);
+
+		/* The lowest hash in each leaf, with bit 0 set if the leaf
+		   carries on a run of equal hashes from the leaf before.  */
+		u32 *hashes = xcalloc(nleaves, sizeof(*hashes));
+		for (u64 i = 0; i < nleaves; ++i) {
+			hashes[i] = items[first[i]].hash;
+			if (i > 0 && items[first[i] - 1].hash == hashes[i]) {
+				hashes[i] |= 1;
+			}
+		}
+
+		struct ext2_dir_entry *dot = (struct ext2_dir_entry *) buf;
+		dot->inode = node->ino;
+		dot->rec_len = 12;
+		dot->name_len = 1;
+		memcpy(dot->name, ".", 1);
+		struct ext2_dir_entry *dotdot = (struct ext2_dir_entry *) (buf + 12);
+		dotdot->inode = (node->parent ? node->parent : node)->ino;
+		dotdot->rec_len = BLOCK_SIZE - 12;
+		dotdot->name_len = 2;
+		memcpy(dotdot->name, "..", 2);
+		struct ext2_dx_root_info *info = (struct ext2_dx_root_info *) (buf + 24);
+		info->hash_version = EXT2_HASH_HALF_MD4;
+		info->info_length = sizeof(*info);
+		info->indirect_levels = nnodes ? 1 : 0;
+
+		if (nnodes == 0) {
+			struct ext2_dx_entry *entries = dx_entries(buf + 32, root_limit, nleaves);
+			for (u64 i = 0; i < nleaves; ++i) {
+				if (i > 0) {
+					entries[i].hash = hashes[i];
+				}
+				entries[i].block = 1 + i;
+			}
+		} else {
+			struct ext2_dx_entry *entries = dx_entries(buf + 32, root_limit, nnodes);
+			for (u64 k = 0; k < nnodes; ++k) {
+				u64 leaf = k * node_limit;
+				u64 count = nleaves - leaf < node_limit ? nleaves - leaf : node_limit;
+				if (k > 0) {
+					entries[k].hash = hashes[leaf];
+				}
+				entries[k].block = 1 + k;
+
+				u8 *block = buf + (1 + k) * BLOCK_SIZE;
+				struct ext2_dir_entry *empty = (struct ext2_dir_entry *) block;
+				empty->rec_len = BLOCK_SIZE;
+				struct ext2_dx_entry *leaves = dx_entries(block + 8, node_limit, count);
+				for (u64 i = 0; i < count; ++i) {
+					if (i > 0) {
+						leaves[i].hash = hashes[leaf + i];
+					}
+					leaves[i].block = 1 + nnodes + leaf + i;
+				}
+			}
+		}
+		free(hashes);
+	}
+	free(first);
+	free(items);
+	return size;
 }
 
-void write_lost_and_found_dir_block(int fd) {
-	off_t off = BLOCK_OFFSET(LOST_AND_FOUND_DIR_BLOCKNO);
-	off = lseek(fd, off, SEEK_SET);
-	if (off == -1) {
-		errno_exit("lseek");
+/* Lay out the entries of directory NODE in blocks and return the size
+   they take.  If BUF is nonnull, also fill it in with the blocks.
+   Directories marked indexed by allocate_blocks get an htree.  */
+static u64 pack_dir(const struct node *node, u8 *buf) {
+	if (node->indexed) {
+		return pack_htree(node, buf);
 	}
 
-	ssize_t bytes_remaining = BLOCK_SIZE;
+	size_t n = node->nchildren + 2;
+	struct dir_item *items = xcalloc(n, sizeof(*items));
+	items[0] = (struct dir_item) {".", 1, node->ino, 0};
+	items[1] = (struct dir_item) {"..", 2, (node->parent ? node->parent : node)->ino, 0};
+	for (size_t i = 2; i < n; ++i) {
+		const struct node *child = node->children[i - 2];
+		items[i].name = child->name;
+		items[i].len = strlen(child->name);
+		items[i].ino = child->ino;
+	}
+	u64 size = pack_entries(items, n, buf, NULL) * BLOCK_SIZE;
+	free(items);
+	return size;
+}
 
-	struct ext2_dir_entry current_entry = {0};
-	dir_entry_set(current_entry, LOST_AND_FOUND_INO, ".");
-	dir_entry_write(current_entry, fd);
+static void pwrite_all(int fd, const void *buf, size_t size, off_t off) {
+	const u8 *p = buf;
+	while (size) {
+		ssize_t n = pwrite(fd, p, size, off);
+		atomic_fetch_add(&io_syscalls, 1);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			errno_exit("pwrite");
+		}
+		atomic_fetch_add(&io_bytes, n);
+		p += n;
+		off += n;
+		size -= n;
+	}
+}
 
-	bytes_remaining -= current_entry.rec_len;
+/* Read SIZE bytes at OFFSET of host file FD into BUF.  A file that has
+   shrunk since it was scanned reads as zeroes past its end.  */
+static void pread_all(int fd, const char *path, u8 *buf, size_t size,
+                      off_t offset) {
+	while (size) {
+		ssize_t n = pread(fd, buf, size, offset);
+		atomic_fetch_add(&io_syscalls, 1);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			errno_exit(path);
+		}
+		if (n == 0) {
+			memset(buf, 0, size);
+			return;
+		}
+		buf += n;
+		offset += n;
+		size -= n;
+	}
+}
 
-	struct ext2_dir_entry parent_entry = {0};
-	dir_entry_set(parent_entry, EXT2_ROOT_INO, "..");
-	dir_entry_write(parent_entry, fd);
+static bool is_zero(const u8 *buf, size_t size) {
+	return size == 0 || (buf[0] == 0 && memcmp(buf, buf + 1, size - 1) == 0);
+}
 
-	bytes_remaining -= parent_entry.rec_len;
+#define HASH_INIT 0xcbf29ce484222325ULL
 
-	struct ext2_dir_entry fill_entry = {0};
-	fill_entry.rec_len = bytes_remaining;
-	dir_entry_write(fill_entry, fd);
+/* Fold the SIZE bytes of BUF into hash H, a word at a time.  */
+static u64 hash_bytes(u64 h, const void *buf, size_t size) {
+	const u8 *p = buf;
+	for (; size >= 8; size -= 8, p += 8) {
+		u64 w;
+		memcpy(&w, p, sizeof(w));
+		h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+		h ^= h >> 32;
+	}
+	for (; size; --size, ++p) {
+		h = (h ^ *p) * 0x100000001b3ULL;
+	}
+	return h;
 }
 
-void write_hello_world_file_block(int fd)
-{
-	off_t offset = BLOCK_OFFSET(HELLO_WORLD_FILE_BLOCKNO);
-	
-	offset = lseek(fd, offset, SEEK_SET);
-	if (offset == -1) 
-	{
-		errno_exit("lseek");
+/* Return the slot under indirect block *IND, which maps the DEPTH
+   levels below SLOT, for block LBLOCK counted from the first block it
+   maps.  Indirect blocks are allocated on first use, so each comes just
+   before the blocks it maps.  */
+static u32 *indirect_slot(struct blockmap *map, struct indirect **ind,
+                          u32 *slot, int depth, u64 lblock) {
+	if (!*slot) {
+		*ind = xcalloc(1, sizeof(**ind));
+		(*ind)->entries = xcalloc(BLOCK_SIZE / sizeof(u32), sizeof(u32));
+		(*ind)->blockno = *slot = alloc_block();
+		map->indirect = grow(map->indirect, map->nindirect,
+		                     sizeof(*map->indirect));
+		map->indirect[map->nindirect++] = *ind;
+		map->nblocks++;
 	}
 
-	char block_data[BLOCK_SIZE];
-	memset(block_data, 0, sizeof(block_data));
-	strcpy(block_data, "Hello world\n");
+	u64 span = 1;
+	for (int i = 1; i < depth; ++i) {
+		span *= BLOCK_SIZE / sizeof(u32);
+	}
+	u32 *entry = &(*ind)->entries[lblock / span];
+	if (depth == 1) {
+		return entry;
+	}
+	return indirect_slot(map, &(*ind)->last_child, entry, depth - 1,
+	                     lblock % span);
+}
 
-	ssize_t written_bytes = write(fd, block_data, BLOCK_SIZE);
-    if (written_bytes == -1) 
-	{
-		errno_exit("write");
+/* Return the slot of MAP that holds logical block LBLOCK.  Exit with
+   EFBIG if it is past the largest file ext2 can map.  */
+static u32 *map_slot(struct blockmap *map, u64 lblock) {
+	u64 per_block = BLOCK_SIZE / sizeof(u32);
+	if (lblock < EXT2_NDIR_BLOCKS) {
+		return &map->i_block[lblock];
+	}
+	lblock -= EXT2_NDIR_BLOCKS;
+	for (int depth = 1; depth <= 3; ++depth) {
+		u64 span = 1;
+		for (int i = 0; i < depth; ++i) {
+			span *= per_block;
+		}
+		if (lblock < span) {
+			return indirect_slot(map, &map->root[depth - 1],
+			                     &map->i_block[EXT2_NDIR_BLOCKS + depth - 1],
+			                     depth, lblock);
+		}
+		lblock -= span;
 	}
+	fprintf(stderr, "file too large for block size %u\n", BLOCK_SIZE);
+	exit(EFBIG);
 }
 
-int main(int argc, char *argv[]) {
-	int fd = open("cs111-base.img", O_CREAT | O_WRONLY, 0666);
-	if (fd == -1) {
-		errno_exit("open");
+/* Give MAP a data block for logical block LBLOCK.  */
+static void map_block(struct blockmap *map, u64 lblock) {
+	u32 *slot = map_slot(map, lblock);
+	*slot = alloc_block();
+	map->nblocks++;
+
+	struct extent *last = map->nextents ? &map->extents[map->nextents - 1]
+	                                    : NULL;
+	if (last && last->logical + last->count == lblock
+	    && last->physical + last->count == *slot) {
+		last->count++;
+		return;
 	}
+	map->extents = grow(map->extents, map->nextents, sizeof(*map->extents));
+	map->extents[map->nextents++] = (struct extent) {lblock, *slot, 1};
+}
 
-	if (ftruncate(fd, 0)) {
-		errno_exit("ftruncate");
+/* Return how many indirect blocks it takes to map NBLOCKS blocks.  */
+static u64 indirect_blocks_count(u64 nblocks) {
+	u64 per_block = BLOCK_SIZE / sizeof(u32);
+	u64 count = 0;
+	u64 span = 1;
+	if (nblocks <= EXT2_NDIR_BLOCKS) {
+		return 0;
 	}
-	if (ftruncate(fd, NUM_BLOCKS * BLOCK_SIZE)) {
-		errno_exit("ftruncate");
+	nblocks -= EXT2_NDIR_BLOCKS;
+	for (int depth = 1; depth <= 3 && nblocks; ++depth) {
+		span *= per_block;
+		u64 n = nblocks < span ? nblocks : span;
+		/* A tree of DEPTH levels takes one block at each level for
+		   every full or partial M blocks it maps, M going down by a
+		   factor of per_block from SPAN.  */
+		for (u64 m = span; m >= per_block; m /= per_block) {
+			count += (n + m - 1) / m;
+		}
+		nblocks -= n;
 	}
+	return count;
+}
 
-	write_superblock(fd);
-	write_block_group_descriptor_table(fd);
-	write_block_bitmap(fd);
-	write_inode_bitmap(fd);
-	write_inode_table(fd);
-	write_root_dir_block(fd);
-	write_lost_and_found_dir_block(fd);
-	write_hello_world_file_block(fd);
+/* Set in ZERO the blocks of the host file of NODE that hold nothing but
+   zeroes.  Only the data regions of the file are read; its holes are
+   zeroes as they stand.  */
+static void find_zero_blocks(const struct node *node, struct bitmap *zero) {
+	u64 nblocks = (node->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	bitmap_init(zero, nblocks);
+	bitmap_set_range(zero, 0, nblocks);
 
+	int fd = open_host(node->path);
+	if (fd == -1) {
+		errno_exit(node->path);
+	}
+	u8 *buf = malloc(PIPELINE_BUFFER_SIZE);
+	if (!buf) {
+		errno_exit("malloc");
+	}
+	u64 per_buf = PIPELINE_BUFFER_SIZE / BLOCK_SIZE;
+	for (u64 block = 0; block < nblocks; ) {
+		off_t data = lseek(fd, block * BLOCK_SIZE, SEEK_DATA);
+		off_t hole = node->size;
+		if (data == -1) {
+			if (errno == ENXIO) {
+				break;
+			}
+			data = block * BLOCK_SIZE;      /* no hole support: all data */
+		} else {
+			hole = lseek(fd, data, SEEK_HOLE);
+			if (hole == -1 || (u64) hole > node->size) {
+				hole = node->size;
+			}
+		}
+		u64 end = (hole + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		for (block = data / BLOCK_SIZE; block < end; block += per_buf) {
+			u64 n = end - block < per_buf ? end - block : per_buf;
+			pread_all(fd, node->path, buf, n * BLOCK_SIZE, block * BLOCK_SIZE);
+			for (u64 i = 0; i < n; ++i) {
+				if (!is_zero(buf + i * BLOCK_SIZE, BLOCK_SIZE)) {
+					bitmap_clear_range(zero, block + i, block + i + 1);
+				}
+			}
+		}
+		block = end;
+	}
+	free(buf);
 	if (close(fd)) {
 		errno_exit("close");
 	}
+}
+
+/* Allocate the blocks of every node in the tree under NODE, in
+   depth-first order, so that each file's blocks are contiguous.  Nodes
+   whose blocks are already in the image are passed over.  */
+static void allocate_blocks(struct node *node) {
+	u64 nblocks = 0;
+	if (node->in_image) {
+		/* Its blocks are already in the image.  */
+	} else if (is_dir(node)) {
+		node->size = pack_dir(node, NULL);
+		/* Index any directory past one block, so that lookups in it
+		   take a few blocks rather than a scan of all of them.  */
+		if (node->size > BLOCK_SIZE) {
+			u64 size = pack_htree(node, NULL);
+			if (size) {
+				node->indexed = true;
+				node->size = size;
+				feature_compat |= EXT2_FEATURE_COMPAT_DIR_INDEX;
+			}
+		}
+		nblocks = node->size / BLOCK_SIZE;
+	} else if (is_reg(node)) {
+		nblocks = (node->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	} else if (is_symlink(node) && node->size > EXT2_FAST_SYMLINK_MAX) {
+		nblocks = 1;
+	}
+	/* With -D, blocks of zeroes are left unmapped, as holes.  */
+	struct bitmap zero = {0};
+	if (dedup && is_reg(node) && node->path && nblocks) {
+		find_zero_blocks(node, &zero);
+	}
+
+	/* Set aside one run for the data and indirect blocks together, so
+	   that each indirect block lands just before the blocks it maps.  */
+	blocks_wanted = nblocks + indirect_blocks_count(nblocks);
+	for (u64 i = 0; i < nblocks; ++i) {
+		if (!zero.words || bitmap_find(&zero, i, false) == i) {
+			map_block(&node->map, i);
+		}
+	}
+	if (zero.words) {
+		/* Holes leave part of the run unused.  */
+		if (run_count) {
+			mark_blocks(run_start, run_count, false);
+			block_goal = run_start;
+			run_count = 0;
+		}
+		blocks_wanted = 0;
+		free(zero.words);
+	}
+	assert(blocks_wanted == 0 && run_count == 0);
+
+	for (size_t i = 0; i < node->nchildren; ++i) {
+		allocate_blocks(node->children[i]);
+	}
+}
+
+/* The block-hash index of -D: for each distinct block of file contents
+   written so far, its hash and where in the image it went, in an open
+   addressing table.  ext2 cannot share a block between files, but the
+   image file can share storage with itself: a block already in the
+   image is cloned rather than written again.  */
+struct block_index {
+	pthread_mutex_t lock;
+	u64 *hashes;            /* 0 for an empty slot */
+	off_t *offsets;
+	size_t mask;
+	size_t count;
+};
+
+static struct block_index block_index = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+/* Set once cloning within the image turns out not to work, after which
+   blocks are neither indexed nor cloned.  */
+static atomic_bool dedup_unsupported;
+
+/* Return the slot of index BI for hash H: the one holding it, or the
+   empty one where it would go.  */
+static size_t block_index_slot(const struct block_index *bi, u64 h) {
+	size_t i = h & bi->mask;
+	while (bi->hashes[i] && bi->hashes[i] != h) {
+		i = (i + 1) & bi->mask;
+	}
+	return i;
+}
+
+static void block_index_grow(struct block_index *bi) {
+	struct block_index old = *bi;
+	size_t size = old.hashes ? 2 * (old.mask + 1) : 1024;
+	bi->hashes = xcalloc(size, sizeof(*bi->hashes));
+	bi->offsets = xcalloc(size, sizeof(*bi->offsets));
+	bi->mask = size - 1;
+	for (size_t i = 0; old.hashes && i <= old.mask; ++i) {
+		if (old.hashes[i]) {
+			size_t j = block_index_slot(bi, old.hashes[i]);
+			bi->hashes[j] = old.hashes[i];
+			bi->offsets[j] = old.offsets[i];
+		}
+	}
+	free(old.hashes);
+	free(old.offsets);
+}
+
+/* If a block with the contents BLOCK is already in the image, make the
+   block at OFFSET share it and return true.  Otherwise note that
+   BLOCK is to be written at OFFSET and return false.  */
+static bool clone_duplicate(const u8 *block, off_t offset) {
+	if (atomic_load(&dedup_unsupported)) {
+		return false;
+	}
+	u64 h = hash_bytes(HASH_INIT, block, BLOCK_SIZE) | 1;
+
+	pthread_mutex_lock(&block_index.lock);
+	if (2 * (block_index.count + 1) > block_index.mask + 1) {
+		block_index_grow(&block_index);
+	}
+	size_t i = block_index_slot(&block_index, h);
+	off_t first = block_index.offsets[i];
+	bool found = block_index.hashes[i] != 0;
+	if (!found) {
+		block_index.hashes[i] = h;
+		block_index.offsets[i] = offset;
+		block_index.count++;
+	}
+	pthread_mutex_unlock(&block_index.lock);
+
+	/* The earlier copy may be one still on its way to the image, and
+	   the hashes may collide, so only clone it if it matches.  */
+	if (!found || memcmp(image_at(first), block, BLOCK_SIZE)) {
+		return false;
+	}
+	struct file_clone_range range = {
+		.src_fd = image_fd,
+		.src_offset = first,
+		.src_length = BLOCK_SIZE,
+		.dest_offset = offset,
+	};
+	atomic_fetch_add(&io_syscalls, 1);
+	if (ioctl(image_fd, FICLONERANGE, &range) == 0) {
+		return true;
+	}
+	/* EINVAL only means the block is not aligned to the blocks of the
+	   host file system.  */
+	if (errno != EINVAL) {
+		atomic_store(&dedup_unsupported, true);
+	}
+	return false;
+}
+
+/* Serializes lseek and write on the image for the write writer, since
+   group workers share the descriptor.  */
+static pthread_mutex_t seek_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define IOV_BATCH (IOV_MAX < 256 ? IOV_MAX : 256)
+
+/* Runs waiting to go to the image in one pwritev, each starting where
+   the one before ends, for the pwritev writer.  Each thread has its
+   own, which it sends off with flush_writes.  */
+struct iov_batch {
+	struct iovec iov[IOV_BATCH];
+	int count;
+	off_t offset;
+	size_t size;
+};
+
+static _Thread_local struct iov_batch iov_batch;
+
+/* What a batch is padded with to the start of the next block.  */
+static u8 zero_tail[4096];
+
+/* Write out the runs this thread has batched up for image FD.  */
+static void flush_writes(int fd) {
+	struct iov_batch *b = &iov_batch;
+	int i = 0;
+	while (b->size) {
+		ssize_t n = pwritev(fd, b->iov + i, b->count - i, b->offset);
+		atomic_fetch_add(&io_syscalls, 1);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			errno_exit("pwritev");
+		}
+		atomic_fetch_add(&io_bytes, n);
+		b->offset += n;
+		b->size -= n;
+		while (n > 0 && (size_t) n >= b->iov[i].iov_len) {
+			n -= b->iov[i++].iov_len;
+		}
+		if (n > 0) {
+			b->iov[i].iov_base = (u8 *) b->iov[i].iov_base + n;
+			b->iov[i].iov_len -= n;
+		}
+	}
+	b->count = 0;
+}
+
+/* A write queued on a uring, kept to resubmit the rest of it if it
+   comes back short.  */
+struct uring_write {
+	int fd;
+	int buffer;
+	const u8 *buf;
+	size_t size;
+	off_t offset;
+};
+
+/* An io_uring, set up with the raw system calls, for the io_uring
+   writer.  write_run queues writes from the pipeline buffers, which
+   are registered with the ring if the kernel lets us, and at most
+   depth of them are in flight at once.  Once every write from a
+   buffer has completed, its index goes on released to be handed back
+   to the reader.  Only the pipeline writer thread uses it.  */
+struct uring {
+	int fd;
+	unsigned depth;
+	bool fixed;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *rings;
+	size_t rings_size;
+	size_t sqes_size;
+	u8 *buffers[PIPELINE_BUFFERS];
+	unsigned pending[PIPELINE_BUFFERS];
+	int released[PIPELINE_BUFFERS];
+	int nreleased;
+	struct uring_write *writes;
+	unsigned *free_writes;
+	unsigned nfree;
+	unsigned queued;            /* filled in but not yet submitted */
+	unsigned in_flight;         /* queued or submitted, not completed */
+};
+
+/* The uring of the pipeline writer thread, if it has one.  */
+static _Thread_local struct uring *thread_ring;
+
+/* Set up R to write from BUFFERS with DEPTH writes in flight.  Return 0,
+   or -1 with errno set if io_uring is not available.  */
+static int uring_init(struct uring *r, unsigned depth, u8 *const *buffers) {
+	struct io_uring_params params = {0};
+	int fd = syscall(__NR_io_uring_setup, depth, &params);
+	if (fd == -1) {
+		return -1;
+	}
+	/* Kernels with IORING_OP_WRITE (5.6) have IORING_FEAT_RW_CUR_POS.  */
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP)
+	    || !(params.features & IORING_FEAT_RW_CUR_POS)) {
+		close(fd);
+		errno = ENOSYS;
+		return -1;
+	}
+
+	size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(u32);
+	size_t cq_size = params.cq_off.cqes
+	                 + params.cq_entries * sizeof(struct io_uring_cqe);
+	r->rings_size = sq_size > cq_size ? sq_size : cq_size;
+	r->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	r->rings = mmap(NULL, r->rings_size, PROT_READ | PROT_WRITE,
+	                MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+	               MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (r->rings == MAP_FAILED || r->sqes == MAP_FAILED) {
+		errno_exit("mmap");
+	}
+	u8 *rings = r->rings;
+	r->fd = fd;
+	r->depth = depth;
+	r->sq_tail = (unsigned *) (rings + params.sq_off.tail);
+	r->sq_mask = (unsigned *) (rings + params.sq_off.ring_mask);
+	r->sq_array = (unsigned *) (rings + params.sq_off.array);
+	r->cq_head = (unsigned *) (rings + params.cq_off.head);
+	r->cq_tail = (unsigned *) (rings + params.cq_off.tail);
+	r->cq_mask = (unsigned *) (rings + params.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *) (rings + params.cq_off.cqes);
+
+	/* Registered buffers save pinning the pages on every write, but
+	   may run into RLIMIT_MEMLOCK on older kernels; plain writes do
+	   without.  */
+	struct iovec iov[PIPELINE_BUFFERS];
+	for (int i = 0; i < PIPELINE_BUFFERS; ++i) {
+		r->buffers[i] = buffers[i];
+		iov[i] = (struct iovec) {buffers[i], PIPELINE_BUFFER_SIZE};
+	}
+	r->fixed = syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS,
+	                   iov, PIPELINE_BUFFERS) == 0;
+
+	r->writes = xcalloc(depth, sizeof(*r->writes));
+	r->free_writes = xcalloc(depth, sizeof(*r->free_writes));
+	for (r->nfree = 0; r->nfree < depth; ++r->nfree) {
+		r->free_writes[r->nfree] = r->nfree;
+	}
+	return 0;
+}
+
+static void uring_free(struct uring *r) {
+	munmap(r->sqes, r->sqes_size);
+	munmap(r->rings, r->rings_size);
+	close(r->fd);
+	free(r->writes);
+	free(r->free_writes);
+}
+
+/* Fill in a submission queue entry for the write in slot I of R.  */
+static void uring_queue(struct uring *r, unsigned i) {
+	const struct uring_write *w = &r->writes[i];
+	unsigned tail = *r->sq_tail;
+	unsigned index = tail & *r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = r->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+	sqe->fd = w->fd;
+	sqe->off = w->offset;
+	sqe->addr = (uintptr_t) w->buf;
+	sqe->len = w->size;
+	sqe->buf_index = w->buffer;
+	sqe->user_data = i;
+	r->sq_array[index] = index;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	r->queued++;
+}
+
+/* Submit the writes queued on R and wait for at least one to complete,
+   then go through the completions.  */
+static void uring_wait(struct uring *r) {
+	for (;;) {
+		int n = syscall(__NR_io_uring_enter, r->fd, r->queued, 1,
+		                IORING_ENTER_GETEVENTS, NULL, 0);
+		atomic_fetch_add(&io_syscalls, 1);
+		if (n >= 0) {
+			r->queued -= n;
+			break;
+		}
+		if (errno != EINTR) {
+			errno_exit("io_uring_enter");
+		}
+	}
+
+	unsigned head = *r->cq_head;
+	unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; ++head) {
+		const struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+		unsigned i = cqe->user_data;
+		struct uring_write *w = &r->writes[i];
+		if (cqe->res <= 0) {
+			errno = cqe->res ? -cqe->res : EIO;
+			errno_exit("io_uring write");
+		}
+		atomic_fetch_add(&io_bytes, cqe->res);
+		if ((size_t) cqe->res < w->size) {
+			w->buf += cqe->res;
+			w->size -= cqe->res;
+			w->offset += cqe->res;
+			uring_queue(r, i);
+			continue;
+		}
+		r->free_writes[r->nfree++] = i;
+		r->in_flight--;
+		if (--r->pending[w->buffer] == 0) {
+			r->released[r->nreleased++] = w->buffer;
+		}
+	}
+	__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* The index in R of the buffer holding BUF.  */
+static int uring_buffer(const struct uring *r, const u8 *buf) {
+	for (int i = 0; ; ++i) {
+		if (buf >= r->buffers[i]
+		    && buf < r->buffers[i] + PIPELINE_BUFFER_SIZE) {
+			return i;
+		}
+	}
+}
+
+/* Queue a write of the SIZE bytes of BUF at OFFSET of FD on R, first
+   waiting for room if R has depth writes in flight.  */
+static void uring_write(struct uring *r, int fd, const u8 *buf, size_t size,
+                        off_t offset) {
+	while (r->in_flight == r->depth) {
+		uring_wait(r);
+	}
+	unsigned i = r->free_writes[--r->nfree];
+	int buffer = uring_buffer(r, buf);
+	r->writes[i] = (struct uring_write) {fd, buffer, buf, size, offset};
+	r->pending[buffer]++;
+	r->in_flight++;
+	uring_queue(r, i);
+}
+
+/* Write the SIZE bytes of BUF at OFFSET of image FD the way -w says.
+   BUF must stay as it is until flush_writes.  */
+static void write_run(int fd, const u8 *buf, size_t size, off_t offset) {
+	switch (writer) {
+	case WRITER_COPY:
+	case WRITER_PWRITE:
+		pwrite_all(fd, buf, size, offset);
+		break;
+	case WRITER_WRITE:
+		pthread_mutex_lock(&seek_lock);
+		if (lseek(fd, offset, SEEK_SET) == -1) {
+			errno_exit("lseek");
+		}
+		atomic_fetch_add(&io_syscalls, 1);
+		while (size) {
+			ssize_t n = write(fd, buf, size);
+			atomic_fetch_add(&io_syscalls, 1);
+			if (n < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				errno_exit("write");
+			}
+			atomic_fetch_add(&io_bytes, n);
+			buf += n;
+			size -= n;
+		}
+		pthread_mutex_unlock(&seek_lock);
+		break;
+	case WRITER_IO_URING:
+		if (thread_ring) {
+			uring_write(thread_ring, fd, buf, size, offset);
+			break;
+		}
+		/* Group workers have their own buffers to reuse at once,
+		   so they batch with pwritev instead.  */
+		/* fall through */
+	case WRITER_PWRITEV: {
+		struct iov_batch *b = &iov_batch;
+		off_t end = b->offset + b->size;
+		/* The rest of the block a file ends in is zeroes, so runs
+		   that start in the next block can join the batch.  */
+		if (b->count && offset > end && offset - end < BLOCK_SIZE
+		    && b->count < IOV_BATCH - 1) {
+			b->iov[b->count++] = (struct iovec) {zero_tail, offset - end};
+			b->size += offset - end;
+		}
+		if (b->count && (b->offset + (off_t) b->size != offset
+		                 || b->count == IOV_BATCH)) {
+			flush_writes(fd);
+		}
+		if (!b->count) {
+			b->offset = offset;
+		}
+		b->iov[b->count++] = (struct iovec) {(void *) buf, size};
+		b->size += size;
+		break;
+	}
+	case WRITER_MMAP:
+		memcpy(image_at(offset), buf, size);
+		atomic_fetch_add(&io_bytes, size);
+		break;
+	case WRITERS_COUNT:
+		assert(0);
+	}
+}
+
+/* Write the SIZE bytes of BUF at OFFSET of FD, skipping the image blocks
+   they would fill with nothing but zeroes so that those stay holes.
+   With -D, blocks already in the image are cloned instead.  Call
+   flush_writes before reusing BUF.  */
+static void write_nonzero(int fd, const u8 *buf, size_t size, off_t offset) {
+	size_t run = 0;
+	size_t pos = 0;
+	while (pos < size) {
+		size_t n = BLOCK_SIZE - (offset + pos) % BLOCK_SIZE;
+		if (n > size - pos) {
+			n = size - pos;
+		}
+		if (is_zero(buf + pos, n)
+		    || (dedup && n == BLOCK_SIZE
+		        && clone_duplicate(buf + pos, offset + pos))) {
+			if (run < pos) {
+				write_run(fd, buf + run, pos - run, offset + run);
+			}
+			run = pos + n;
+		}
+		pos += n;
+	}
+	if (run < size) {
+		write_run(fd, buf + run, size - run, offset + run);
+	}
+}
+
+/* Copy the SIZE bytes of BUF, the contents of a file mapped by MAP,
+   to their blocks.  */
+static void write_mapped(const struct blockmap *map,
+                         const void *buf, u64 size) {
+	for (size_t i = 0; i < map->nextents; ++i) {
+		const struct extent *e = &map->extents[i];
+		u64 start = e->logical * BLOCK_SIZE;
+		if (start >= size) {
+			break;
+		}
+		u64 len = (u64) e->count * BLOCK_SIZE;
+		if (len > size - start) {
+			len = size - start;
+		}
+		memcpy(image_at(BLOCK_OFFSET(e->physical)),
+		       (const u8 *) buf + start, len);
+	}
+}
+
+void write_node_inode(const struct node *node) {
+	struct ext2_inode inode = {0};
+	inode.i_mode = node->mode;
+	inode.i_uid = node->uid;
+	inode.l_i_uid_high = node->uid >> 16;
+	inode.i_size = node->size;
+	inode.i_atime = node->atime;
+	inode.i_ctime = node->ctime;
+	inode.i_mtime = node->mtime;
+	inode.i_dtime = 0;
+	inode.i_gid = node->gid;
+	inode.l_i_gid_high = node->gid >> 16;
+	inode.i_links_count = node->links_count;
+	inode.i_blocks = node->map.nblocks * (BLOCK_SIZE / 512);
+	if (is_reg(node)) {
+		inode.i_dir_acl = node->size >> 32;     /* i_size_high */
+	}
+	if (node->indexed) {
+		inode.i_flags = EXT2_INDEX_FL;
+	}
+
+	if (is_symlink(node) && node->size <= EXT2_FAST_SYMLINK_MAX) {
+		memcpy(inode.i_block, node->data, node->size);
+	} else if (is_device(node)) {
+		u32 major = major(node->rdev);
+		u32 minor = minor(node->rdev);
+		if (major < 256 && minor < 256) {
+			inode.i_block[0] = major << 8 | minor;
+		} else {
+			inode.i_block[1] = (minor & 0xff) | major << 8
+			                   | (minor & ~0xff) << 12;
+		}
+	} else {
+		memcpy(inode.i_block, node->map.i_block, sizeof(inode.i_block));
+	}
+	write_inode(node->ino, &inode);
+}
+
+/* Bring the metadata in the inode of NODE, which keeps its blocks, up
+   to date.  */
+static void update_node_inode(const struct node *node) {
+	struct ext2_inode *inode = inode_at(node->ino);
+	inode->i_mode = node->mode;
+	inode->i_uid = node->uid;
+	inode->l_i_uid_high = node->uid >> 16;
+	inode->i_atime = node->atime;
+	inode->i_ctime = node->ctime;
+	inode->i_mtime = node->mtime;
+	inode->i_gid = node->gid;
+	inode->l_i_gid_high = node->gid >> 16;
+	inode->i_links_count = node->links_count;
+}
+
+/* Whether the contents of NODE are to be copied from its host file.  */
+static bool has_host_contents(const struct node *node) {
+	return node->path && node->size && !node->in_image;
+}
+
+/* Write the inode of NODE, its indirect and directory blocks, and any
+   in-memory contents.  Host file contents are copied separately.  */
+void write_node(const struct node *node) {
+	if (node->in_image) {
+		if (node->changed) {
+			update_node_inode(node);
+		}
+		return;
+	}
+	write_node_inode(node);
+	for (size_t i = 0; i < node->map.nindirect; ++i) {
+		memcpy(image_at(BLOCK_OFFSET(node->map.indirect[i]->blockno)),
+		       node->map.indirect[i]->entries, BLOCK_SIZE);
+	}
+
+	if (is_dir(node)) {
+		u8 *buf = xcalloc(node->size, 1);
+		pack_dir(node, buf);
+		write_mapped(&node->map, buf, node->size);
+		free(buf);
+	} else if (node->data && node->map.nblocks) {
+		write_mapped(&node->map, node->data, node->size);
+	}
+}
+
+/* A buffer of SIZE bytes of file contents bound for image offset
+   OFFSET.  A null BUF marks the end of the stream.  */
+struct chunk {
+	u8 *buf;
+	size_t size;
+	off_t offset;
+};
+
+/* A blocking FIFO of chunks.  It can hold every buffer at once, plus
+   the end marker, so pushing never blocks.  */
+struct chunk_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t nonempty;
+	struct chunk chunk[PIPELINE_BUFFERS + 1];
+	size_t head;
+	size_t count;
+};
+
+static void chunk_queue_init(struct chunk_queue *q) {
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->nonempty, NULL);
+	q->head = 0;
+	q->count = 0;
+}
+
+static void chunk_queue_push(struct chunk_queue *q, struct chunk c) {
+	pthread_mutex_lock(&q->lock);
+	q->chunk[(q->head + q->count++) % (PIPELINE_BUFFERS + 1)] = c;
+	pthread_cond_signal(&q->nonempty);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/* Pop a chunk off Q into *C if there is one, without waiting, and
+   return whether there was.  */
+static bool chunk_queue_try_pop(struct chunk_queue *q, struct chunk *c) {
+	pthread_mutex_lock(&q->lock);
+	bool found = q->count > 0;
+	if (found) {
+		*c = q->chunk[q->head];
+		q->head = (q->head + 1) % (PIPELINE_BUFFERS + 1);
+		q->count--;
+	}
+	pthread_mutex_unlock(&q->lock);
+	return found;
+}
+
+static struct chunk chunk_queue_pop(struct chunk_queue *q) {
+	pthread_mutex_lock(&q->lock);
+	while (!q->count) {
+		pthread_cond_wait(&q->nonempty, &q->lock);
+	}
+	struct chunk c = q->chunk[q->head];
+	q->head = (q->head + 1) % (PIPELINE_BUFFERS + 1);
+	q->count--;
+	pthread_mutex_unlock(&q->lock);
+	return c;
+}
+
+/* The pipeline that copies host file contents into the image.  A reader
+   thread fills empty buffers from the host files in tree order, and a
+   writer thread writes each filled buffer to the image and hands it
+   back, so reading, writing and the metadata work all overlap.  The
+   contents go in with pwrite rather than through the mapping, which
+   would take a page fault for every page.  */
+struct pipeline {
+	int fd;
+	const struct node *root;
+	u8 *buffers[PIPELINE_BUFFERS];
+	struct chunk_queue empty;
+	struct chunk_queue full;
+	struct uring *ring;         /* for the io_uring writer */
+	pthread_t reader;
+	pthread_t writer;
+};
+
+/* Set once cloning or copy_file_range turns out not to work between
+   the source and the image, so that it is not tried again.  */
+static atomic_bool clone_unsupported;
+static atomic_bool copy_range_unsupported;
+
+/* Copy LEN bytes at START of host file FD to OFFSET of the image without
+   bringing them into userspace: by sharing the blocks with FICLONERANGE
+   where both sides are on one file system that can, and otherwise with
+   copy_file_range.  Return how many bytes were copied; the rest is left
+   for the caller to copy by hand.  */
+static u64 copy_in_kernel(int fd, u64 start, u64 len, off_t offset) {
+	if (!atomic_load(&clone_unsupported)) {
+		struct file_clone_range range = {
+			.src_fd = fd,
+			.src_offset = start,
+			.src_length = len,
+			.dest_offset = offset,
+		};
+		atomic_fetch_add(&io_syscalls, 1);
+		if (ioctl(image_fd, FICLONERANGE, &range) == 0) {
+			atomic_fetch_add(&io_bytes, len);
+			return len;
+		}
+		/* EINVAL only means this range is not aligned to the
+		   blocks of the host file system.  */
+		if (errno != EINVAL) {
+			atomic_store(&clone_unsupported, true);
+		}
+	}
+
+	u64 done = 0;
+	while (done < len && !atomic_load(&copy_range_unsupported)) {
+		loff_t in = start + done;
+		loff_t out = offset + done;
+		ssize_t n = copy_file_range(fd, &in, image_fd, &out, len - done, 0);
+		atomic_fetch_add(&io_syscalls, 1);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno != EXDEV && errno != EINVAL && errno != EOPNOTSUPP
+			    && errno != ENOSYS) {
+				errno_exit("copy_file_range");
+			}
+			atomic_store(&copy_range_unsupported, true);
+			break;
+		}
+		if (n == 0) {
+			/* The file has shrunk; the rest stays a hole.  */
+			return len;
+		}
+		atomic_fetch_add(&io_bytes, n);
+		done += n;
+	}
+	return done;
+}
+
+/* Copy SIZE bytes at START of host file FD, named PATH, to image offset
+   OFFSET by hand.  SIZE is at most PIPELINE_BUFFER_SIZE.  */
+typedef void copy_fn(void *arg, int fd, const char *path, u64 start,
+                     size_t size, off_t offset);
+
+/* Copy the contents of the host file of NODE into the image.  Only the
+   data regions of the host file are copied, so its holes stay holes in
+   the image.  They are copied in the kernel where that works, and what
+   is left goes to COPY with ARG in pieces.  */
+static void copy_contents(const struct node *node, copy_fn *copy, void *arg) {
+	int fd = open_host(node->path);
+	if (fd == -1) {
+		errno_exit(node->path);
+	}
+	for (size_t i = 0; i < node->map.nextents; ++i) {
+		const struct extent *e = &node->map.extents[i];
+		u64 start = e->logical * BLOCK_SIZE;
+		u64 end = start + (u64) e->count * BLOCK_SIZE;
+		if (end > node->size) {
+			end = node->size;
+		}
+
+		for (u64 pos = start; pos < end; ) {
+			off_t data = lseek(fd, pos, SEEK_DATA);
+			off_t hole = end;
+			atomic_fetch_add(&io_syscalls, 1);
+			if (data == -1) {
+				if (errno == ENXIO) {
+					break;
+				}
+				data = pos;     /* no hole support: all data */
+			} else {
+				hole = lseek(fd, data, SEEK_HOLE);
+				atomic_fetch_add(&io_syscalls, 1);
+				if (hole == -1 || (u64) hole > end) {
+					hole = end;
+				}
+			}
+			if ((u64) data >= end) {
+				break;
+			}
+
+			off_t offset = BLOCK_OFFSET(e->physical) + (data - start);
+			u64 len = hole - data;
+			/* With -D, the blocks go through write_nonzero to be
+			   checked against the block index.  */
+			u64 done = dedup || writer != WRITER_COPY
+			           ? 0 : copy_in_kernel(fd, data, len, offset);
+			while (done < len) {
+				size_t size = len - done < PIPELINE_BUFFER_SIZE
+				              ? len - done : PIPELINE_BUFFER_SIZE;
+				copy(arg, fd, node->path, data + done, size,
+				     offset + done);
+				done += size;
+			}
+			pos = hole;
+		}
+	}
+	if (close(fd)) {
+		errno_exit("close");
+	}
+}
+
+static void pipeline_read(void *arg, int fd, const char *path, u64 start,
+                          size_t size, off_t offset) {
+	struct pipeline *p = arg;
+	struct chunk c = chunk_queue_pop(&p->empty);
+	c.size = size;
+	c.offset = offset;
+	pread_all(fd, path, c.buf, size, start);
+	chunk_queue_push(&p->full, c);
+}
+
+static void read_tree(struct pipeline *p, const struct node *node) {
+	if (has_host_contents(node)) {
+		copy_contents(node, pipeline_read, p);
+	}
+	for (size_t i = 0; i < node->nchildren; ++i) {
+		read_tree(p, node->children[i]);
+	}
+}
+
+static void *pipeline_reader(void *arg) {
+	struct pipeline *p = arg;
+	read_tree(p, p->root);
+	chunk_queue_push(&p->full, (struct chunk) {NULL, 0, 0});
+	return NULL;
+}
+
+/* Hand the buffers of P whose writes have all completed back to the
+   reader.  */
+static void release_buffers(struct pipeline *p) {
+	struct uring *r = p->ring;
+	for (; r->nreleased; r->nreleased--) {
+		u8 *buf = r->buffers[r->released[r->nreleased - 1]];
+		chunk_queue_push(&p->empty, (struct chunk) {buf, 0, 0});
+	}
+}
+
+/* The pipeline writer for io_uring: queue the writes of chunks as they
+   come, submitting them when no more are ready or the ring is full,
+   and hand each buffer back once its writes have completed.  */
+static void *uring_writer(struct pipeline *p) {
+	struct uring *r = p->ring;
+	thread_ring = r;
+	bool done = false;
+	while (!done || r->in_flight) {
+		struct chunk c;
+		if (!done && r->in_flight < r->depth
+		    && (r->in_flight ? chunk_queue_try_pop(&p->full, &c)
+		                     : (c = chunk_queue_pop(&p->full), true))) {
+			if (!c.buf) {
+				done = true;
+				continue;
+			}
+			/* Hold the buffer while its writes are queued, in case
+			   some complete meanwhile or there are none at all.  */
+			int buffer = uring_buffer(r, c.buf);
+			r->pending[buffer]++;
+			write_nonzero(p->fd, c.buf, c.size, c.offset);
+			if (--r->pending[buffer] == 0) {
+				r->released[r->nreleased++] = buffer;
+			}
+		} else {
+			uring_wait(r);
+		}
+		release_buffers(p);
+	}
+	return NULL;
+}
+
+static void *pipeline_writer(void *arg) {
+	struct pipeline *p = arg;
+	if (p->ring) {
+		return uring_writer(p);
+	}
+	for (;;) {
+		/* For pwritev, hold on to up to half the buffers, so that
+		   consecutive chunks go in together while the reader fills
+		   the rest.  */
+		struct chunk ready[PIPELINE_BUFFERS / 2];
+		size_t n = 0;
+		ready[n++] = chunk_queue_pop(&p->full);
+		while (writer == WRITER_PWRITEV && ready[n - 1].buf
+		       && n < PIPELINE_BUFFERS / 2) {
+			ready[n++] = chunk_queue_pop(&p->full);
+		}
+
+		for (size_t i = 0; i < n && ready[i].buf; ++i) {
+			write_nonzero(p->fd, ready[i].buf, ready[i].size,
+			              ready[i].offset);
+		}
+		flush_writes(p->fd);
+		for (size_t i = 0; i < n; ++i) {
+			if (!ready[i].buf) {
+				return NULL;
+			}
+			chunk_queue_push(&p->empty, ready[i]);
+		}
+	}
+}
+
+/* Start copying the host files in the tree under ROOT into image FD.  */
+void start_pipeline(struct pipeline *p, int fd, const struct node *root) {
+	p->fd = fd;
+	p->root = root;
+	chunk_queue_init(&p->empty);
+	chunk_queue_init(&p->full);
+	for (int i = 0; i < PIPELINE_BUFFERS; ++i) {
+		p->buffers[i] = malloc(PIPELINE_BUFFER_SIZE);
+		if (!p->buffers[i]) {
+			errno_exit("malloc");
+		}
+		chunk_queue_push(&p->empty, (struct chunk) {p->buffers[i], 0, 0});
+	}
+
+	p->ring = NULL;
+	if (writer == WRITER_IO_URING) {
+		p->ring = xcalloc(1, sizeof(*p->ring));
+		if (uring_init(p->ring, queue_depth, p->buffers)) {
+			fprintf(stderr, "io_uring: %s; writing with pwritev\n",
+			        strerror(errno));
+			free(p->ring);
+			p->ring = NULL;
+			writer = WRITER_PWRITEV;
+		}
+	}
+
+	int err = pthread_create(&p->reader, NULL, pipeline_reader, p);
+	if (!err) {
+		err = pthread_create(&p->writer, NULL, pipeline_writer, p);
+	}
+	if (err) {
+		errno = err;
+		errno_exit("pthread_create");
+	}
+}
+
+/* Wait for the pipeline P to finish copying.  */
+void finish_pipeline(struct pipeline *p) {
+	pthread_join(p->reader, NULL);
+	pthread_join(p->writer, NULL);
+	if (p->ring) {
+		uring_free(p->ring);
+		free(p->ring);
+	}
+	for (int i = 0; i < PIPELINE_BUFFERS; ++i) {
+		free(p->buffers[i]);
+	}
+}
+
+/* Copy a piece of a host file through the PIPELINE_BUFFER_SIZE bytes
+   at ARG.  */
+static void buffer_copy(void *arg, int fd, const char *path, u64 start,
+                        size_t size, off_t offset) {
+	u8 *buf = arg;
+	pread_all(fd, path, buf, size, start);
+	write_nonzero(image_fd, buf, size, offset);
+	flush_writes(image_fd);
+}
+
+/* Build group G: its bitmaps, its descriptor and the inodes it holds,
+   with their indirect and directory blocks.  If BUF is nonnull, also
+   copy the host file contents of those inodes through it.  Groups
+   touch disjoint parts of the image, so they can be built in any
+   order, at the same time.  */
+static void build_group(u32 g, u8 *buf) {
+	write_block_bitmap(g);
+	write_inode_bitmap(g);
+	fill_block_group_descriptor(g);
+
+	u32 first = g * geo.inodes_per_group + 1;
+	u32 last = first + geo.inodes_per_group;
+	if (last > max_ino + 1) {
+		last = max_ino + 1;
+	}
+	for (u32 ino = first; ino < last; ++ino) {
+		const struct node *node = inode_nodes[ino];
+		if (!node) {
+			continue;
+		}
+		write_node(node);
+		if (buf && has_host_contents(node)) {
+			copy_contents(node, buffer_copy, buf);
+		}
+	}
+}
+
+/* The groups not yet taken by a worker.  */
+struct group_queue {
+	atomic_uint next;
+	bool copy_contents;
+};
+
+static void *group_worker(void *arg) {
+	struct group_queue *q = arg;
+	u8 *buf = NULL;
+	if (q->copy_contents) {
+		buf = malloc(PIPELINE_BUFFER_SIZE);
+		if (!buf) {
+			errno_exit("malloc");
+		}
+	}
+
+	u32 g;
+	while ((g = atomic_fetch_add(&q->next, 1)) < geo.groups_count) {
+		build_group(g, buf);
+	}
+	free(buf);
+	return NULL;
+}
+
+/* Build every group on JOBS threads.  With one job the groups are built
+   on this thread and host file contents are left to the pipeline;
+   with more, each worker copies the files whose inodes are in its
+   groups.  */
+void build_groups(int jobs) {
+	struct group_queue q = {.copy_contents = jobs > 1};
+	atomic_init(&q.next, 0);
+	if (jobs == 1) {
+		group_worker(&q);
+		return;
+	}
+
+	pthread_t *workers = xcalloc(jobs, sizeof(*workers));
+	for (int i = 0; i < jobs; ++i) {
+		int err = pthread_create(&workers[i], NULL, group_worker, &q);
+		if (err) {
+			errno = err;
+			errno_exit("pthread_create");
+		}
+	}
+	for (int i = 0; i < jobs; ++i) {
+		pthread_join(workers[i], NULL);
+	}
+	free(workers);
+}
+
+/* Incremental builds.  With -m, ext2-create keeps a manifest of the
+   image it wrote: for every inode its path, metadata, a hash of its
+   contents and the runs of blocks it holds.  Given the manifest of an
+   image of the same geometry, a build starts from that image rather
+   than from scratch.  The bitmaps are rebuilt from the manifest, files
+   and directories whose contents hash the same keep their inodes and
+   blocks, and only the inodes, blocks and bitmaps that differ are
+   written.  The blocks given up are punched out of the image, so that
+   they read as zeroes again, as write_nonzero assumes.  */
+
+#define MANIFEST_MAGIC "ext2-create manifest 2"
+
+/* A run of COUNT blocks from START on.  */
+struct run {
+	u32 start;
+	u32 count;
+};
+
+/* An inode of the last build, as the manifest has it.  NODE is the
+   node now at its path with the same inode, if there is one.  */
+struct record {
+	char *path;
+	u32 ino;
+	u16 mode;
+	u32 uid;
+	u32 gid;
+	u16 links_count;
+	u32 atime;
+	u32 ctime;
+	u32 mtime;
+	u64 size;
+	u64 host_ino;
+	u64 mtime_ns;
+	u64 ctime_ns;
+	u64 hash;
+	bool indexed;
+	struct run *runs;
+	size_t nruns;
+	struct node *node;
+};
+
+/* The records of a manifest, with a hash table of their paths.  */
+struct manifest {
+	struct record *records;
+	size_t nrecords;
+	size_t *table;          /* indexes into records, SIZE_MAX if empty */
+	size_t mask;
+};
+
+/* The blocks and inodes given up by this build, cleared out of the
+   image before anything is written to it.  */
+static struct run *freed_runs;
+static size_t nfreed_runs;
+static u32 *freed_inodes;
+static size_t nfreed_inodes;
+
+/* Return a hash of the metadata of the image at PATH, laid out as this
+   build would: the superblock, the descriptor table, the bitmaps and
+   each group's inode table up to its last inode in use.  The manifest
+   keeps the hash of the image it describes, so that an image written
+   since by another build, or changed in any other way, is built again
+   from scratch rather than patched as if the manifest held.  */
+static u64 hash_image(const char *path) {
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		errno_exit(path);
+	}
+	u8 *buf = xcalloc(1, BLOCK_SIZE);
+	u64 h = HASH_INIT;
+	pread_all(fd, path, buf, sizeof(struct ext2_superblock),
+	          SUPERBLOCK_OFFSET);
+	h = hash_bytes(h, buf, sizeof(struct ext2_superblock));
+	for (u32 b = 0; b < geo.gdt_blocks; ++b) {
+		pread_all(fd, path, buf, BLOCK_SIZE,
+		          BLOCK_OFFSET(geo.first_data_block + 1 + b));
+		h = hash_bytes(h, buf, BLOCK_SIZE);
+	}
+	for (u32 g = 0; g < geo.groups_count; ++g) {
+		pread_all(fd, path, buf, BLOCK_SIZE,
+		          BLOCK_OFFSET(group_block_bitmap(g)));
+		h = hash_bytes(h, buf, BLOCK_SIZE);
+		pread_all(fd, path, buf, BLOCK_SIZE,
+		          BLOCK_OFFSET(group_inode_bitmap(g)));
+		h = hash_bytes(h, buf, BLOCK_SIZE);
+
+		u32 used = geo.inodes_per_group;
+		while (used && !(buf[(used - 1) / 8] & 1 << (used - 1) % 8)) {
+			--used;
+		}
+		u64 size = (u64) used * EXT2_GOOD_OLD_INODE_SIZE;
+		for (u64 off = 0; off < size; off += BLOCK_SIZE) {
+			pread_all(fd, path, buf, BLOCK_SIZE,
+			          BLOCK_OFFSET(group_inode_table(g)) + off);
+			h = hash_bytes(h, buf, BLOCK_SIZE);
+		}
+	}
+	free(buf);
+	close(fd);
+	return h;
+}
+
+/* Return the hash of the contents of the host file of NODE.  */
+static u64 hash_file(const struct node *node) {
+	int fd = open_host(node->path);
+	if (fd == -1) {
+		errno_exit(node->path);
+	}
+	u8 *buf = malloc(PIPELINE_BUFFER_SIZE);
+	if (!buf) {
+		errno_exit("malloc");
+	}
+	u64 h = HASH_INIT;
+	for (u64 pos = 0; pos < node->size; pos += PIPELINE_BUFFER_SIZE) {
+		size_t size = node->size - pos < PIPELINE_BUFFER_SIZE
+		              ? node->size - pos : PIPELINE_BUFFER_SIZE;
+		pread_all(fd, node->path, buf, size, pos);
+		h = hash_bytes(h, buf, size);
+	}
+	free(buf);
+	if (close(fd)) {
+		errno_exit("close");
+	}
+	return h;
+}
+
+/* Return the hash of the entries of directory NODE.  */
+static u64 hash_entries(const struct node *node) {
+	u64 h = HASH_INIT;
+	for (size_t i = 0; i < node->nchildren; ++i) {
+		const struct node *child = node->children[i];
+		h = hash_bytes(h, child->name, strlen(child->name) + 1);
+		h = hash_bytes(h, &child->ino, sizeof(child->ino));
+	}
+	return h;
+}
+
+/* Return PATH joined to NAME with a slash, in new memory.  */
+static char *join_path(const char *path, const char *name) {
+	char *joined = xcalloc(strlen(path) + strlen(name) + 2, 1);
+	sprintf(joined, "%s/%s", path, name);
+	return joined;
+}
+
+/* Write PATH to F with spaces, control characters and '%' escaped as
+   %XX, so that it is one field.  */
+static void put_path(FILE *f, const char *path) {
+	for (const u8 *p = (const u8 *) path; *p; ++p) {
+		if (*p <= ' ' || *p == '%' || *p == 0x7f) {
+			fprintf(f, "%%%02X", *p);
+		} else {
+			putc(*p, f);
+		}
+	}
+}
+
+/* Undo put_path on PATH in place.  */
+static void unescape_path(char *path) {
+	char *out = path;
+	for (char *p = path; *p; ++p) {
+		unsigned int c;
+		if (*p == '%' && sscanf(p + 1, "%2X", &c) == 1) {
+			*out++ = c;
+			p += 2;
+		} else {
+			*out++ = *p;
+		}
+	}
+	*out = '\0';
+}
+
+static size_t path_hash(const char *path) {
+	u64 h = HASH_INIT;
+	for (const u8 *p = (const u8 *) path; *p; ++p) {
+		h = (h ^ *p) * 0x100000001b3ULL;
+	}
+	return h;
+}
+
+/* Return the record of M for PATH, or NULL if there is none.  */
+static struct record *manifest_find(const struct manifest *m,
+                                    const char *path) {
+	for (size_t i = path_hash(path) & m->mask; m->table[i] != SIZE_MAX;
+	     i = (i + 1) & m->mask) {
+		struct record *r = &m->records[m->table[i]];
+		if (strcmp(r->path, path) == 0) {
+			return r;
+		}
+	}
+	return NULL;
+}
+
+/* Parse the record on LINE, a line of a manifest, into R.  Return
+   whether it is well formed.  */
+static bool parse_record(char *line, struct record *r) {
+	unsigned int ino, mode, uid, gid, links_count, atime, ctime, mtime;
+	unsigned int indexed;
+	unsigned long long size, host_ino, mtime_ns, ctime_ns, hash;
+	size_t nruns;
+	int n;
+	*r = (struct record) {0};
+	if (sscanf(line, "%u %o %u %u %u %u %u %u %llu %llu %llu %llu %llx %u %zu%n",
+	           &ino, &mode, &uid, &gid, &links_count, &atime, &ctime,
+	           &mtime, &size, &host_ino, &mtime_ns, &ctime_ns, &hash,
+	           &indexed, &nruns, &n) != 15
+	    || ino < 1 || ino > geo.inodes_count || nruns > geo.blocks_count) {
+		return false;
+	}
+	*r = (struct record) {
+		.ino = ino, .mode = mode, .uid = uid, .gid = gid,
+		.links_count = links_count, .atime = atime, .ctime = ctime,
+		.mtime = mtime, .size = size, .host_ino = host_ino,
+		.mtime_ns = mtime_ns, .ctime_ns = ctime_ns, .hash = hash,
+		.indexed = indexed, .nruns = nruns,
+	};
+
+	char *p = line + n;
+	r->runs = xcalloc(nruns ? nruns : 1, sizeof(*r->runs));
+	for (size_t i = 0; i < nruns; ++i) {
+		struct run *run = &r->runs[i];
+		if (sscanf(p, " %u+%u%n", &run->start, &run->count, &n) != 2
+		    || run->start < geo.first_data_block
+		    || run->start >= geo.blocks_count
+		    || run->count > geo.blocks_count - run->start) {
+			return false;
+		}
+		p += n;
+	}
+
+	/* The path is the last field: "/" for the root, which is looked up
+	   as "".  */
+	p += strspn(p, " ");
+	p[strcspn(p, "\n")] = '\0';
+	if (*p != '/') {
+		return false;
+	}
+	unescape_path(p);
+	r->path = strdup(strcmp(p, "/") == 0 ? "" : p);
+	if (!r->path) {
+		errno_exit("strdup");
+	}
+	return true;
+}
+
+static void free_manifest(struct manifest *m) {
+	for (size_t r = 0; r < m->nrecords; ++r) {
+		free(m->records[r].path);
+		free(m->records[r].runs);
+	}
+	free(m->records);
+	free(m->table);
+	free(m);
+}
+
+/* Read the manifest at PATH.  Return NULL, and leave the image to be
+   built from scratch, if there is none or it is for another
+   geometry.  */
+/* Read the manifest at PATH of the image IMAGE, or return null if
+   there is none, or it is of another geometry or another image.  */
+static struct manifest *read_manifest(const char *path, const char *image) {
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		if (errno != ENOENT) {
+			perror(path);
+		}
+		return NULL;
+	}
+
+	struct manifest *m = xcalloc(1, sizeof(*m));
+	char *line = NULL;
+	size_t cap = 0;
+	bool ok = getline(&line, &cap, f) > 0
+	          && strncmp(line, MANIFEST_MAGIC " ", strlen(MANIFEST_MAGIC) + 1) == 0;
+	unsigned long long hash = 0;
+	if (ok) {
+		struct geometry g = {0};
+		ok = sscanf(line + strlen(MANIFEST_MAGIC), "%u %u %u %llx",
+		            &g.block_size, &g.blocks_count, &g.inodes_count,
+		            &hash) == 4
+		     && g.block_size == geo.block_size
+		     && g.blocks_count == geo.blocks_count
+		     && g.inodes_count == geo.inodes_count;
+	}
+	if (ok && hash != hash_image(image)) {
+		fprintf(stderr, "%s: image has changed since the manifest was "
+		        "written; building from scratch\n", path);
+		free(line);
+		fclose(f);
+		free_manifest(m);
+		return NULL;
+	}
+	while (ok && getline(&line, &cap, f) > 0) {
+		m->records = grow(m->records, m->nrecords, sizeof(*m->records));
+		ok = parse_record(line, &m->records[m->nrecords++]);
+	}
+	free(line);
+	if (ferror(f)) {
+		errno_exit(path);
+	}
+	fclose(f);
+	if (!ok) {
+		fprintf(stderr, "%s: not a manifest of an image of this "
+		        "geometry; building from scratch\n", path);
+		free_manifest(m);
+		return NULL;
+	}
+
+	size_t size = 1;
+	while (size < 2 * m->nrecords) {
+		size *= 2;
+	}
+	m->mask = size - 1;
+	m->table = xcalloc(size, sizeof(*m->table));
+	memset(m->table, 0xff, size * sizeof(*m->table));
+	for (size_t r = 0; r < m->nrecords; ++r) {
+		size_t i = path_hash(m->records[r].path) & m->mask;
+		while (m->table[i] != SIZE_MAX) {
+			i = (i + 1) & m->mask;
+		}
+		m->table[i] = r;
+	}
+	return m;
+}
+
+/* Mark the inodes and blocks of every record of M in use, so that the
+   bitmaps are those of the image it describes.  */
+static void apply_manifest(const struct manifest *m) {
+	for (size_t r = 0; r < m->nrecords; ++r) {
+		mark_inode(m->records[r].ino);
+		for (size_t i = 0; i < m->records[r].nruns; ++i) {
+			const struct run *run = &m->records[r].runs[i];
+			mark_blocks(run->start, run->count, true);
+		}
+	}
+	for (u32 g = 0; g < geo.groups_count; ++g) {
+		block_bitmaps[g].dirty = false;
+		inode_bitmaps[g].dirty = false;
+	}
+}
+
+static bool same_metadata(const struct node *node, const struct record *r) {
+	return node->mode == r->mode && node->uid == r->uid
+	       && node->gid == r->gid && node->links_count == r->links_count
+	       && node->atime == r->atime && node->ctime == r->ctime
+	       && node->mtime == r->mtime;
+}
+
+/* Let NODE keep the inode and blocks of its record.  */
+static void keep_node(struct node *node) {
+	node->in_image = true;
+	node->changed = !same_metadata(node, node->old);
+	node->size = node->old->size;
+	node->indexed = node->old->indexed;
+	if (node->indexed) {
+		feature_compat |= EXT2_FEATURE_COMPAT_DIR_INDEX;
+	}
+}
+
+/* Hash the files in the tree under NODE, at PATH in the image, and
+   match each with the record of M at its path, if M is nonnull.  A
+   matched node takes the inode of its record, and keeps its blocks too
+   if it is not a directory and its contents hash the same.  Host files
+   whose size and times are unchanged are not hashed again.  Further
+   hard links have no records: they go with their first link.  */
+static void match_tree(struct node *node, const char *path,
+                       struct manifest *m) {
+	if (node->link) {
+		return;
+	}
+	struct record *r = m ? manifest_find(m, path) : NULL;
+	/* Only a node of the same type can take over a record, and not
+	   the lost+found inode if ext2-create made a lost+found there.  */
+	if (r && (((r->mode ^ node->mode) & 0xF000)
+	          || (node->ino && node->ino != r->ino)
+	          || (!node->ino && r->ino == LOST_AND_FOUND_INO
+	              && made_lost_and_found))) {
+		r = NULL;
+	}
+
+	if (is_reg(node) && node->path) {
+		if (r && r->size == node->size && r->host_ino == node->host_ino
+		    && r->mtime_ns == node->mtime_ns
+		    && r->ctime_ns == node->ctime_ns) {
+			node->hash = r->hash;
+		} else {
+			node->hash = hash_file(node);
+		}
+	} else if (node->data) {
+		node->hash = hash_bytes(HASH_INIT, node->data, node->size);
+	} else if (is_device(node)) {
+		node->hash = node->rdev;
+	}
+
+	if (r) {
+		r->node = node;
+		node->old = r;
+		node->ino = r->ino;
+		/* Nodes made up by ext2-create keep the times they were
+		   first given, unless times come from the epoch.  */
+		if (!node->host_ino && !reproducible) {
+			node->atime = r->atime;
+			node->ctime = r->ctime;
+			node->mtime = r->mtime;
+		}
+		if (!is_dir(node) && node->hash == r->hash
+		    && node->size == r->size) {
+			keep_node(node);
+		}
+	}
+
+	for (size_t i = 0; i < node->nchildren; ++i) {
+		char *child_path = join_path(path, node->children[i]->name);
+		match_tree(node->children[i], child_path, m);
+		free(child_path);
+	}
+}
+
+/* Hash the entries of the directories in the tree under NODE, now that
+   every node has its inode, and let those whose entries are unchanged
+   keep their blocks.  */
+static void match_dirs(struct node *node) {
+	if (!is_dir(node)) {
+		return;
+	}
+	node->hash = hash_entries(node);
+	if (node->old && node->old->hash == node->hash) {
+		keep_node(node);
+	}
+	for (size_t i = 0; i < node->nchildren; ++i) {
+		match_dirs(node->children[i]);
+	}
+}
+
+/* Free the blocks of every record of M whose node does not keep them,
+   and the inodes of those with no node, to be cleared out of the image
+   by clear_freed.  */
+static void release_records(const struct manifest *m) {
+	for (size_t r = 0; r < m->nrecords; ++r) {
+		const struct record *rec = &m->records[r];
+		if (rec->node && rec->node->in_image) {
+			continue;
+		}
+		for (size_t i = 0; i < rec->nruns; ++i) {
+			mark_blocks(rec->runs[i].start, rec->runs[i].count, false);
+			freed_runs = grow(freed_runs, nfreed_runs, sizeof(*freed_runs));
+			freed_runs[nfreed_runs++] = rec->runs[i];
+		}
+		if (!rec->node) {
+			free_inode(rec->ino);
+			freed_inodes = grow(freed_inodes, nfreed_inodes,
+			                    sizeof(*freed_inodes));
+			freed_inodes[nfreed_inodes++] = rec->ino;
+		}
+	}
+}
+
+/* Zero the blocks and inodes freed by release_records in the image,
+   punching the blocks out where the host file system can.  */
+static void clear_freed() {
+	for (size_t i = 0; i < nfreed_runs; ++i) {
+		off_t off = BLOCK_OFFSET(freed_runs[i].start);
+		off_t len = BLOCK_OFFSET(freed_runs[i].count);
+		if (fallocate(image_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		              off, len)) {
+			if (errno != EOPNOTSUPP) {
+				errno_exit("fallocate");
+			}
+			memset(image_at(off), 0, len);
+		}
+	}
+	for (size_t i = 0; i < nfreed_inodes; ++i) {
+		memset(inode_at(freed_inodes[i]), 0, sizeof(struct ext2_inode));
+	}
+}
+
+static int compare_runs(const void *a, const void *b) {
+	const struct run *x = a, *y = b;
+	return x->start < y->start ? -1 : x->start > y->start;
+}
+
+/* Write to F the runs of blocks NODE holds, data and indirect blocks
+   alike, merged where they touch.  */
+static void put_runs(FILE *f, const struct node *node) {
+	if (node->in_image) {
+		fprintf(f, " %zu", node->old->nruns);
+		for (size_t i = 0; i < node->old->nruns; ++i) {
+			fprintf(f, " %u+%u", node->old->runs[i].start,
+			        node->old->runs[i].count);
+		}
+		return;
+	}
+
+	const struct blockmap *map = &node->map;
+	struct run *runs = xcalloc(map->nextents + map->nindirect + 1,
+	                           sizeof(*runs));
+	size_t n = 0;
+	for (size_t i = 0; i < map->nextents; ++i) {
+		runs[n++] = (struct run) {map->extents[i].physical,
+		                          map->extents[i].count};
+	}
+	for (size_t i = 0; i < map->nindirect; ++i) {
+		runs[n++] = (struct run) {map->indirect[i]->blockno, 1};
+	}
+	qsort(runs, n, sizeof(*runs), compare_runs);
+	size_t merged = 0;
+	for (size_t i = 0; i < n; ++i) {
+		if (merged && runs[merged - 1].start + runs[merged - 1].count
+		              == runs[i].start) {
+			runs[merged - 1].count += runs[i].count;
+		} else {
+			runs[merged++] = runs[i];
+		}
+	}
+	fprintf(f, " %zu", merged);
+	for (size_t i = 0; i < merged; ++i) {
+		fprintf(f, " %u+%u", runs[i].start, runs[i].count);
+	}
+	free(runs);
+}
+
+/* Write to F the records of the tree under NODE, at PATH in the
+   image.  */
+static void put_records(FILE *f, const struct node *node, const char *path) {
+	if (node->link) {
+		return;
+	}
+	fprintf(f, "%u %o %u %u %u %u %u %u %llu %llu %llu %llu %llx %u",
+	        node->ino, node->mode, node->uid, node->gid, node->links_count,
+	        node->atime, node->ctime, node->mtime,
+	        (unsigned long long) node->size,
+	        (unsigned long long) node->host_ino,
+	        (unsigned long long) node->mtime_ns,
+	        (unsigned long long) node->ctime_ns,
+	        (unsigned long long) node->hash, node->indexed);
+	put_runs(f, node);
+	putc(' ', f);
+	put_path(f, *path ? path : "/");
+	putc('\n', f);
+
+	for (size_t i = 0; i < node->nchildren; ++i) {
+		char *child_path = join_path(path, node->children[i]->name);
+		put_records(f, node->children[i], child_path);
+		free(child_path);
+	}
+}
+
+/* Write the manifest of the image of the tree under ROOT, whose
+   metadata hashes to IMAGE_HASH, to PATH, by way of a temporary file,
+   so that a manifest is always whole.  */
+static void write_manifest(const char *path, const struct node *root,
+                           u64 image_hash) {
+	char *tmp = xcalloc(strlen(path) + 5, 1);
+	sprintf(tmp, "%s.tmp", path);
+	FILE *f = fopen(tmp, "w");
+	if (!f) {
+		errno_exit(tmp);
+	}
+	fprintf(f, "%s %u %u %u %llx\n", MANIFEST_MAGIC, geo.block_size,
+	        geo.blocks_count, geo.inodes_count,
+	        (unsigned long long) image_hash);
+	put_records(f, root, "");
+	if (fclose(f)) {
+		errno_exit(tmp);
+	}
+	if (rename(tmp, path)) {
+		errno_exit(tmp);
+	}
+	free(tmp);
+}
+
+/* Fold the tree under NODE into hash H: the names, types, permissions,
+   owners, sizes, times and symlink targets.  */
+static u64 hash_tree(u64 h, const struct node *node) {
+	if (node->name) {
+		h = hash_bytes(h, node->name, strlen(node->name) + 1);
+	}
+	u32 fields[] = {
+		node->mode, node->uid, node->gid, node->links_count,
+		node->atime, node->ctime, node->mtime,
+		node->size, node->size >> 32, major(node->rdev), minor(node->rdev),
+		node->nchildren,
+	};
+	h = hash_bytes(h, fields, sizeof(fields));
+	if (node->data) {
+		h = hash_bytes(h, node->data, node->size);
+	}
+	for (size_t i = 0; i < node->nchildren; ++i) {
+		h = hash_tree(h, node->children[i]);
+	}
+	return h;
+}
+
+/* Derive the UUID of a reproducible image from the epoch, the geometry
+   and the tree under ROOT, as a version 8 (custom) UUID.  */
+static void derive_uuid(const struct node *root) {
+	u64 h[2] = {HASH_INIT, ~HASH_INIT};
+	for (int i = 0; i < 2; ++i) {
+		h[i] = hash_bytes(h[i], &epoch, sizeof(epoch));
+		h[i] = hash_bytes(h[i], &geo, sizeof(geo));
+		h[i] = hash_tree(h[i], root);
+	}
+	memcpy(uuid, h, sizeof(uuid));
+	uuid[6] = (uuid[6] & 0x0f) | 0x80;
+	uuid[8] = (uuid[8] & 0x3f) | 0x80;
+}
+
+/* Parse a size in bytes, with an optional K, M, G or T suffix.  Exit
+   with EINVAL if STRING is not one.  */
+static u64 parse_size(const char *string) {
+	char *end;
+	errno = 0;
+	unsigned long long size = strtoull(string, &end, 10);
+	int shift = 0;
+	switch (*end) {
+	case 'T': case 't': shift += 10; /* fall through */
+	case 'G': case 'g': shift += 10; /* fall through */
+	case 'M': case 'm': shift += 10; /* fall through */
+	case 'K': case 'k': shift += 10; end++; break;
+	}
+	if (errno || end == string || *end || size > (UINT64_MAX >> shift)) {
+		fprintf(stderr, "bad size: %s\n", string);
+		exit(EINVAL);
+	}
+	return (u64) size << shift;
+}
+
+/* Parse a time in seconds since 1970.  Exit with EINVAL if STRING is
+   not one that fits an ext2 timestamp.  */
+static u32 parse_epoch(const char *string) {
+	char *end;
+	errno = 0;
+	unsigned long long t = strtoull(string, &end, 10);
+	if (errno || end == string || *end || t > UINT32_MAX) {
+		fprintf(stderr, "bad epoch: %s\n", string);
+		exit(EINVAL);
+	}
+	return t;
+}
+
+static enum writer parse_writer(const char *string) {
+	for (int w = 0; w < WRITERS_COUNT; ++w) {
+		if (!strcmp(string, writer_names[w])) {
+			return w;
+		}
+	}
+	fprintf(stderr, "bad writer: %s\n", string);
+	exit(EINVAL);
+}
+
+static void usage(const char *argv0) {
+	fprintf(stderr, "usage: %s [-s size] [-b block-size] [-i bytes-per-inode]"
+	        " [-d directory] [-j jobs] [-m manifest] [-T epoch] [-D]"
+	        " [-w writer] [-q depth] [-v] [-o image]\n", argv0);
+	exit(EINVAL);
+}
+
+int main(int argc, char *argv[]) {
+	u64 size = DEFAULT_IMAGE_SIZE;
+	u64 block_size = DEFAULT_BLOCK_SIZE;
+	u64 inode_ratio = DEFAULT_INODE_RATIO;
+	const char *image = DEFAULT_IMAGE_NAME;
+	const char *source = NULL;
+	const char *manifest_path = NULL;
+	const char *epoch_string = getenv("SOURCE_DATE_EPOCH");
+	u64 jobs = 1;
+	bool verbose = false;
+	u64 depth = queue_depth;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "s:b:i:d:j:m:o:T:Dw:q:v")) != -1) {
+		switch (opt) {
+		case 'd':
+			source = optarg;
+			break;
+		case 's':
+			size = parse_size(optarg);
+			break;
+		case 'b':
+			block_size = parse_size(optarg);
+			break;
+		case 'i':
+			inode_ratio = parse_size(optarg);
+			break;
+		case 'j':
+			jobs = parse_size(optarg);
+			break;
+		case 'm':
+			manifest_path = optarg;
+			break;
+		case 'T':
+			epoch_string = optarg;
+			break;
+		case 'D':
+			dedup = true;
+			break;
+		case 'w':
+			writer = parse_writer(optarg);
+			break;
+		case 'q':
+			depth = parse_size(optarg);
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		case 'o':
+			image = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc || block_size > UINT32_MAX || inode_ratio > UINT32_MAX
+	    || jobs < 1 || jobs > 1024 || depth < 1 || depth > 4096) {
+		usage(argv[0]);
+	}
+	queue_depth = depth;
+
+	if (epoch_string && *epoch_string) {
+		reproducible = true;
+		epoch = parse_epoch(epoch_string);
+	}
+
+	compute_geometry(size, block_size, inode_ratio);
+	init_bitmaps();
+	group_dirs = xcalloc(geo.groups_count, sizeof(*group_dirs));
+	group_desc = xcalloc(geo.groups_count, sizeof(*group_desc));
+
+	struct node *root = source ? build_source_tree(source)
+	                           : build_default_tree();
+
+	/* An incremental build needs both the manifest and its image.  */
+	struct manifest *manifest = NULL;
+	if (manifest_path && access(image, R_OK | W_OK) == 0) {
+		manifest = read_manifest(manifest_path, image);
+	}
+	if (manifest) {
+		apply_manifest(manifest);
+	}
+	if (manifest_path) {
+		match_tree(root, "", manifest);
+	}
+	assign_inodes(root);
+	if (manifest_path) {
+		match_dirs(root);
+	}
+	if (reproducible) {
+		derive_uuid(root);
+	}
+	if (manifest) {
+		release_records(manifest);
+	}
+	allocate_blocks(root);
+	inode_nodes = xcalloc(max_ino + 1, sizeof(*inode_nodes));
+	index_inodes(root);
+
+	/* Until the new manifest is written, the image matches neither.  */
+	if (manifest_path && unlink(manifest_path) && errno != ENOENT) {
+		errno_exit(manifest_path);
+	}
+	open_image(image, manifest != NULL);
+	if (manifest) {
+		clear_freed();
+	}
+
+	/* With one job, regular file contents stream through the pipeline
+	   while the groups are built.  */
+	struct pipeline pipeline;
+	if (jobs == 1) {
+		start_pipeline(&pipeline, image_fd, root);
+	}
+	build_groups(jobs);
+	if (jobs == 1) {
+		finish_pipeline(&pipeline);
+	}
+
+	/* The totals are only known once every group is built.  */
+	for (u32 g = 0; g < geo.groups_count; ++g) {
+		if (group_has_super(g)) {
+			write_superblock(g);
+			write_block_group_descriptor_table(g);
+		}
+	}
+	close_image();
+	if (manifest_path) {
+		write_manifest(manifest_path, root, hash_image(image));
+	}
+	if (verbose) {
+		fprintf(stderr, "writer=%s io_syscalls=%llu bytes_written=%llu\n",
+		        writer_names[writer], atomic_load(&io_syscalls),
+		        atomic_load(&io_bytes));
+	}
 	return 0;
 }
@@ -0,0 +1,663 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ext2-image.h"
+
+#define DEFAULT_CACHE_BLOCKS 1024
+#define MIN_INODE_BUCKETS    64
+
+/* A block of the image held in the cache.  Blocks are found through a
+   hash table and evicted in least recently used order.  */
+struct cache_block {
+	u32 blockno;
+	bool valid;
+	u8 *data;
+	struct cache_block *hash_next;
+	struct cache_block *lru_prev;
+	struct cache_block *lru_next;
+};
+
+/* An entry of a cached directory, whose name is NAME_LEN bytes at
+   NAME_OFF in the directory's names.  */
+struct dir_slot {
+	u32 ino;
+	u32 hash;
+	u32 name_off;
+	u32 name_len;
+};
+
+/* A directory read into memory: its entries in on-disk order, and an
+   open-addressing hash table over them whose slots hold an entry index
+   plus one, or 0 when empty.  */
+struct dir_cache {
+	struct dir_slot *entries;
+	size_t nentries;
+	char *names;
+	size_t names_size;
+	u32 *table;
+	u32 mask;
+};
+
+/* An inode read from the image, with the image block of each of its
+   logical blocks (0 for holes) once it has been mapped.  */
+struct cached_inode {
+	u32 ino;
+	struct ext2_inode inode;
+	bool mapped;
+	u32 *blocks;
+	u64 nblocks;
+	struct dir_cache *dir;
+	struct cached_inode *next;
+};
+
+struct ext2_image {
+	int fd;
+	struct ext2_superblock sb;
+	struct ext2_block_group_descriptor *gdt;
+	u32 block_size;
+	u32 groups_count;
+	u32 inode_size;
+
+	u8 *cache_data;
+	struct cache_block *cache;
+	size_t cache_size;
+	struct cache_block **cache_table;
+	u32 cache_mask;
+	struct cache_block lru;     /* lru.lru_next is the most recent */
+
+	struct cached_inode **inodes;
+	u32 inode_mask;
+	size_t ninodes;
+};
+
+static void *set_errno(int err) {
+	errno = err;
+	return NULL;
+}
+
+static int pread_full(int fd, void *buf, size_t size, off_t off) {
+	u8 *p = buf;
+	while (size) {
+		ssize_t n = pread(fd, p, size, off);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		if (n == 0) {
+			errno = EIO;
+			return -1;
+		}
+		p += n;
+		off += n;
+		size -= n;
+	}
+	return 0;
+}
+
+/* Return the smallest power of two that is at least N.  */
+static u32 round_up_pow2(size_t n) {
+	u32 size = 1;
+	while (size < n) {
+		size *= 2;
+	}
+	return size;
+}
+
+/* Make room in *ARRAY, of capacity *CAP elements of SIZE bytes, for N
+   elements.  */
+static int reserve(void *array, size_t *cap, size_t n, size_t size) {
+	if (n <= *cap) {
+		return 0;
+	}
+	size_t new_cap = *cap ? *cap : 8;
+	while (new_cap < n) {
+		new_cap *= 2;
+	}
+	void *p = realloc(*(void **) array, new_cap * size);
+	if (!p) {
+		return -1;
+	}
+	*(void **) array = p;
+	*cap = new_cap;
+	return 0;
+}
+
+static void lru_unlink(struct cache_block *b) {
+	b->lru_prev->lru_next = b->lru_next;
+	b->lru_next->lru_prev = b->lru_prev;
+}
+
+static void lru_push_front(struct ext2_image *image, struct cache_block *b) {
+	b->lru_prev = &image->lru;
+	b->lru_next = image->lru.lru_next;
+	b->lru_next->lru_prev = b;
+	image->lru.lru_next = b;
+}
+
+/* Return block BLOCKNO of IMAGE, from the cache if it is there.  The
+   pointer is good until the next call.  */
+static const u8 *get_block(struct ext2_image *image, u32 blockno) {
+	if (blockno < image->sb.s_first_data_block
+	    || blockno >= image->sb.s_blocks_count) {
+		return set_errno(EUCLEAN);
+	}
+
+	struct cache_block **bucket = &image->cache_table[blockno
+	                                                  & image->cache_mask];
+	for (struct cache_block *b = *bucket; b; b = b->hash_next) {
+		if (b->blockno == blockno) {
+			lru_unlink(b);
+			lru_push_front(image, b);
+			return b->data;
+		}
+	}
+
+	struct cache_block *b = image->lru.lru_prev;
+	if (b->valid) {
+		struct cache_block **p = &image->cache_table[b->blockno
+		                                             & image->cache_mask];
+		while (*p != b) {
+			p = &(*p)->hash_next;
+		}
+		*p = b->hash_next;
+		b->valid = false;
+	}
+	if (pread_full(image->fd, b->data, image->block_size,
+	               (off_t) blockno * image->block_size)) {
+		return NULL;
+	}
+	b->blockno = blockno;
+	b->valid = true;
+	b->hash_next = *bucket;
+	*bucket = b;
+	lru_unlink(b);
+	lru_push_front(image, b);
+	return b->data;
+}
+
+struct ext2_image *ext2_open_image(const char *path, size_t cache_blocks) {
+	struct ext2_image *image = calloc(1, sizeof(*image));
+	if (!image) {
+		return NULL;
+	}
+	image->fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (image->fd == -1) {
+		goto fail;
+	}
+
+	struct ext2_superblock *sb = &image->sb;
+	if (pread_full(image->fd, sb, sizeof(*sb), SUPERBLOCK_OFFSET)) {
+		goto fail;
+	}
+	if (sb->s_magic != EXT2_SUPER_MAGIC || sb->s_log_block_size > 6
+	    || !sb->s_blocks_per_group || !sb->s_inodes_per_group
+	    || sb->s_first_data_block >= sb->s_blocks_count) {
+		errno = EINVAL;
+		goto fail;
+	}
+	image->block_size = 1024 << sb->s_log_block_size;
+	image->groups_count = (sb->s_blocks_count - sb->s_first_data_block
+	                       + sb->s_blocks_per_group - 1)
+	                      / sb->s_blocks_per_group;
+	image->inode_size = sb->s_rev_level >= EXT2_DYNAMIC_REV
+	                    ? sb->s_inode_size : EXT2_GOOD_OLD_INODE_SIZE;
+	if (image->inode_size < EXT2_GOOD_OLD_INODE_SIZE
+	    || image->inode_size > image->block_size
+	    || image->block_size % image->inode_size
+	    || sb->s_inodes_count
+	       > (u64) image->groups_count * sb->s_inodes_per_group) {
+		errno = EUCLEAN;
+		goto fail;
+	}
+
+	size_t gdt_size = image->groups_count * sizeof(*image->gdt);
+	image->gdt = malloc(gdt_size);
+	if (!image->gdt
+	    || pread_full(image->fd, image->gdt, gdt_size,
+	                  (off_t) (sb->s_first_data_block + 1)
+	                  * image->block_size)) {
+		goto fail;
+	}
+
+	image->cache_size = cache_blocks ? cache_blocks : DEFAULT_CACHE_BLOCKS;
+	image->cache_mask = round_up_pow2(2 * image->cache_size) - 1;
+	image->cache_data = malloc(image->cache_size * image->block_size);
+	image->cache = calloc(image->cache_size, sizeof(*image->cache));
+	image->cache_table = calloc(image->cache_mask + 1,
+	                            sizeof(*image->cache_table));
+	image->inode_mask = MIN_INODE_BUCKETS - 1;
+	image->inodes = calloc(MIN_INODE_BUCKETS, sizeof(*image->inodes));
+	if (!image->cache_data || !image->cache || !image->cache_table
+	    || !image->inodes) {
+		goto fail;
+	}
+	image->lru.lru_next = image->lru.lru_prev = &image->lru;
+	for (size_t i = 0; i < image->cache_size; ++i) {
+		image->cache[i].data = image->cache_data + i * image->block_size;
+		lru_push_front(image, &image->cache[i]);
+	}
+	return image;
+
+fail: ;
+	int err = errno;
+	ext2_close_image(image);
+	errno = err;
+	return NULL;
+}
+
+static void free_inode(struct cached_inode *ci) {
+	if (ci->dir) {
+		free(ci->dir->entries);
+		free(ci->dir->names);
+		free(ci->dir->table);
+		free(ci->dir);
+	}
+	free(ci->blocks);
+	free(ci);
+}
+
+void ext2_close_image(struct ext2_image *image) {
+	if (image->inodes) {
+		for (u32 i = 0; i <= image->inode_mask; ++i) {
+			struct cached_inode *next;
+			for (struct cached_inode *ci = image->inodes[i]; ci; ci = next) {
+				next = ci->next;
+				free_inode(ci);
+			}
+		}
+	}
+	free(image->inodes);
+	free(image->cache_table);
+	free(image->cache);
+	free(image->cache_data);
+	free(image->gdt);
+	if (image->fd != -1) {
+		close(image->fd);
+	}
+	free(image);
+}
+
+/* Double the buckets of the inode cache of IMAGE.  */
+static int grow_inode_table(struct ext2_image *image) {
+	u32 mask = 2 * (image->inode_mask + 1) - 1;
+	struct cached_inode **inodes = calloc(mask + 1, sizeof(*inodes));
+	if (!inodes) {
+		return -1;
+	}
+	for (u32 i = 0; i <= image->inode_mask; ++i) {
+		struct cached_inode *next;
+		for (struct cached_inode *ci = image->inodes[i]; ci; ci = next) {
+			next = ci->next;
+			ci->next = inodes[ci->ino & mask];
+			inodes[ci->ino & mask] = ci;
+		}
+	}
+	free(image->inodes);
+	image->inodes = inodes;
+	image->inode_mask = mask;
+	return 0;
+}
+
+static struct cached_inode *get_inode(struct ext2_image *image, u32 ino) {
+	if (ino < 1 || ino > image->sb.s_inodes_count) {
+		return set_errno(EINVAL);
+	}
+	for (struct cached_inode *ci = image->inodes[ino & image->inode_mask];
+	     ci; ci = ci->next) {
+		if (ci->ino == ino) {
+			return ci;
+		}
+	}
+
+	u32 g = (ino - 1) / image->sb.s_inodes_per_group;
+	if (g >= image->groups_count) {
+		return set_errno(EUCLEAN);
+	}
+	u64 offset = (u64) ((ino - 1) % image->sb.s_inodes_per_group)
+	             * image->inode_size;
+	const u8 *data = get_block(image, image->gdt[g].bg_inode_table
+	                                  + offset / image->block_size);
+	if (!data) {
+		return NULL;
+	}
+	struct cached_inode *ci = calloc(1, sizeof(*ci));
+	if (!ci) {
+		return NULL;
+	}
+	ci->ino = ino;
+	memcpy(&ci->inode, data + offset % image->block_size, sizeof(ci->inode));
+
+	ci->next = image->inodes[ino & image->inode_mask];
+	image->inodes[ino & image->inode_mask] = ci;
+	if (++image->ninodes > 2 * (size_t) (image->inode_mask + 1)) {
+		grow_inode_table(image);    /* failing only costs speed */
+	}
+	return ci;
+}
+
+static u16 inode_type(const struct ext2_inode *inode) {
+	return inode->i_mode & 0xF000;
+}
+
+u64 ext2_inode_size(const struct ext2_inode *inode) {
+	u64 size = inode->i_size;
+	if (inode_type(inode) == EXT2_S_IFREG) {
+		size |= (u64) inode->i_dir_acl << 32;   /* i_size_high */
+	}
+	return size;
+}
+
+static bool is_fast_symlink(const struct ext2_inode *inode) {
+	return inode_type(inode) == EXT2_S_IFLNK && inode->i_blocks == 0;
+}
+
+/* Fill in the blocks of CI mapped by the indirect block BLOCKNO, which
+   is DEPTH levels above the data and maps logical blocks from LBLOCK.  */
+static int map_indirect(struct ext2_image *image, struct cached_inode *ci,
+                        u32 blockno, int depth, u64 lblock) {
+	u32 per_block = image->block_size / sizeof(u32);
+	const u8 *data = get_block(image, blockno);
+	if (!data) {
+		return -1;
+	}
+	/* The cache may reuse the block while the levels below are read.  */
+	u32 entries[per_block];
+	memcpy(entries, data, image->block_size);
+
+	u64 span = 1;
+	for (int i = 1; i < depth; ++i) {
+		span *= per_block;
+	}
+	for (u32 i = 0; i < per_block && lblock + i * span < ci->nblocks; ++i) {
+		if (!entries[i]) {
+			continue;
+		}
+		if (depth == 1) {
+			ci->blocks[lblock + i] = entries[i];
+		} else if (map_indirect(image, ci, entries[i], depth - 1,
+		                        lblock + i * span)) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Resolve every logical block of CI to its image block, walking the
+   indirect blocks once.  */
+static int map_inode(struct ext2_image *image, struct cached_inode *ci) {
+	if (ci->mapped) {
+		return 0;
+	}
+	u64 per_block = image->block_size / sizeof(u32);
+	ci->nblocks = (ext2_inode_size(&ci->inode) + image->block_size - 1)
+	              / image->block_size;
+	ci->blocks = calloc(ci->nblocks ? ci->nblocks : 1, sizeof(u32));
+	if (!ci->blocks) {
+		return -1;
+	}
+
+	for (u32 i = 0; i < EXT2_NDIR_BLOCKS && i < ci->nblocks; ++i) {
+		ci->blocks[i] = ci->inode.i_block[i];
+	}
+	u64 lblock = EXT2_NDIR_BLOCKS;
+	u64 span = per_block;
+	for (int depth = 1; depth <= 3 && lblock < ci->nblocks; ++depth) {
+		u32 blockno = ci->inode.i_block[EXT2_IND_BLOCK + depth - 1];
+		if (blockno && map_indirect(image, ci, blockno, depth, lblock)) {
+			free(ci->blocks);
+			ci->blocks = NULL;
+			return -1;
+		}
+		lblock += span;
+		span *= per_block;
+	}
+	ci->mapped = true;
+	return 0;
+}
+
+int ext2_stat(struct ext2_image *image, u32 ino, struct ext2_inode *inode) {
+	struct cached_inode *ci = get_inode(image, ino);
+	if (!ci) {
+		return -1;
+	}
+	*inode = ci->inode;
+	return 0;
+}
+
+ssize_t ext2_read(struct ext2_image *image, u32 ino, void *buf, size_t len,
+                  u64 off) {
+	struct cached_inode *ci = get_inode(image, ino);
+	if (!ci) {
+		return -1;
+	}
+	if (inode_type(&ci->inode) == EXT2_S_IFDIR) {
+		errno = EISDIR;
+		return -1;
+	}
+	if (inode_type(&ci->inode) != EXT2_S_IFREG
+	    && inode_type(&ci->inode) != EXT2_S_IFLNK) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	u64 size = ext2_inode_size(&ci->inode);
+	if (off >= size) {
+		return 0;
+	}
+	if (len > size - off) {
+		len = size - off;
+	}
+	if (is_fast_symlink(&ci->inode)) {
+		if (size > sizeof(ci->inode.i_block)) {
+			errno = EUCLEAN;
+			return -1;
+		}
+		memcpy(buf, (const u8 *) ci->inode.i_block + off, len);
+		return len;
+	}
+	if (map_inode(image, ci)) {
+		return -1;
+	}
+
+	u32 bs = image->block_size;
+	u8 *out = buf;
+	for (size_t done = 0; done < len; ) {
+		u64 lblock = (off + done) / bs;
+		u32 in = (off + done) % bs;
+		u32 blockno = ci->blocks[lblock];
+		size_t n = bs - in < len - done ? bs - in : len - done;
+
+		if (!blockno) {
+			memset(out + done, 0, n);
+		} else if (in == 0 && len - done >= bs) {
+			/* Whole blocks skip the cache, so that reading big
+			   files does not flush it: each run of contiguous
+			   blocks is read with one pread.  */
+			u64 run = 1;
+			while (lblock + run < ci->nblocks
+			       && (run + 1) * bs <= len - done
+			       && ci->blocks[lblock + run] == blockno + run) {
+				run++;
+			}
+			if (blockno + run > image->sb.s_blocks_count) {
+				errno = EUCLEAN;
+				return -1;
+			}
+			n = run * bs;
+			if (pread_full(image->fd, out + done, n, (off_t) blockno * bs)) {
+				return -1;
+			}
+		} else {
+			const u8 *data = get_block(image, blockno);
+			if (!data) {
+				return -1;
+			}
+			memcpy(out + done, data + in, n);
+		}
+		done += n;
+	}
+	return len;
+}
+
+static u32 name_hash(const char *name, size_t len) {
+	u32 hash = 2166136261u;     /* FNV-1a */
+	for (size_t i = 0; i < len; ++i) {
+		hash = (hash ^ (u8) name[i]) * 16777619u;
+	}
+	return hash;
+}
+
+/* Add the entries in directory block DATA to DIR.  */
+static int add_dir_block(struct ext2_image *image, struct dir_cache *dir,
+                         size_t *entries_cap, size_t *names_cap,
+                         const u8 *data) {
+	for (u32 off = 0; off < image->block_size; ) {
+		const struct ext2_dir_entry *entry =
+			(const struct ext2_dir_entry *) (data + off);
+		u32 name_len = entry->name_len;
+		if (image->sb.s_feature_incompat & EXT2_FEATURE_INCOMPAT_FILETYPE) {
+			name_len &= 0xff;
+		}
+		if (off + 8 > image->block_size || entry->rec_len < 8
+		    || entry->rec_len % 4 || off + entry->rec_len > image->block_size
+		    || 8 + name_len > entry->rec_len) {
+			errno = EUCLEAN;
+			return -1;
+		}
+
+		if (entry->inode) {
+			if (reserve(&dir->entries, entries_cap, dir->nentries + 1,
+			            sizeof(*dir->entries))
+			    || reserve(&dir->names, names_cap,
+			               dir->names_size + name_len, 1)) {
+				return -1;
+			}
+			const char *name = (const char *) entry->name;
+			dir->entries[dir->nentries++] = (struct dir_slot) {
+				entry->inode, name_hash(name, name_len),
+				dir->names_size, name_len,
+			};
+			memcpy(dir->names + dir->names_size, name, name_len);
+			dir->names_size += name_len;
+		}
+		off += entry->rec_len;
+	}
+	return 0;
+}
+
+/* Return the entries of directory CI, reading them in and hashing them
+   the first time.  */
+static struct dir_cache *get_dir(struct ext2_image *image,
+                                 struct cached_inode *ci) {
+	if (ci->dir) {
+		return ci->dir;
+	}
+	if (inode_type(&ci->inode) != EXT2_S_IFDIR) {
+		return set_errno(ENOTDIR);
+	}
+	if (map_inode(image, ci)) {
+		return NULL;
+	}
+
+	struct dir_cache *dir = calloc(1, sizeof(*dir));
+	if (!dir) {
+		return NULL;
+	}
+	size_t entries_cap = 0;
+	size_t names_cap = 0;
+	for (u64 i = 0; i < ci->nblocks; ++i) {
+		if (!ci->blocks[i]) {
+			continue;
+		}
+		const u8 *data = get_block(image, ci->blocks[i]);
+		if (!data || add_dir_block(image, dir, &entries_cap, &names_cap,
+		                           data)) {
+			goto fail;
+		}
+	}
+
+	dir->mask = round_up_pow2(2 * dir->nentries + 1) - 1;
+	dir->table = calloc(dir->mask + 1, sizeof(*dir->table));
+	if (!dir->table) {
+		goto fail;
+	}
+	for (size_t i = 0; i < dir->nentries; ++i) {
+		u32 slot = dir->entries[i].hash & dir->mask;
+		while (dir->table[slot]) {
+			slot = (slot + 1) & dir->mask;
+		}
+		dir->table[slot] = i + 1;
+	}
+	ci->dir = dir;
+	return dir;
+
+fail: ;
+	int err = errno;
+	free(dir->entries);
+	free(dir->names);
+	free(dir);
+	return set_errno(err);
+}
+
+/* Return the inode of NAME in DIR, or 0 if there is none.  */
+static u32 dir_find(const struct dir_cache *dir, const char *name,
+                    size_t len) {
+	u32 hash = name_hash(name, len);
+	for (u32 slot = hash & dir->mask; dir->table[slot];
+	     slot = (slot + 1) & dir->mask) {
+		const struct dir_slot *e = &dir->entries[dir->table[slot] - 1];
+		if (e->hash == hash && e->name_len == len
+		    && memcmp(dir->names + e->name_off, name, len) == 0) {
+			return e->ino;
+		}
+	}
+	return 0;
+}
+
+int ext2_lookup(struct ext2_image *image, const char *path, u32 *ino) {
+	u32 current = EXT2_ROOT_INO;
+	for (const char *p = path; *p; ) {
+		if (*p == '/') {
+			p++;
+			continue;
+		}
+		size_t len = strcspn(p, "/");
+		struct cached_inode *ci = get_inode(image, current);
+		struct dir_cache *dir = ci ? get_dir(image, ci) : NULL;
+		if (!dir) {
+			return -1;
+		}
+		current = dir_find(dir, p, len);
+		if (!current) {
+			errno = ENOENT;
+			return -1;
+		}
+		p += len;
+	}
+	*ino = current;
+	return 0;
+}
+
+int ext2_readdir(struct ext2_image *image, u32 ino, ext2_readdir_fn *fn,
+                 void *arg) {
+	struct cached_inode *ci = get_inode(image, ino);
+	struct dir_cache *dir = ci ? get_dir(image, ci) : NULL;
+	if (!dir) {
+		return -1;
+	}
+	for (size_t i = 0; i < dir->nentries; ++i) {
+		const struct dir_slot *e = &dir->entries[i];
+		if (fn(arg, dir->names + e->name_off, e->name_len, e->ino)) {
+			break;
+		}
+	}
+	return 0;
+}
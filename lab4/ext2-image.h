@@ -0,0 +1,53 @@
+#ifndef EXT2_IMAGE_H
+#define EXT2_IMAGE_H
+
+/* Reading files out of ext2 images without mounting them.
+
+   An image is opened with ext2_open_image and read with the functions
+   below, which go through a per-image LRU cache of blocks.  Inodes are
+   cached once read, along with the full map from their logical blocks
+   to image blocks and, for directories, a hash table of their entries,
+   so repeated lookups and reads do not walk indirect blocks or scan
+   directories again.  Symlinks in paths are not followed.
+
+   A handle is not safe to use from several threads at once; use one
+   per thread.  Functions that fail return -1 (or NULL) and set errno:
+   EUCLEAN means the image is corrupt.  */
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "ext2.h"
+
+struct ext2_image;
+
+/* Called by ext2_readdir with ARG for each entry of a directory, "."
+   and ".." included.  NAME is not null-terminated.  Return nonzero to
+   stop.  */
+typedef int ext2_readdir_fn(void *arg, const char *name, size_t name_len,
+                            u32 ino);
+
+/* Open the image at PATH with a cache of CACHE_BLOCKS blocks, or a
+   default size if it is 0.  */
+struct ext2_image *ext2_open_image(const char *path, size_t cache_blocks);
+void ext2_close_image(struct ext2_image *image);
+
+/* Store in *INO the inode at PATH, relative to the root.  */
+int ext2_lookup(struct ext2_image *image, const char *path, u32 *ino);
+
+/* Copy inode INO into *INODE.  */
+int ext2_stat(struct ext2_image *image, u32 ino, struct ext2_inode *inode);
+
+/* Return the size of the file INODE.  */
+u64 ext2_inode_size(const struct ext2_inode *inode);
+
+/* Read up to LEN bytes at OFF of the regular file or symlink target of
+   INO into BUF, and return how many were read.  */
+ssize_t ext2_read(struct ext2_image *image, u32 ino, void *buf, size_t len,
+                  u64 off);
+
+/* Call FN with ARG for each entry of directory INO, in on-disk order.  */
+int ext2_readdir(struct ext2_image *image, u32 ino, ext2_readdir_fn *fn,
+                 void *arg);
+
+#endif
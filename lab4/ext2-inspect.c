@@ -0,0 +1,825 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include "ext2-image.h"
+#include "ext2.h"
+
+#define errno_exit(str)                                                        \
+	do { int err = errno; perror(str); exit(err); } while (0)
+
+/* Passed to a block_fn in place of a logical block number for the
+   indirect blocks of a file.  */
+#define INDIRECT_BLOCK UINT64_MAX
+
+/* The image, mapped read-only, and what its superblock says about it.  */
+static int image_fd;
+static const u8 *image;
+static const struct ext2_superblock *sb;
+static const struct ext2_block_group_descriptor *gdt;
+static u32 block_size;
+static u32 groups_count;
+static u32 inode_size;
+
+/* The same image opened through the read library, which resolves paths
+   through its hashed directories.  */
+static struct ext2_image *reader;
+
+static void corrupt(const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	fprintf(stderr, "corrupt image: ");
+	vfprintf(stderr, fmt, ap);
+	fprintf(stderr, "\n");
+	va_end(ap);
+	exit(EINVAL);
+}
+
+static bool block_in_range(u32 blockno) {
+	return blockno >= sb->s_first_data_block && blockno < sb->s_blocks_count;
+}
+
+/* Return where block BLOCKNO of the image is mapped.  */
+static const u8 *block(u32 blockno) {
+	if (!block_in_range(blockno)) {
+		corrupt("block %u out of range", blockno);
+	}
+	return image + (u64) blockno * block_size;
+}
+
+/* Map the image NAME and check that it looks like ext2.  */
+static void open_image(const char *name) {
+	image_fd = open(name, O_RDONLY);
+	if (image_fd == -1) {
+		errno_exit(name);
+	}
+
+	struct stat st;
+	if (fstat(image_fd, &st)) {
+		errno_exit("fstat");
+	}
+	if (st.st_size < SUPERBLOCK_OFFSET + sizeof(struct ext2_superblock)) {
+		fprintf(stderr, "%s: not an ext2 image\n", name);
+		exit(EINVAL);
+	}
+	image = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, image_fd, 0);
+	if (image == MAP_FAILED) {
+		errno_exit("mmap");
+	}
+
+	sb = (const struct ext2_superblock *) (image + SUPERBLOCK_OFFSET);
+	if (sb->s_magic != EXT2_SUPER_MAGIC || sb->s_log_block_size > 6
+	    || !sb->s_blocks_per_group || !sb->s_inodes_per_group
+	    || sb->s_first_data_block >= sb->s_blocks_count) {
+		fprintf(stderr, "%s: not an ext2 image\n", name);
+		exit(EINVAL);
+	}
+	block_size = 1024 << sb->s_log_block_size;
+	groups_count = (sb->s_blocks_count - sb->s_first_data_block
+	                + sb->s_blocks_per_group - 1) / sb->s_blocks_per_group;
+	inode_size = sb->s_rev_level >= EXT2_DYNAMIC_REV
+	             ? sb->s_inode_size : EXT2_GOOD_OLD_INODE_SIZE;
+	if ((u64) sb->s_blocks_count * block_size > (u64) st.st_size) {
+		fprintf(stderr, "%s: image is truncated\n", name);
+		exit(EINVAL);
+	}
+	if (inode_size < EXT2_GOOD_OLD_INODE_SIZE || inode_size > block_size
+	    || block_size % inode_size) {
+		corrupt("bad inode size %u", inode_size);
+	}
+	if (sb->s_inodes_count > (u64) groups_count * sb->s_inodes_per_group) {
+		corrupt("%u inodes, but %u groups of %u", sb->s_inodes_count,
+		        groups_count, sb->s_inodes_per_group);
+	}
+	gdt = (const struct ext2_block_group_descriptor *)
+	      block(sb->s_first_data_block + 1);
+}
+
+static const struct ext2_inode *get_inode(u32 ino) {
+	if (ino < 1 || ino > sb->s_inodes_count) {
+		corrupt("inode %u out of range", ino);
+	}
+	u32 g = (ino - 1) / sb->s_inodes_per_group;
+	if (g >= groups_count) {
+		corrupt("inode %u past the last group", ino);
+	}
+	u64 offset = (u64) ((ino - 1) % sb->s_inodes_per_group) * inode_size;
+	return (const struct ext2_inode *)
+	       (block(gdt[g].bg_inode_table + offset / block_size)
+	        + offset % block_size);
+}
+
+static u16 inode_type(const struct ext2_inode *inode) {
+	return inode->i_mode & 0xF000;
+}
+
+static u64 inode_file_size(const struct ext2_inode *inode) {
+	u64 size = inode->i_size;
+	if (inode_type(inode) == EXT2_S_IFREG) {
+		size |= (u64) inode->i_dir_acl << 32;   /* i_size_high */
+	}
+	return size;
+}
+
+/* Whether the i_block array of INODE maps blocks.  Fast symlinks keep
+   their target there instead, and device nodes their number.  */
+static bool has_blocks(const struct ext2_inode *inode) {
+	switch (inode_type(inode)) {
+	case EXT2_S_IFREG:
+	case EXT2_S_IFDIR:
+		return true;
+	case EXT2_S_IFLNK:
+		return inode->i_blocks != 0;
+	}
+	return false;
+}
+
+/* Called with ARG for each block BLOCKNO of a file: with its logical
+   block number LBLOCK for data, or INDIRECT_BLOCK for indirect blocks.  */
+typedef void block_fn(void *arg, u64 lblock, u32 blockno);
+
+static void walk_indirect(u32 blockno, int depth, u64 lblock,
+                          block_fn *visit, void *arg) {
+	visit(arg, INDIRECT_BLOCK, blockno);
+	if (!block_in_range(blockno)) {
+		return;
+	}
+
+	u32 per_block = block_size / sizeof(u32);
+	u64 span = 1;
+	for (int i = 1; i < depth; ++i) {
+		span *= per_block;
+	}
+	const u32 *entries = (const u32 *) block(blockno);
+	for (u32 i = 0; i < per_block; ++i) {
+		if (!entries[i]) {
+			continue;
+		}
+		if (depth == 1) {
+			visit(arg, lblock + i, entries[i]);
+		} else {
+			walk_indirect(entries[i], depth - 1, lblock + i * span,
+			              visit, arg);
+		}
+	}
+}
+
+/* Call VISIT with ARG for every block of INODE, in logical order.
+   Holes are skipped.  */
+static void walk_blocks(const struct ext2_inode *inode, block_fn *visit,
+                        void *arg) {
+	if (!has_blocks(inode)) {
+		return;
+	}
+	for (u32 i = 0; i < EXT2_NDIR_BLOCKS; ++i) {
+		if (inode->i_block[i]) {
+			visit(arg, i, inode->i_block[i]);
+		}
+	}
+
+	u64 per_block = block_size / sizeof(u32);
+	u64 lblock = EXT2_NDIR_BLOCKS;
+	u64 span = per_block;
+	for (int depth = 1; depth <= 3; ++depth) {
+		if (inode->i_block[EXT2_IND_BLOCK + depth - 1]) {
+			walk_indirect(inode->i_block[EXT2_IND_BLOCK + depth - 1],
+			              depth, lblock, visit, arg);
+		}
+		lblock += span;
+		span *= per_block;
+	}
+}
+
+/* Called with ARG for each entry of a directory.  Return false to stop
+   the walk.  */
+typedef bool dirent_fn(void *arg, const struct ext2_dir_entry *entry,
+                       u32 name_len);
+
+struct dir_walk {
+	dirent_fn *visit;
+	void *arg;
+	u64 size;
+	bool stopped;
+};
+
+static void walk_dir_block(void *arg, u64 lblock, u32 blockno) {
+	struct dir_walk *w = arg;
+	if (lblock == INDIRECT_BLOCK || w->stopped
+	    || lblock * block_size >= w->size) {
+		return;
+	}
+
+	const u8 *b = block(blockno);
+	for (u32 off = 0; off < block_size; ) {
+		const struct ext2_dir_entry *entry =
+			(const struct ext2_dir_entry *) (b + off);
+		u32 name_len = entry->name_len;
+		if (sb->s_feature_incompat & EXT2_FEATURE_INCOMPAT_FILETYPE) {
+			name_len &= 0xff;
+		}
+		if (off + 8 > block_size || entry->rec_len < 8
+		    || entry->rec_len % 4 || off + entry->rec_len > block_size
+		    || 8 + name_len > entry->rec_len) {
+			corrupt("bad directory entry in block %u", blockno);
+		}
+		if (entry->inode && !w->visit(w->arg, entry, name_len)) {
+			w->stopped = true;
+			return;
+		}
+		off += entry->rec_len;
+	}
+}
+
+/* Call VISIT with ARG for each entry of directory DIR.  */
+static void walk_dir(const struct ext2_inode *dir, dirent_fn *visit,
+                     void *arg) {
+	struct dir_walk w = {visit, arg, inode_file_size(dir), false};
+	walk_blocks(dir, walk_dir_block, &w);
+}
+
+/* Return the inode at PATH, relative to the root.  Exit if there is
+   none.  */
+static u32 lookup_path(const char *path) {
+	u32 ino;
+	if (ext2_lookup(reader, path, &ino)) {
+		errno_exit(path);
+	}
+	return ino;
+}
+
+static void print_info() {
+	printf("Block size:        %u\n", block_size);
+	printf("Blocks:            %u (%u free)\n", sb->s_blocks_count,
+	       sb->s_free_blocks_count);
+	printf("Inodes:            %u (%u free)\n", sb->s_inodes_count,
+	       sb->s_free_inodes_count);
+	printf("Block groups:      %u\n", groups_count);
+	printf("Blocks per group:  %u\n", sb->s_blocks_per_group);
+	printf("Inodes per group:  %u\n", sb->s_inodes_per_group);
+	printf("Inode size:        %u\n", inode_size);
+	printf("Revision:          %u\n", sb->s_rev_level);
+	printf("Features:          compat %#x incompat %#x ro_compat %#x\n",
+	       sb->s_feature_compat, sb->s_feature_incompat,
+	       sb->s_feature_ro_compat);
+	printf("Volume name:       %.16s\n", (const char *) sb->s_volume_name);
+}
+
+static int print_entry(void *arg, const char *name, size_t name_len,
+                       u32 ino) {
+	struct ext2_inode inode;
+	if (ext2_stat(reader, ino, &inode)) {
+		errno_exit("stat");
+	}
+	printf("%8u %6o %3u %5u %5u %12llu %.*s\n", ino, inode.i_mode,
+	       inode.i_links_count, inode.i_uid | inode.l_i_uid_high << 16,
+	       inode.i_gid | inode.l_i_gid_high << 16,
+	       (unsigned long long) ext2_inode_size(&inode), (int) name_len, name);
+	return 0;
+}
+
+static void list(const char *path) {
+	u32 ino = lookup_path(path);
+	if (ext2_readdir(reader, ino, print_entry, NULL)) {
+		if (errno != ENOTDIR) {
+			errno_exit(path);
+		}
+		print_entry(NULL, path, strlen(path), ino);
+	}
+}
+
+/* The state of copying a file out of the image: the output, how far
+   into the file it has got, and the run of contiguous blocks not yet
+   copied.  */
+struct copy_out {
+	int out;
+	bool seekable;
+	off_t base;             /* where the file starts in a seekable OUT */
+	u64 size;
+	u64 pos;
+	u64 run_lblock;
+	u32 run_start;
+	u32 run_count;
+};
+
+/* Bring the output of C up to byte TARGET of the file: by seeking, so
+   that the gap is a hole, if the output is a regular file, and by
+   writing zeroes otherwise.  */
+static void fill_to(struct copy_out *c, u64 target) {
+	static const u8 zeroes[65536];
+	if (c->seekable) {
+		if (lseek(c->out, c->base + target, SEEK_SET) == -1) {
+			errno_exit("lseek");
+		}
+		c->pos = target;
+		return;
+	}
+	while (c->pos < target) {
+		size_t n = target - c->pos < sizeof(zeroes)
+		           ? target - c->pos : sizeof(zeroes);
+		ssize_t written = write(c->out, zeroes, n);
+		if (written < 0) {
+			errno_exit("write");
+		}
+		c->pos += written;
+	}
+}
+
+/* Copy the pending run of C with sendfile, which moves it from the page
+   cache of the image without bringing it into userspace.  */
+static void flush_run(struct copy_out *c) {
+	if (!c->run_count) {
+		return;
+	}
+	u64 start = c->run_lblock * block_size;
+	c->run_count = start < c->size ? c->run_count : 0;
+	if (!c->run_count) {
+		return;
+	}
+	u64 len = (u64) c->run_count * block_size;
+	if (len > c->size - start) {
+		len = c->size - start;
+	}
+	fill_to(c, start);
+
+	off_t offset = (off_t) c->run_start * block_size;
+	block(c->run_start + c->run_count - 1);     /* check the range */
+	while (len) {
+		ssize_t n = sendfile(c->out, image_fd, &offset, len);
+		if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+			/* An output sendfile cannot write to, such as an
+			   O_APPEND file: write from the mapping instead.  */
+			n = write(c->out, image + offset, len);
+			if (n > 0) {
+				offset += n;
+			}
+		}
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			errno_exit("sendfile");
+		}
+		if (n == 0) {
+			corrupt("image shrank while reading");
+		}
+		len -= n;
+		c->pos += n;
+	}
+	c->run_count = 0;
+}
+
+static void copy_out_block(void *arg, u64 lblock, u32 blockno) {
+	struct copy_out *c = arg;
+	if (lblock == INDIRECT_BLOCK) {
+		return;
+	}
+	if (c->run_count && lblock == c->run_lblock + c->run_count
+	    && blockno == c->run_start + c->run_count) {
+		c->run_count++;
+		return;
+	}
+	flush_run(c);
+	c->run_lblock = lblock;
+	c->run_start = blockno;
+	c->run_count = 1;
+}
+
+/* Write the contents of INODE to OUT.  */
+static void copy_out(const struct ext2_inode *inode, int out) {
+	struct stat st;
+	if (fstat(out, &st)) {
+		errno_exit("fstat");
+	}
+	struct copy_out c = {
+		.out = out,
+		.seekable = S_ISREG(st.st_mode),
+		.size = inode_file_size(inode),
+	};
+	if (c.seekable) {
+		c.base = lseek(out, 0, SEEK_CUR);
+		if (c.base == -1) {
+			errno_exit("lseek");
+		}
+	}
+
+	if (inode_type(inode) == EXT2_S_IFLNK && !has_blocks(inode)) {
+		if (write(out, inode->i_block, c.size) != (ssize_t) c.size) {
+			errno_exit("write");
+		}
+		return;
+	}
+	walk_blocks(inode, copy_out_block, &c);
+	flush_run(&c);
+	fill_to(&c, c.size);
+	if (c.seekable && ftruncate(out, c.base + c.size)) {
+		errno_exit("ftruncate");
+	}
+}
+
+static void extract(u32 ino, const char *dest);
+
+static bool extract_entry(void *arg, const struct ext2_dir_entry *entry,
+                          u32 name_len) {
+	const char *dir = arg;
+	const char *name = (const char *) entry->name;
+	if ((name_len == 1 && name[0] == '.')
+	    || (name_len == 2 && name[0] == '.' && name[1] == '.')) {
+		return true;
+	}
+
+	char *path = malloc(strlen(dir) + name_len + 2);
+	if (!path) {
+		errno_exit("malloc");
+	}
+	sprintf(path, "%s/%.*s", dir, (int) name_len, name);
+	extract(entry->inode, path);
+	free(path);
+	return true;
+}
+
+/* Recreate inode INO, and everything under it if it is a directory, at
+   the host path DEST.  */
+static void extract(u32 ino, const char *dest) {
+	const struct ext2_inode *inode = get_inode(ino);
+	mode_t perm = inode->i_mode & 07777;
+
+	switch (inode_type(inode)) {
+	case EXT2_S_IFREG: {
+		int fd = open(dest, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		if (fd == -1) {
+			errno_exit(dest);
+		}
+		copy_out(inode, fd);
+		if (fchmod(fd, perm) || close(fd)) {
+			errno_exit(dest);
+		}
+		break;
+	}
+	case EXT2_S_IFDIR:
+		if (mkdir(dest, 0700) && errno != EEXIST) {
+			errno_exit(dest);
+		}
+		walk_dir(inode, extract_entry, (void *) dest);
+		if (chmod(dest, perm)) {
+			errno_exit(dest);
+		}
+		break;
+	case EXT2_S_IFLNK: {
+		u64 size = inode_file_size(inode);
+		if (size >= block_size) {
+			corrupt("inode %u: symlink too long", ino);
+		}
+		char target[size + 1];
+		memcpy(target, has_blocks(inode) ? block(inode->i_block[0])
+		                                 : (const u8 *) inode->i_block,
+		       size);
+		target[size] = '\0';
+		if (symlink(target, dest)) {
+			errno_exit(dest);
+		}
+		break;
+	}
+	case EXT2_S_IFCHR:
+	case EXT2_S_IFBLK:
+	case EXT2_S_IFIFO:
+	case EXT2_S_IFSOCK: {
+		u32 old = inode->i_block[0];
+		u32 new = inode->i_block[1];
+		dev_t dev = old ? makedev(old >> 8 & 0xff, old & 0xff)
+		                : makedev((new & 0xfff00) >> 8,
+		                          (new & 0xff) | (new >> 12 & 0xfff00));
+		mode_t type = inode_type(inode) == EXT2_S_IFCHR ? S_IFCHR
+		              : inode_type(inode) == EXT2_S_IFBLK ? S_IFBLK
+		              : inode_type(inode) == EXT2_S_IFIFO ? S_IFIFO
+		              : S_IFSOCK;
+		if (mknod(dest, type | perm, dev)) {
+			errno_exit(dest);
+		}
+		break;
+	}
+	default:
+		corrupt("inode %u: bad mode %o", ino, inode->i_mode);
+	}
+
+	struct timespec times[2] = {
+		{.tv_sec = inode->i_atime},
+		{.tv_sec = inode->i_mtime},
+	};
+	if (utimensat(AT_FDCWD, dest, times, AT_SYMLINK_NOFOLLOW)) {
+		errno_exit(dest);
+	}
+}
+
+/* What the consistency check has found: a bit for every block in use,
+   and the inodes and directories in use in each group.  Groups are
+   checked by several threads at once, which take them in turn from
+   NEXT.  */
+struct check {
+	atomic_uint next;
+	_Atomic u64 *used_blocks;
+	u32 *used_inodes;
+	u32 *used_dirs;
+	atomic_uint problems;
+};
+
+static struct check check;
+
+static void problem(const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	atomic_fetch_add(&check.problems, 1);
+	vfprintf(stdout, fmt, ap);
+	printf("\n");
+	va_end(ap);
+}
+
+static bool bit_set(const u8 *bitmap, u32 i) {
+	return bitmap[i / 8] >> (i % 8) & 1;
+}
+
+static bool group_has_super(u32 g) {
+	if (g <= 1 || !(sb->s_feature_ro_compat
+	                & EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER)) {
+		return true;
+	}
+	for (u32 base = 3; base <= 7; base += 2) {
+		u64 n = base;
+		while (n < g) {
+			n *= base;
+		}
+		if (n == g) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Mark block BLOCKNO in use by inode INO, or by the file system's own
+   metadata if INO is 0.  */
+static void mark_block(u32 blockno, u32 ino) {
+	if (!block_in_range(blockno)) {
+		problem("inode %u: block %u out of range", ino, blockno);
+		return;
+	}
+	u64 mask = 1ULL << (blockno % 64);
+	if (atomic_fetch_or(&check.used_blocks[blockno / 64], mask) & mask) {
+		problem("block %u is in use twice (inode %u)", blockno, ino);
+	}
+}
+
+struct inode_blocks {
+	u32 ino;
+	u32 count;
+};
+
+static void mark_inode_block(void *arg, u64 lblock, u32 blockno) {
+	struct inode_blocks *b = arg;
+	mark_block(blockno, b->ino);
+	b->count++;
+}
+
+/* Check the inodes of group G against its inode bitmap, and mark the
+   blocks of the group's metadata and inodes in use.  */
+static void check_group_inodes(u32 g) {
+	u32 first_block = sb->s_first_data_block + g * sb->s_blocks_per_group;
+	if (group_has_super(g)) {
+		u32 gdt_blocks = (groups_count * sizeof(*gdt) + block_size - 1)
+		                 / block_size;
+		for (u32 i = 0; i <= gdt_blocks; ++i) {
+			mark_block(first_block + i, 0);
+		}
+	}
+	mark_block(gdt[g].bg_block_bitmap, 0);
+	mark_block(gdt[g].bg_inode_bitmap, 0);
+	u32 table_blocks = ((u64) sb->s_inodes_per_group * inode_size
+	                    + block_size - 1) / block_size;
+	for (u32 i = 0; i < table_blocks; ++i) {
+		mark_block(gdt[g].bg_inode_table + i, 0);
+	}
+
+	const u8 *bitmap = block(gdt[g].bg_inode_bitmap);
+	u32 first_ino = sb->s_rev_level >= EXT2_DYNAMIC_REV
+	                ? sb->s_first_ino : EXT2_GOOD_OLD_FIRST_INO;
+	u32 wrong = 0;
+	for (u32 i = 0; i < sb->s_inodes_per_group; ++i) {
+		u32 ino = g * sb->s_inodes_per_group + i + 1;
+		if (ino > sb->s_inodes_count) {
+			break;
+		}
+		const struct ext2_inode *inode = get_inode(ino);
+		bool in_use = ino < first_ino || inode->i_links_count > 0;
+		if (in_use != bit_set(bitmap, i)) {
+			wrong++;
+		}
+		if (!in_use) {
+			continue;
+		}
+
+		check.used_inodes[g]++;
+		if (inode_type(inode) == EXT2_S_IFDIR) {
+			check.used_dirs[g]++;
+		}
+		struct inode_blocks b = {ino, 0};
+		walk_blocks(inode, mark_inode_block, &b);
+		if (inode->i_blocks != (u64) b.count * (block_size / 512)) {
+			problem("inode %u: i_blocks is %u, should be %llu", ino,
+			        inode->i_blocks,
+			        (unsigned long long) b.count * (block_size / 512));
+		}
+	}
+
+	if (wrong) {
+		problem("group %u: %u inodes wrong in the inode bitmap", g, wrong);
+	}
+	if (gdt[g].bg_free_inodes_count
+	    != sb->s_inodes_per_group - check.used_inodes[g]) {
+		problem("group %u: %u free inodes, should be %u", g,
+		        gdt[g].bg_free_inodes_count,
+		        sb->s_inodes_per_group - check.used_inodes[g]);
+	}
+	if (gdt[g].bg_used_dirs_count != check.used_dirs[g]) {
+		problem("group %u: %u directories, should be %u", g,
+		        gdt[g].bg_used_dirs_count, check.used_dirs[g]);
+	}
+}
+
+/* Check the block bitmap and free block count of group G against the
+   blocks found in use.  */
+static void check_group_blocks(u32 g) {
+	u32 first_block = sb->s_first_data_block + g * sb->s_blocks_per_group;
+	u32 nblocks = sb->s_blocks_count - first_block < sb->s_blocks_per_group
+	              ? sb->s_blocks_count - first_block : sb->s_blocks_per_group;
+	const u8 *bitmap = block(gdt[g].bg_block_bitmap);
+
+	u32 used = 0;
+	u32 wrong = 0;
+	for (u32 i = 0; i < nblocks; ++i) {
+		u32 blockno = first_block + i;
+		bool in_use = check.used_blocks[blockno / 64] >> (blockno % 64) & 1;
+		used += in_use;
+		if (in_use != bit_set(bitmap, i)) {
+			wrong++;
+		}
+	}
+	for (u32 i = nblocks; i < sb->s_blocks_per_group; ++i) {
+		if (!bit_set(bitmap, i)) {
+			wrong++;
+		}
+	}
+
+	if (wrong) {
+		problem("group %u: %u blocks wrong in the block bitmap", g, wrong);
+	}
+	if (gdt[g].bg_free_blocks_count != nblocks - used) {
+		problem("group %u: %u free blocks, should be %u", g,
+		        gdt[g].bg_free_blocks_count, nblocks - used);
+	}
+}
+
+static void *check_worker(void *arg) {
+	void (*check_group)(u32) = arg;
+	u32 g;
+	while ((g = atomic_fetch_add(&check.next, 1)) < groups_count) {
+		check_group(g);
+	}
+	return NULL;
+}
+
+/* Run CHECK_GROUP on every group, on JOBS threads.  */
+static void check_groups(void (*check_group)(u32), int jobs) {
+	atomic_store(&check.next, 0);
+	pthread_t workers[jobs];
+	for (int i = 0; i < jobs; ++i) {
+		int err = pthread_create(&workers[i], NULL, check_worker,
+		                         (void *) check_group);
+		if (err) {
+			errno = err;
+			errno_exit("pthread_create");
+		}
+	}
+	for (int i = 0; i < jobs; ++i) {
+		pthread_join(workers[i], NULL);
+	}
+}
+
+/* Check the bitmaps and counts of the image against what its inodes
+   actually use.  Return the number of problems found.  */
+static u32 check_image(const char *name, int jobs) {
+	check.used_blocks = calloc((sb->s_blocks_count + 63) / 64, sizeof(u64));
+	check.used_inodes = calloc(groups_count, sizeof(u32));
+	check.used_dirs = calloc(groups_count, sizeof(u32));
+	if (!check.used_blocks || !check.used_inodes || !check.used_dirs) {
+		errno_exit("calloc");
+	}
+	for (u32 b = 0; b < sb->s_first_data_block; ++b) {
+		check.used_blocks[b / 64] |= 1ULL << (b % 64);
+	}
+	if (sb->s_inodes_count != (u64) groups_count * sb->s_inodes_per_group) {
+		problem("superblock: %u inodes, should be %u groups of %u",
+		        sb->s_inodes_count, groups_count, sb->s_inodes_per_group);
+	}
+
+	/* Every block has to be marked before any bitmap is compared.  */
+	check_groups(check_group_inodes, jobs);
+	check_groups(check_group_blocks, jobs);
+
+	u64 used_blocks = 0;
+	u64 used_inodes = 0;
+	for (u32 w = 0; w < (sb->s_blocks_count + 63) / 64; ++w) {
+		used_blocks += __builtin_popcountll(check.used_blocks[w]);
+	}
+	used_blocks -= sb->s_first_data_block;
+	for (u32 g = 0; g < groups_count; ++g) {
+		used_inodes += check.used_inodes[g];
+	}
+	u32 data_blocks = sb->s_blocks_count - sb->s_first_data_block;
+	if (sb->s_free_blocks_count != data_blocks - used_blocks) {
+		problem("superblock: %u free blocks, should be %llu",
+		        sb->s_free_blocks_count,
+		        (unsigned long long) (data_blocks - used_blocks));
+	}
+	if (sb->s_free_inodes_count != sb->s_inodes_count - used_inodes) {
+		problem("superblock: %u free inodes, should be %llu",
+		        sb->s_free_inodes_count,
+		        (unsigned long long) (sb->s_inodes_count - used_inodes));
+	}
+
+	printf("%s: %llu/%u files, %llu/%u blocks, %u problems\n", name,
+	       (unsigned long long) used_inodes, sb->s_inodes_count,
+	       (unsigned long long) used_blocks + sb->s_first_data_block,
+	       sb->s_blocks_count, atomic_load(&check.problems));
+	return atomic_load(&check.problems);
+}
+
+static void usage(const char *argv0) {
+	fprintf(stderr, "usage: %s [-j jobs] image info\n"
+	        "       %s image ls [path]\n"
+	        "       %s image cat path\n"
+	        "       %s image extract path destination\n"
+	        "       %s [-j jobs] image check\n",
+	        argv0, argv0, argv0, argv0, argv0);
+	exit(EINVAL);
+}
+
+int main(int argc, char *argv[]) {
+	long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+
+	int opt;
+	while ((opt = getopt(argc, argv, "+j:")) != -1) {
+		switch (opt) {
+		case 'j':
+			jobs = strtol(optarg, NULL, 10);
+			if (jobs < 1 || jobs > 1024) {
+				usage(argv[0]);
+			}
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (jobs < 1) {
+		jobs = 1;
+	}
+	if (argc - optind < 2) {
+		usage(argv[0]);
+	}
+
+	const char *name = argv[optind];
+	const char *command = argv[optind + 1];
+	int nargs = argc - optind - 2;
+	char **args = argv + optind + 2;
+	open_image(name);
+	reader = ext2_open_image(name, 0);
+	if (!reader) {
+		errno_exit(name);
+	}
+
+	if (strcmp(command, "info") == 0 && nargs == 0) {
+		print_info();
+	} else if (strcmp(command, "ls") == 0 && nargs <= 1) {
+		list(nargs ? args[0] : "/");
+	} else if (strcmp(command, "cat") == 0 && nargs == 1) {
+		copy_out(get_inode(lookup_path(args[0])), STDOUT_FILENO);
+	} else if (strcmp(command, "extract") == 0 && nargs == 2) {
+		extract(lookup_path(args[0]), args[1]);
+	} else if (strcmp(command, "check") == 0 && nargs == 0) {
+		return check_image(name, jobs) ? 1 : 0;
+	} else {
+		usage(argv[0]);
+	}
+	return 0;
+}
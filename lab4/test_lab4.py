@@ -35,3 +35,262 @@ class Lab4TestCase(unittest.TestCase):
     def test_hello_world(self):
         with open('mnt/hello-world') as f:
             self.assertEqual(f.read(), "Hello world\n")
+
+    def test_multi_group_image(self):
+        subprocess.run(['./ext2-create', '-s', '256M', '-b', '4096',
+                        '-o', 'multi-group.img'], check=True)
+        p = subprocess.run(['fsck.ext2', '-f', '-n', 'multi-group.img'],
+                           capture_output=True, text=True)
+        os.remove('multi-group.img')
+        self.assertEqual(p.returncode, 0, msg=p.stdout)
+
+    def test_inodes_past_group_boundary(self):
+        # 8200K spills 8 blocks into a second group, which is dropped;
+        # the inodes must still follow -i.
+        counts = {}
+        for size in ('8193K', '8200K'):
+            subprocess.run(['./ext2-create', '-s', size, '-b', '1024',
+                            '-i', '8192', '-o', 'boundary.img'], check=True)
+            p = subprocess.run(['./ext2-inspect', 'boundary.img', 'info'],
+                               capture_output=True, text=True)
+            os.remove('boundary.img')
+            counts[size] = int(p.stdout.split('Inodes:')[1].split()[0])
+        self.assertGreaterEqual(counts['8193K'], 8193 * 1024 // 8192)
+        self.assertGreaterEqual(counts['8200K'], 8200 * 1024 // 8192)
+
+    def test_parallel_build(self):
+        # Enough files to fill the inodes of several groups.
+        for i in range(40):
+            os.makedirs(f'parallel/dir-{i}', exist_ok=True)
+            for j in range(50):
+                with open(f'parallel/dir-{i}/file-{j}', 'wb') as f:
+                    f.write(os.urandom(i * 1000 + j))
+        data = os.urandom(3000000)
+        with open('parallel/big', 'wb') as f:
+            f.write(data)
+        subprocess.run(['./ext2-create', '-d', 'parallel', '-s', '64M',
+                        '-j', '4', '-o', 'parallel.img'], check=True)
+        p = subprocess.run(['fsck.ext2', '-f', '-n', 'parallel.img'],
+                           capture_output=True, text=True)
+        q = subprocess.run(['debugfs', '-R', 'cat /big', 'parallel.img'],
+                           capture_output=True)
+        subprocess.run(['rm', '-rf', 'parallel', 'parallel.img'])
+        self.assertEqual(p.returncode, 0, msg=p.stdout)
+        self.assertEqual(q.stdout, data)
+
+    def test_incremental_build(self):
+        os.makedirs('inc/dir', exist_ok=True)
+        for name in ['a', 'b', 'c']:
+            with open(f'inc/dir/{name}', 'wb') as f:
+                f.write(os.urandom(50000))
+        command = ['./ext2-create', '-d', 'inc', '-s', '4M',
+                   '-m', 'inc.manifest', '-o', 'inc.img']
+        subprocess.run(command, check=True)
+        data = os.urandom(70000)
+        with open('inc/dir/a', 'wb') as f:
+            f.write(data)
+        os.remove('inc/dir/b')
+        os.symlink('dir/c', 'inc/link')
+        subprocess.run(command, check=True)
+        p = subprocess.run(['fsck.ext2', '-f', '-n', 'inc.img'],
+                           capture_output=True, text=True)
+        q = subprocess.run(['debugfs', '-R', 'cat /dir/a', 'inc.img'],
+                           capture_output=True)
+        r = subprocess.run(['debugfs', '-R', 'ls /dir', 'inc.img'],
+                           capture_output=True, text=True)
+        subprocess.run(['rm', '-rf', 'inc', 'inc.img', 'inc.manifest'])
+        self.assertEqual(p.returncode, 0, msg=p.stdout)
+        self.assertEqual(q.stdout, data)
+        self.assertNotIn('b', r.stdout.split())
+
+    def test_stale_manifest(self):
+        # A build without -m leaves the manifest describing an image
+        # that is no longer there.
+        os.makedirs('stale', exist_ok=True)
+        for name in ['a', 'b', 'c']:
+            with open(f'stale/{name}', 'wb') as f:
+                f.write(os.urandom(30000))
+        command = ['./ext2-create', '-d', 'stale', '-s', '4M',
+                   '-o', 'stale.img']
+        subprocess.run(command + ['-m', 'stale.manifest'], check=True)
+        os.makedirs('stale/dir')
+        open('stale/dir/file', 'w').close()
+        subprocess.run(command, check=True)
+        data = os.urandom(40000)
+        with open('stale/b', 'wb') as f:
+            f.write(data)
+        p = subprocess.run(command + ['-m', 'stale.manifest'],
+                           capture_output=True, text=True)
+        q = subprocess.run(['fsck.ext2', '-f', '-n', 'stale.img'],
+                           capture_output=True, text=True)
+        r = subprocess.run(['debugfs', '-R', 'cat /b', 'stale.img'],
+                           capture_output=True)
+        subprocess.run(['rm', '-rf', 'stale', 'stale.img', 'stale.manifest'])
+        self.assertEqual(p.returncode, 0, msg=p.stderr)
+        self.assertIn('building from scratch', p.stderr)
+        self.assertEqual(q.returncode, 0, msg=q.stdout)
+        self.assertEqual(r.stdout, data)
+
+    def test_reproducible_build(self):
+        os.makedirs('repro/dir', exist_ok=True)
+        with open('repro/dir/data', 'wb') as f:
+            f.write(os.urandom(20000) + bytes(100000) + os.urandom(20000))
+        images = []
+        for name in ['repro1.img', 'repro2.img']:
+            subprocess.run(['./ext2-create', '-T', '1700000000', '-D',
+                            '-d', 'repro', '-o', name], check=True)
+            with open(name, 'rb') as f:
+                images.append(f.read())
+            os.utime('repro/dir/data')
+        p = subprocess.run(['fsck.ext2', '-f', '-n', 'repro1.img'],
+                           capture_output=True, text=True)
+        q = subprocess.run(['debugfs', '-R', 'stat /dir/data', 'repro1.img'],
+                           capture_output=True, text=True)
+        subprocess.run(['rm', '-rf', 'repro', 'repro1.img', 'repro2.img'])
+        self.assertEqual(p.returncode, 0, msg=p.stdout)
+        self.assertEqual(images[0], images[1])
+        self.assertIn('TOTAL: 41', q.stdout)
+
+    def test_writers(self):
+        os.makedirs('writers/dir', exist_ok=True)
+        for i in range(50):
+            with open('writers/dir/f%d' % i, 'wb') as f:
+                f.write(os.urandom(i * 300 + 1))
+        images = []
+        for writer in ['copy', 'pwrite', 'write', 'pwritev', 'mmap', 'io_uring']:
+            p = subprocess.run(['./ext2-create', '-T', '1700000000', '-w', writer,
+                                '-q', '4', '-v', '-d', 'writers', '-o', 'writers.img'],
+                               capture_output=True, text=True)
+            # io_uring falls back to pwritev where the kernel lacks it.
+            self.assertIn('io_syscalls=', p.stderr)
+            with open('writers.img', 'rb') as f:
+                images.append(f.read())
+        subprocess.run(['rm', '-rf', 'writers', 'writers.img'])
+        for image in images[1:]:
+            self.assertEqual(image, images[0])
+
+    def test_populate_from_directory(self):
+        os.makedirs('tree/dir', exist_ok=True)
+        data = os.urandom(300000)
+        with open('tree/dir/data', 'wb') as f:
+            f.write(data)
+        os.symlink('dir/data', 'tree/link')
+        subprocess.run(['./ext2-create', '-d', 'tree', '-o', 'tree.img'],
+                       check=True)
+        p = subprocess.run(['fsck.ext2', '-f', '-n', 'tree.img'],
+                           capture_output=True, text=True)
+        q = subprocess.run(['debugfs', '-R', 'cat /dir/data', 'tree.img'],
+                           capture_output=True)
+        r = subprocess.run(['debugfs', '-R', 'stat /link', 'tree.img'],
+                           capture_output=True, text=True)
+        subprocess.run(['rm', '-rf', 'tree', 'tree.img'])
+        self.assertEqual(p.returncode, 0, msg=p.stdout)
+        self.assertEqual(q.stdout, data)
+        self.assertIn('Fast link dest: "dir/data"', r.stdout)
+
+    def test_hard_links_and_owners(self):
+        os.makedirs('tree/dir', exist_ok=True)
+        with open('tree/data', 'w') as f:
+            f.write('shared\n')
+        os.link('tree/data', 'tree/dir/data')
+        if os.geteuid() == 0:
+            os.chown('tree/data', 70000, 70001)
+        subprocess.run(['./ext2-create', '-d', 'tree', '-o', 'tree.img'],
+                       check=True)
+        p = subprocess.run(['fsck.ext2', '-f', '-n', 'tree.img'],
+                           capture_output=True, text=True)
+        q = subprocess.run(['debugfs', '-R', 'stat /dir/data', 'tree.img'],
+                           capture_output=True, text=True)
+        r = subprocess.run(['debugfs', '-R', 'ls -l /', 'tree.img'],
+                           capture_output=True, text=True)
+        subprocess.run(['rm', '-rf', 'tree', 'tree.img'])
+        self.assertEqual(p.returncode, 0, msg=p.stdout)
+        self.assertIn('Links: 2', q.stdout)
+        ino = q.stdout.split()[1]
+        self.assertIn(ino, r.stdout.split())
+        if os.geteuid() == 0:
+            self.assertIn('User: 70000   Group: 70001', q.stdout)
+
+    def test_tree_deeper_than_path_max(self):
+        # Made with directory fds, since the deepest path is past
+        # PATH_MAX.
+        os.mkdir('deep')
+        fd = os.open('deep', os.O_RDONLY)
+        for i in range(300):
+            os.mkdir(f'directory-{i:04}', dir_fd=fd)
+            next_fd = os.open(f'directory-{i:04}', os.O_RDONLY, dir_fd=fd)
+            os.close(fd)
+            fd = next_fd
+        data = os.urandom(10000)
+        out = os.open('data', os.O_WRONLY | os.O_CREAT, 0o644, dir_fd=fd)
+        os.write(out, data)
+        os.close(out)
+        os.close(fd)
+        subprocess.run(['./ext2-create', '-d', 'deep', '-s', '8M',
+                        '-o', 'deep.img'], check=True)
+        p = subprocess.run(['fsck.ext2', '-f', '-n', 'deep.img'],
+                           capture_output=True, text=True)
+        path = ''.join(f'/directory-{i:04}' for i in range(300))
+        q = subprocess.run(['debugfs', '-R', f'cat {path}/data', 'deep.img'],
+                           capture_output=True)
+        subprocess.run(['rm', '-rf', 'deep', 'deep.img'])
+        self.assertEqual(p.returncode, 0, msg=p.stdout)
+        self.assertEqual(q.stdout, data)
+
+    def test_indexed_directory(self):
+        os.makedirs('big', exist_ok=True)
+        for i in range(2000):
+            open(f'big/file-{i}', 'w').close()
+        subprocess.run(['./ext2-create', '-s', '16M', '-d', 'big',
+                        '-o', 'big.img'],
+                       check=True)
+        p = subprocess.run(['fsck.ext2', '-f', '-n', 'big.img'],
+                           capture_output=True, text=True)
+        q = subprocess.run(['debugfs', '-R', 'htree /', 'big.img'],
+                           capture_output=True, text=True)
+        r = subprocess.run(['debugfs', '-R', 'stat /file-1234', 'big.img'],
+                           capture_output=True, text=True)
+        subprocess.run(['rm', '-rf', 'big', 'big.img'])
+        self.assertEqual(p.returncode, 0, msg=p.stdout)
+        self.assertIn('Hash Version: 1', q.stdout)
+        self.assertIn('Type: regular', r.stdout)
+
+    def test_inspect(self):
+        p = subprocess.run(['./ext2-inspect', 'cs111-base.img', 'check'],
+                           capture_output=True, text=True)
+        self.assertEqual(p.returncode, 0, msg=p.stdout)
+        p = subprocess.run(['./ext2-inspect', 'cs111-base.img', 'cat',
+                            '/hello-world'], capture_output=True, text=True)
+        self.assertEqual(p.stdout, 'Hello world\n')
+
+    def test_inspect_inodes_per_group(self):
+        # s_inodes_per_group is at byte 40 of the superblock.
+        subprocess.run(['./ext2-create', '-o', 'bad.img'], check=True)
+        with open('bad.img', 'r+b') as f:
+            f.seek(1024 + 40)
+            f.write((1).to_bytes(4, 'little'))
+        p = subprocess.run(['./ext2-inspect', 'bad.img', 'ls', '/'],
+                           capture_output=True, text=True)
+        q = subprocess.run(['./ext2-inspect', 'bad.img', 'check'],
+                           capture_output=True, text=True)
+        os.remove('bad.img')
+        self.assertNotEqual(p.returncode, 0)
+        self.assertIn('corrupt image', p.stderr)
+        self.assertNotEqual(q.returncode, 0)
+
+    def test_inspect_extract(self):
+        os.makedirs('tree/dir', exist_ok=True)
+        data = os.urandom(300000)
+        with open('tree/dir/data', 'wb') as f:
+            f.write(data)
+        os.symlink('dir/data', 'tree/link')
+        subprocess.run(['./ext2-create', '-d', 'tree', '-o', 'tree.img'],
+                       check=True)
+        subprocess.run(['./ext2-inspect', 'tree.img', 'extract', '/', 'out'],
+                       check=True)
+        with open('out/dir/data', 'rb') as f:
+            extracted = f.read()
+        link = os.readlink('out/link')
+        subprocess.run(['rm', '-rf', 'tree', 'tree.img', 'out'])
+        self.assertEqual(extracted, data)
+        self.assertEqual(link, 'dir/data')